@@ -13,6 +13,7 @@ enum class [[nodiscard]] ReturnCode {
 	QFAM_NOT_FOUND,
 	SHADER_CREATION_ERROR,
 	FILE_NOT_FOUND,
+	FORMAT_NOT_SUPPORTED,
 	UNKNOWN,
 	COUNT,
 };
@@ -17,6 +17,10 @@
 #include <deque>
 #include <functional>
 #include <array>
+#include <atomic>
+#include <limits>
+#include <chrono>
+#include <memory>
 
 #include <vulkan/vulkan.h>
 #include <vk_mem_alloc.h>
@@ -47,7 +51,24 @@
     } while(0)
 
 namespace kvk {
-    static constexpr std::uint32_t MAX_IN_FLIGHT_FRAMES = 1;
+    // Upper bound of InitSettings::framesInFlight, sizes the per-frame arrays
+    static constexpr std::uint32_t MAX_IN_FLIGHT_FRAMES = 3;
+
+    // Host clock GPU timestamps are calibrated against, the one std::chrono::steady_clock reads
+#if defined(_WIN32)
+    static constexpr VkTimeDomainKHR HOST_TIME_DOMAIN = VK_TIME_DOMAIN_QUERY_PERFORMANCE_COUNTER_KHR;
+#else
+    static constexpr VkTimeDomainKHR HOST_TIME_DOMAIN = VK_TIME_DOMAIN_CLOCK_MONOTONIC_KHR;
+#endif
+
+    // How endFrame hands images to the display. Modes fall back to FIFO when unsupported
+    enum class PresentPolicy : std::uint8_t {
+        UNCAPPED,     // IMMEDIATE, else MAILBOX: tears, highest throughput
+        MAILBOX,      // newest finished frame at every vblank, no tearing
+        VSYNC,        // FIFO, every frame is shown
+        LOW_LATENCY,  // FIFO paced with VK_KHR_present_wait: one frame queued at most and recording
+                      // starts as late as the measured frame time allows. VSYNC without the extension
+    };
 
     struct InitSettings {
         const char*   appName;
@@ -61,6 +82,9 @@ namespace kvk {
 #else
         GLFWwindow* window;
 #endif
+        // Frames the CPU may record ahead of the GPU, 1 to MAX_IN_FLIGHT_FRAMES
+        std::uint32_t framesInFlight = 2;
+        PresentPolicy presentPolicy  = PresentPolicy::UNCAPPED;
     };
 
     struct Pipeline {
@@ -86,6 +110,63 @@ namespace kvk {
         }
     };
 
+    struct BarrierBatch;
+
+    // How the next commands are going to access an image, see require()
+    enum class ImageUsage : std::uint8_t {
+        UNDEFINED,
+        TRANSFER_SRC,
+        TRANSFER_DST,
+        SAMPLED_GRAPHICS,
+        SAMPLED_COMPUTE,
+        STORAGE_READ_COMPUTE,
+        STORAGE_WRITE_COMPUTE,
+        COLOR_ATTACHMENT,
+        DEPTH_ATTACHMENT,
+        DEPTH_READ,
+        PRESENT,
+
+        COUNT
+    };
+
+    // Last known state of one subresource. stage / access accumulate every read since the last write
+    // so the next write waits for all of them. visibleStage / visibleAccess are what the barriers since
+    // that write made its contents visible to, a reader outside of them still needs one.
+    struct ImageState {
+        VkImageLayout         layout        = VK_IMAGE_LAYOUT_UNDEFINED;
+        VkPipelineStageFlags2 stage         = VK_PIPELINE_STAGE_2_NONE;
+        VkAccessFlags2        access        = 0;
+        VkPipelineStageFlags2 visibleStage  = VK_PIPELINE_STAGE_2_NONE;
+        VkAccessFlags2        visibleAccess = 0;
+        std::uint32_t         queueFamily   = VK_QUEUE_FAMILY_IGNORED;
+    };
+
+    struct ImageRange {
+        std::uint32_t baseMip    = 0;
+        std::uint32_t mipCount   = VK_REMAINING_MIP_LEVELS;
+        std::uint32_t baseLayer  = 0;
+        std::uint32_t layerCount = VK_REMAINING_ARRAY_LAYERS;
+    };
+
+    // A view of part of an image, see imageView(). format UNDEFINED means the image format
+    // and aspect 0 the aspect that format implies
+    struct ImageViewKey {
+        VkImageViewType    type   = VK_IMAGE_VIEW_TYPE_2D;
+        VkFormat           format = VK_FORMAT_UNDEFINED;
+        ImageRange         range  = {};
+        VkImageAspectFlags aspect = 0;
+    };
+
+    struct ImageViewCache {
+        struct Entry {
+            ImageViewKey key;
+            VkImageView  view;
+        };
+
+        std::mutex         mutex;
+        std::vector<Entry> entries;
+    };
+
     struct AllocatedImage {
         VkImage           image = VK_NULL_HANDLE;
         VkImageView       view;
@@ -95,6 +176,11 @@ namespace kvk {
         VkImageUsageFlags usage;
         u8                mipCount;
         u8                layerCount;
+        // mipCount * layerCount entries indexed by layer * mipCount + mip, shared by every copy of the
+        // image. Null for images createImage did not make, require treats those as untracked
+        std::shared_ptr<ImageState[]>   states;
+        // Views beyond the default one, destroyImage destroys them and empties the cache for every copy
+        std::shared_ptr<ImageViewCache> views;
     };
 
     struct AllocatedBuffer {
@@ -364,6 +450,53 @@ namespace kvk {
         }
     };
 
+    // Everything VkSamplerCreateInfo can describe plus the reduction mode from
+    // VkSamplerReductionModeCreateInfo, pNext is not part of the key
+    // maxAnisotropy and compareOp only count while their feature is enabled, SamplerKeyHash agrees
+    struct SamplerKey {
+        VkSamplerCreateInfo    info;
+        VkSamplerReductionMode reductionMode = VK_SAMPLER_REDUCTION_MODE_WEIGHTED_AVERAGE;
+
+        bool                   operator==(const SamplerKey& other) const noexcept {
+            const VkSamplerCreateInfo& a = this->info;
+            const VkSamplerCreateInfo& b = other.info;
+            return this->reductionMode == other.reductionMode &&
+                   a.flags == b.flags &&
+                   a.magFilter == b.magFilter &&
+                   a.minFilter == b.minFilter &&
+                   a.mipmapMode == b.mipmapMode &&
+                   a.addressModeU == b.addressModeU &&
+                   a.addressModeV == b.addressModeV &&
+                   a.addressModeW == b.addressModeW &&
+                   a.mipLodBias == b.mipLodBias &&
+                   a.anisotropyEnable == b.anisotropyEnable &&
+                   (!a.anisotropyEnable || a.maxAnisotropy == b.maxAnisotropy) &&
+                   a.compareEnable == b.compareEnable &&
+                   (!a.compareEnable || a.compareOp == b.compareOp) &&
+                   a.minLod == b.minLod &&
+                   a.maxLod == b.maxLod &&
+                   a.borderColor == b.borderColor &&
+                   a.unnormalizedCoordinates == b.unnormalizedCoordinates;
+        }
+    };
+
+    struct SamplerKeyHash {
+        size_t operator()(const kvk::SamplerKey& s) const noexcept {
+            const VkSamplerCreateInfo& info   = s.info;
+            size_t                     retval = std::hash<std::uint32_t>()(s.reductionMode);
+            retval = (retval << 1) ^ std::hash<std::uint32_t>()(info.flags);
+            retval = (retval << 1) ^ std::hash<std::uint32_t>()(info.magFilter | info.minFilter << 4 | info.mipmapMode << 8);
+            retval = (retval << 1) ^ std::hash<std::uint32_t>()(info.addressModeU | info.addressModeV << 4 | info.addressModeW << 8);
+            retval = (retval << 1) ^ std::hash<float>()(info.mipLodBias);
+            retval = (retval << 1) ^ std::hash<float>()(info.anisotropyEnable ? info.maxAnisotropy : 0.0f);
+            retval = (retval << 1) ^ std::hash<std::uint32_t>()(info.compareEnable ? info.compareOp + 1 : 0);
+            retval = (retval << 1) ^ std::hash<float>()(info.minLod);
+            retval = (retval << 1) ^ std::hash<float>()(info.maxLod);
+            retval = (retval << 1) ^ std::hash<std::uint32_t>()(info.borderColor | info.unnormalizedCoordinates << 8);
+            return retval;
+        }
+    };
+
     struct Cache {
         struct RendererState*                                                        state;
 
@@ -381,6 +514,9 @@ namespace kvk {
 
         std::mutex                                                                   pipelineLayoutMutex;
         unordered_map<kvk::PipelineLayoutInfo, VkPipelineLayout, PipelineLayoutHash> pipelineLayouts;
+
+        std::mutex                                                                   samplerMutex;
+        unordered_map<SamplerKey, VkSampler, SamplerKeyHash>                         samplers;
     };
 
     struct DescriptorSetBuilder {
@@ -398,7 +534,9 @@ namespace kvk {
         DescriptorSetBuilder& images(std::span<AllocatedImage> imagesToUpload, u32 offset, VkImageLayout layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);  // assumed, VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE
 
         DescriptorSetBuilder& buffer(VkBuffer buffer, VkDescriptorType type, u64 size = VK_WHOLE_SIZE, u64 offset = 0);
+        DescriptorSetBuilder& image(VkImageView imageView, const VkSamplerCreateInfo& samplerInfo, VkImageLayout layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);  // sampler from samplerFromCache
         DescriptorSetBuilder& sampler(VkSampler sampler);
+        DescriptorSetBuilder& sampler(const VkSamplerCreateInfo& samplerInfo);
 
         DescriptorSet         build(const std::string& name, VkShaderStageFlags shaderStage);
         DescriptorSet         buildPerFrame(const std::string& name, VkShaderStageFlags shaderStage);
@@ -550,6 +688,57 @@ namespace kvk {
         std::uint32_t   indexCount;
     };
 
+    struct RendererState;
+
+    enum class MipFilter : std::uint32_t {
+        AVERAGE,
+        MIN,
+        MAX,
+
+        COUNT
+    };
+
+    // Single pass compute downsampler (SPD style): one dispatch writes up to 12 mips below its
+    // base level, every workgroup reduces a 64x64 tile and the last one to finish (tracked through
+    // a global atomic counter) reduces the tile results further. Works on any storage-capable
+    // format, sRGB formats go through a UNORM alias and are filtered in linear space.
+    struct MipGenerator {
+        static constexpr std::uint32_t MAX_MIPS_PER_DISPATCH = 12;
+        static constexpr std::uint32_t MAX_MIP_COUNT         = 16;
+        static constexpr std::uint32_t COUNTER_COUNT         = 4096;
+
+        struct PushConstants {
+            std::uint32_t baseMip;
+            std::uint32_t mipCount;
+            std::uint32_t counterBase;
+            std::uint32_t flags;
+        };
+
+        VkDescriptorSetLayout      setLayout = VK_NULL_HANDLE;
+        VkPipelineLayout           layout    = VK_NULL_HANDLE;
+        Pipeline                   pipelines[std::uint32_t(MipFilter::COUNT)] = {};
+        AllocatedBuffer            counters;
+        std::atomic<std::uint32_t> nextCounter = 0;
+
+        // shaderName is resolved like PipelineBuilder::addShaders, built from shaders/spd_downsample.comp.glsl
+        ReturnCode                 init(RendererState& state, Cache& cache, std::string_view shaderName);
+        void                       destroy(RendererState& state);
+
+        bool                       isInitialized() const;
+        bool                       supportsFormat(VkPhysicalDevice physicalDevice, VkFormat format) const;
+
+        // Expects mip 0 of every layer to be filled and the whole image to be in currentLayout,
+        // leaves every mip in finalLayout. The per-mip storage views are appended to views, they
+        // have to outlive cmd's execution and are destroyed by the caller afterwards.
+        void                       cmdGenerate(VkCommandBuffer           cmd,
+                                               RendererState&            state,
+                                               AllocatedImage&           image,
+                                               MipFilter                 filter,
+                                               VkImageLayout             currentLayout,
+                                               VkImageLayout             finalLayout,
+                                               std::vector<VkImageView>& views);
+    };
+
     union CubemapContents {
         struct {
             const void* left;
@@ -566,15 +755,37 @@ namespace kvk {
         VkQueue                      handle;
         VkQueue                      secondaryHandle;
         std::mutex                   submitMutex;
+        // One bit per pool, set while locked. Bits past the pool count stay set. The mutex and cvar
+        // only serve lockCommandPool callers that found every pool taken
+        std::vector<std::atomic<std::uint64_t>> slotBits;
+        std::atomic<std::uint32_t>   poolWaiters;
         std::mutex                   poolMutex;
         std::condition_variable      poolCvar;
-        std::vector<bool>            isSlotOccupied;
         std::vector<VkCommandPool>   pools;
         std::vector<VkCommandBuffer> commandBuffers;
-        std::vector<VkFence>         fences;
+
+        // Every batch signals the next value, see enqueueSubmit() and waitTimeline()
+        VkSemaphore                  timeline;
+        std::uint64_t                timelineValue;   // last value handed out, guarded by submitMutex
+        std::atomic<std::uint64_t>   flushedValue;    // last value actually submitted
+        std::atomic<std::uint64_t>   completedValue;  // last value seen reached, only grows
+        std::atomic<bool>            lost;            // a failed submit left values that never signal
+
+        // Batches waiting for flushSubmits, guarded by submitMutex. Ranges index the shared arrays
+        struct PendingSubmit {
+            std::uint32_t firstBuffer;
+            std::uint32_t bufferCount;
+            std::uint32_t firstWait;
+            std::uint32_t waitCount;
+            std::uint32_t firstSignal;
+            std::uint32_t signalCount;
+        };
+        std::vector<PendingSubmit>             pendingSubmits;
+        std::vector<VkCommandBufferSubmitInfo> pendingBuffers;
+        std::vector<VkSemaphoreSubmitInfo>     pendingSemaphores;
+        std::vector<VkSubmitInfo2>             submitInfos;
 
         std::uint32_t                familyIndex;
-        std::uint32_t                freePoolCount;
         VkQueueFlags                 flags;
     };
 
@@ -583,21 +794,93 @@ namespace kvk {
         std::uint32_t poolIndex;
     };
 
+    // Handles destroyed once the graphics timeline reaches timelineValue, see deferDestroy
+    struct DeferredDestroy {
+        union {
+            struct {
+                VkBuffer      handle;
+                VmaAllocation allocation;
+            } buffer;
+            struct {
+                VkImage       handle;
+                VkImageView   view;
+                VmaAllocation allocation;
+            } image;
+            VkImageView    view;
+            VkPipeline     pipeline;
+            VkSampler      sampler;
+            VkSemaphore    semaphore;
+            VkSwapchainKHR swapchain;
+            PoolInfo       poolInfo;
+            VkCommandPool  commandPool;
+        };
+        std::uint64_t timelineValue;
+
+        enum {
+            NONE,
+
+            BUFFER,
+            IMAGE,
+            IMAGE_VIEW,
+            PIPELINE,
+            SAMPLER,
+            SEMAPHORE,
+            SWAPCHAIN,
+            POOL_SLOT,
+            COMMAND_POOL,
+        } type = NONE;
+
+        std::shared_ptr<ImageViewCache> imageViews;  // IMAGE only
+    };
+
+    // Records that wait for the frame being recorded, endFrame stamps them with the frame's value
+    static constexpr std::uint64_t PENDING_FRAME_VALUE = std::numeric_limits<std::uint64_t>::max();
+
+    // FIFO in push order over storage that only grows, so the steady state does not allocate
+    struct DeletionRing {
+        std::mutex                   mutex;
+        std::vector<DeferredDestroy> records;
+        std::uint32_t                head;
+        std::uint32_t                count;
+        std::uint32_t                pendingCount;  // records still waiting for endFrame's value
+    };
+
+    // Queue-to-present latency is submit to image on screen with VK_KHR_present_wait. Without it, or
+    // outside LOW_LATENCY where nothing blocks on the present, it is only sampled when the frame slot
+    // comes around again and reads as an upper bound
+    struct PresentTiming {
+        float                                 latencyMs;
+        float                                 averageLatencyMs;
+        float                                 recordMs;         // startFrame to submit, averaged
+        float                                 refreshMs;        // LOW_LATENCY only
+        float                                 latencyFloorMs;   // LOW_LATENCY only, decaying minimum
+        std::chrono::steady_clock::time_point lastPresentTime;  // LOW_LATENCY only
+    };
+
     struct FrameData {
-        std::uint32_t                      swapchainImageIndex;
+        std::uint32_t                         swapchainImageIndex;
+
+        Queue*                                queue;
+        std::uint64_t                         timelineValue;  // signalled on queue when the frame's submit retires
+        VkCommandBuffer                       commandBuffer;
 
-        Queue*                             queue;
-        VkFence                            inFlightFence;
-        VkCommandBuffer                    commandBuffer;
+        // One pool per recording thread, reset as a whole once the frame retires.
+        // Buffers in use are submitted by endFrame in index order right after commandBuffer
+        std::vector<VkCommandPool>            workerPools;
+        std::vector<VkCommandBuffer>          workerCommandBuffers;
+        std::uint32_t                         workerCount;
 
-        VkSemaphore                        imageAvailableSemaphore;
+        VkSemaphore                           imageAvailableSemaphore;
 
-        std::vector<std::function<void()>> deletionQueue;
+        std::uint64_t                         presentId;  // 0 unless VK_KHR_present_id is in use
+        std::chrono::steady_clock::time_point startTime;
+        std::chrono::steady_clock::time_point submitTime;
     };
 
 
     struct RendererState {
         std::uint32_t            currentFrame;
+        std::uint32_t            framesInFlight;
 
         VmaAllocator             allocator;
 
@@ -609,6 +892,7 @@ namespace kvk {
         std::uint32_t            presentFamilyIndex;
         std::uint32_t            computeFamilyIndex;
         VkPhysicalDeviceLimits   limits;
+        bool                     storageImageWithoutFormat;  // format-less read/write and dynamic indexing of storage images
 
         Queue*                   queues;
         std::uint32_t            queueCount;
@@ -617,6 +901,8 @@ namespace kvk {
 
         DescriptorAllocator      descriptors;
         FrameData                frames[MAX_IN_FLIGHT_FRAMES];
+        DeletionRing             deletions;
+        MipGenerator             mipGenerator;
 
         //
         // Swapchain stuff
@@ -629,8 +915,167 @@ namespace kvk {
         VkExtent2D               swapchainExtent;
         VkSurfaceFormatKHR       swapchainImageFormat;
         VkPresentModeKHR         swapchainPresentMode;
+
+        PresentPolicy            presentPolicy;
+        PFN_vkWaitForPresentKHR  vkWaitForPresent;        // null without VK_KHR_present_wait
+        std::uint64_t            presentId;               // of the last present
+        std::uint64_t            swapchainPresentIdBase;  // presentId when the swapchain was created
+        PresentTiming            presentTiming;
+
+        PFN_vkGetCalibratedTimestampsKHR vkGetCalibratedTimestamps;  // null without VK_KHR_calibrated_timestamps or HOST_TIME_DOMAIN
+    };
+
+    using StreamedTextureHandle = std::uint32_t;
+
+    // Describes where the levels of a streamed 2D texture come from. loadMip writes the complete,
+    // tightly packed contents of `mip` to dst (mipSizes[mip] bytes) and may block on IO.
+    struct StreamedTextureDesc {
+        static constexpr std::uint32_t MAX_MIPS = 16;
+
+        VkFormat                                          format;
+        VkExtent2D                                        extent;
+        std::uint32_t                                     mipCount;
+        std::uint64_t                                     mipSizes[MAX_MIPS];
+        // Smallest levels uploaded at registration and never evicted
+        std::uint32_t                                     tailMipCount = 1;
+        std::function<bool(std::uint32_t mip, void* dst)> loadMip;
+    };
+
+    // Keeps only the mips that are actually needed on the GPU. Every texture starts with its tail
+    // resident, higher levels are streamed in (most starved texture first) within a per-frame byte
+    // budget and dropped again after going unrequested for evictionDelay frames.
+    //
+    // Requests come from requestMip (CPU screen-size estimates) and from shaders, which atomicMin
+    // the mip they sampled into the feedback buffer (see shaders/include/streaming_feedback.glslh).
+    //
+    // Without sparse residency a texture's image only holds mips [residentMip, mipCount), growing or
+    // shrinking it reallocates the image and copies the levels over, so views change and have to be
+    // fetched every frame.
+    struct TextureStreamer {
+        static constexpr std::uint32_t NO_REQUEST = 0xFFFFFFFF;
+
+        struct Texture {
+            StreamedTextureDesc desc;
+            AllocatedImage      image;
+            VkImageUsageFlags   usage;
+            std::uint32_t       residentMip;
+            std::uint32_t       requestedMip;
+            std::uint32_t       framesUnrequested;
+            bool                isAlive;
+        };
+
+        std::vector<Texture>       textures;
+        std::vector<std::uint32_t> freeHandles;
+        AllocatedBuffer            stagingBuffers[MAX_IN_FLIGHT_FRAMES];
+        AllocatedBuffer            feedbackBuffers[MAX_IN_FLIGHT_FRAMES];
+        std::uint64_t              frameBudget;
+        std::uint32_t              maxTextures;
+        std::uint32_t              evictionDelay;
+
+        ReturnCode                 init(RendererState& state,
+                                        std::uint64_t  frameBudget,
+                                        std::uint32_t  maxTextures,
+                                        std::uint32_t  evictionDelay = 120);
+        void                       destroy(RendererState& state);
+
+        ReturnCode                 registerTexture(StreamedTextureHandle&  handle,
+                                                   RendererState&          state,
+                                                   StreamedTextureDesc&&   desc,
+                                                   const VkImageUsageFlags usageFlags = VK_IMAGE_USAGE_SAMPLED_BIT);
+        // The image goes through the deletion ring once the frame being recorded retired
+        void                       unregisterTexture(StreamedTextureHandle handle, RendererState& state);
+
+        void                       requestMip(StreamedTextureHandle handle, std::uint32_t mip);
+        // Mip at which the texture covers roughly screenSize pixels along its longest axis
+        static std::uint32_t       mipForScreenSize(VkExtent2D extent, float screenSize);
+
+        // Call once per frame after startFrame: consumes the feedback written the last time this frame
+        // slot was rendered and records uploads / reallocations into cmd. Replaced images are deferred
+        // to the frame's retirement through the deletion ring.
+        void                       update(VkCommandBuffer cmd, RendererState& state, std::uint32_t frameIndex);
+
+        VkDeviceAddress            feedbackAddress(std::uint32_t frameIndex) const;
+        const AllocatedImage&      image(StreamedTextureHandle handle) const;
+        std::uint32_t              residentMip(StreamedTextureHandle handle) const;
+    };
+
+    // Image based lighting for a single probe: a GGX prefiltered specular cube (roughness = mip / (mipCount - 1)),
+    // the irradiance SH and an irradiance cube expanded from it. All three live in IBL_FORMAT / vec4[9].
+    struct IblProbe {
+        static constexpr VkFormat      IBL_FORMAT        = VK_FORMAT_R16G16B16A16_SFLOAT;
+        static constexpr std::uint32_t SH_COEFFICIENTS   = 9;
+
+        AllocatedImage                 specular;
+        AllocatedImage                 irradiance;
+        AllocatedBuffer                sh;
+    };
+
+    // Compute kernels baking IblProbes from an environment cube at runtime. The environment has to
+    // be sampleable, in SHADER_READ_ONLY_OPTIMAL and should carry a full mip chain (createCubemap
+    // with mipLevels), prefiltering picks the source mip per sample.
+    struct IblBaker {
+        struct PushConstants {
+            float         roughness;
+            std::uint32_t sampleCount;
+            std::uint32_t sourceSize;
+            std::uint32_t sourceMipCount;
+        };
+
+        VkDescriptorSetLayout setLayout  = VK_NULL_HANDLE;
+        VkPipelineLayout      layout     = VK_NULL_HANDLE;
+        VkSampler             sampler    = VK_NULL_HANDLE;  // owned by the Cache passed to init
+        Pipeline              prefilterPipeline  = {};
+        Pipeline              shPipeline         = {};
+        Pipeline              irradiancePipeline = {};
+
+        // Shader names resolve like PipelineBuilder::addShaders, built from
+        // shaders/ibl_prefilter_ggx, ibl_sh_project and ibl_irradiance_sh
+        ReturnCode            init(RendererState&   state,
+                                   Cache&           cache,
+                                   std::string_view prefilterShaderName,
+                                   std::string_view shShaderName,
+                                   std::string_view irradianceShaderName);
+        void                  destroy(RendererState& state);
+
+        // Bakes environment into probe, reusing cachePath when it holds a bake of the same environment
+        // (environmentHash, e.g. hashContents over the faces it was created from), sizes and sample
+        // count and writing it otherwise. cachePath may be null. probe is left empty on failure.
+        ReturnCode            bake(IblProbe&             probe,
+                                   RendererState&        state,
+                                   const AllocatedImage& environment,
+                                   std::uint64_t         environmentHash,
+                                   std::uint32_t         specularSize,
+                                   std::uint32_t         specularMipCount,
+                                   std::uint32_t         irradianceSize,
+                                   std::uint32_t         sampleCount = 1024,
+                                   const char*           cachePath   = nullptr);
+
+        // Records the bake into cmd, probe images have to be created with STORAGE usage.
+        // Leaves both cubes in SHADER_READ_ONLY_OPTIMAL. The storage views it writes through are
+        // appended to views for the caller to destroy once cmd retired. Records nothing when a view
+        // can't be created.
+        ReturnCode            cmdBake(VkCommandBuffer           cmd,
+                                      RendererState&            state,
+                                      IblProbe&                 probe,
+                                      const AllocatedImage&     environment,
+                                      std::uint32_t             sampleCount,
+                                      std::vector<VkImageView>& views);
+    };
+
+    // The cache records what the probe was baked from, loading fails without touching probe when
+    // the file was baked from anything else
+    struct IblCacheKey {
+        std::uint64_t environmentHash;
+        std::uint32_t specularSize;
+        std::uint32_t specularMipCount;
+        std::uint32_t irradianceSize;
+        std::uint32_t sampleCount;
     };
 
+    void       destroyIblProbe(IblProbe& probe, RendererState& state);
+    ReturnCode saveIblProbe(const IblProbe& probe, RendererState& state, const char* path, const IblCacheKey& key);
+    ReturnCode loadIblProbe(IblProbe& probe, RendererState& state, const char* path, const IblCacheKey& key);
+
 
     ReturnCode init(RendererState& state, const InitSettings* settings);
 
@@ -641,6 +1086,79 @@ namespace kvk {
 
     ReturnCode endFrame(RendererState& state, FrameData& frame);
 
+    //
+    // Parallel recording: hands out count primaries of frame, one per thread, valid until the frame
+    // is started again. They are not begun. endFrame submits frame.commandBuffer and then these in
+    // one batch, so a dynamic rendering pass can be split over them with splitRenderingFlags
+    //
+    ReturnCode       acquireWorkerCommandBuffers(RendererState&              state,
+                                                 FrameData&                  frame,
+                                                 std::uint32_t               count,
+                                                 std::span<VkCommandBuffer>& commandBuffers);
+    // Acquires workerCount buffers and records function(cmd, workerIndex) into each on workerPool(),
+    // the calling thread taking part. Buffers are begun and ended around function
+    ReturnCode       recordWorkerCommandBuffers(RendererState&                                             state,
+                                                FrameData&                                                 frame,
+                                                std::uint32_t                                              workerCount,
+                                                const std::function<void(VkCommandBuffer, std::uint32_t)>& function);
+    // VkRenderingInfo::flags for part partIndex of a pass split over partCount consecutive buffers
+    VkRenderingFlags splitRenderingFlags(std::uint32_t partIndex, std::uint32_t partCount);
+
+    // Something a cached recording depends on. Bump version whenever the object behind handle changes
+    // in a way the recorded commands would see (rebuilt pipeline, rewritten set, resized attachment)
+    struct CommandInput {
+        std::uint64_t handle;
+        std::uint64_t version;
+
+        bool operator==(const CommandInput&) const = default;
+    };
+
+    template<typename Handle>
+    CommandInput commandInput(Handle handle, std::uint64_t version = 0) {
+        return { .handle = std::uint64_t(handle), .version = version };
+    }
+
+    struct CachedCommandsSettings {
+        // Rendering the buffers continue, ignored unless insideRendering. The pass has to begin with
+        // VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT and can then only execute secondaries
+        std::span<const VkFormat> colorFormats;
+        VkFormat                  depthFormat     = VK_FORMAT_UNDEFINED;
+        VkFormat                  stencilFormat   = VK_FORMAT_UNDEFINED;
+        VkSampleCountFlagBits     samples         = VK_SAMPLE_COUNT_1_BIT;
+        bool                      insideRendering = true;
+    };
+
+    //
+    // Secondary command buffers recorded once and replayed until their inputs change. Every frame
+    // slot keeps its own buffer, a buffer is only re-recorded when its slot comes around, which has
+    // retired by then, so a change costs framesInFlight recordings and never waits on the GPU
+    //
+    struct CachedCommands {
+        VkCommandPool              pool;
+        VkCommandBuffer            buffers[MAX_IN_FLIGHT_FRAMES];
+        std::vector<CommandInput>  recordedInputs[MAX_IN_FLIGHT_FRAMES];
+        bool                       isRecorded[MAX_IN_FLIGHT_FRAMES];
+        std::vector<VkFormat>      colorFormats;
+        VkFormat                   depthFormat;
+        VkFormat                   stencilFormat;
+        VkSampleCountFlagBits      samples;
+        bool                       insideRendering;
+    };
+
+    ReturnCode createCachedCommands(CachedCommands& cached, RendererState& state, const CachedCommandsSettings& settings);
+    // The pool goes once the frame being recorded retires
+    void       destroyCachedCommands(CachedCommands& cached, RendererState& state);
+    // Re-records every slot on its next use, for changes no input describes
+    void       invalidateCachedCommands(CachedCommands& cached);
+    // Executes frameIndex's buffer into cmd, recording it first with record(secondary) when it was
+    // recorded with other inputs. record must not begin or end the secondary
+    ReturnCode cmdExecuteCachedCommands(VkCommandBuffer                             cmd,
+                                        CachedCommands&                             cached,
+                                        RendererState&                              state,
+                                        std::uint32_t                               frameIndex,
+                                        std::span<const CommandInput>               inputs,
+                                        const std::function<void(VkCommandBuffer)>& record);
+
 
     ReturnCode createSwapchain(RendererState&     state,
                                VkExtent2D         extent,
@@ -668,8 +1186,9 @@ namespace kvk {
                            const VkFormat          format,
                            const VkExtent3D        extent,
                            const VkImageUsageFlags usageFlags,
-                           bool                    isCubemap = false,
-                           std::uint32_t           mipLevels = 1);
+                           bool                    isCubemap  = false,
+                           std::uint32_t           mipLevels  = 1,
+                           std::uint32_t           layerCount = 1);  // ignored for cubemaps, > 1 gets a 2D_ARRAY view
 
     ReturnCode createImage(AllocatedImage&         image,
                            RendererState&          state,
@@ -679,17 +1198,419 @@ namespace kvk {
                            const VkImageUsageFlags usageFlags,
                            std::uint32_t           mipLevels = 1);
 
+    // CPU side preparation of pixels for createImage. Converts in small chunks of local memory that
+    // are copied out once, so dst can be mapped staging memory that is never read back
+    enum class PixelSource : std::uint8_t {
+        RGB8,
+        BGR8,
+        RGBA8,
+        BGRA8,
+        RGBA32F,
+    };
+
+    enum class PixelTransfer : std::uint8_t {
+        NONE,
+        SRGB_TO_LINEAR,  // applied before premultiplying
+        LINEAR_TO_SRGB,  // applied after premultiplying
+    };
+
+    // Output is RGBA8, or RGBA16F with halfFloat. Alpha is never transferred.
+    struct PixelConversion {
+        PixelSource   source      = PixelSource::RGBA8;
+        PixelTransfer transfer    = PixelTransfer::NONE;
+        bool          premultiply = false;
+        bool          halfFloat   = false;
+    };
+
+    std::uint64_t convertedSize(const PixelConversion& conversion, std::uint64_t texelCount);
+    // workerCount 0 picks one per pool thread for large images, the calling thread is one of the workers
+    void          convertPixels(void*                  dst,
+                                const void*            src,
+                                std::uint64_t          texelCount,
+                                const PixelConversion& conversion,
+                                std::uint32_t          workerCount = 0);
+
+    // Same as the data path above, format has to match the converted texels
+    ReturnCode    createImage(AllocatedImage&         image,
+                              RendererState&          state,
+                              const void*             data,
+                              const PixelConversion&  conversion,
+                              const VkFormat          format,
+                              const VkExtent3D        extent,
+                              const VkImageUsageFlags usageFlags = VK_IMAGE_USAGE_SAMPLED_BIT,
+                              std::uint32_t           mipLevels  = 1);
+
+    // Region path: copies every region out of an already filled staging buffer, then either
+    // generates the remaining mips from mip 0 or transitions the uploaded ones to SHADER_READ_ONLY.
+    ReturnCode createImage(AllocatedImage&                    image,
+                           RendererState&                     state,
+                           const AllocatedBuffer&             stagingBuffer,
+                           std::span<const VkBufferImageCopy> regions,
+                           const VkFormat                     format,
+                           const VkExtent3D                   extent,
+                           const VkImageUsageFlags            usageFlags,
+                           std::uint32_t                      mipLevels    = 1,
+                           bool                               isCubemap    = false,
+                           bool                               generateMips = false,
+                           std::uint32_t                      layerCount   = 1);
+
+    struct ImageCreateRequest {
+        AllocatedImage*   image;
+        const void*       data;
+        // Bytes of mip 0 at data, 0 means 4 bytes per texel like createImage
+        std::uint64_t     dataSize   = 0;
+        VkFormat          format;
+        VkExtent3D        extent;
+        VkImageUsageFlags usageFlags = VK_IMAGE_USAGE_SAMPLED_BIT;
+        // More than 1 generates the chain from mip 0
+        std::uint32_t     mipLevels  = 1;
+    };
+
+    // An in-flight createImages upload, the images must not be used until it completed.
+    // Only a timeline value, the command buffer and staging memory are released through the
+    // deletion ring once it retires.
+    struct UploadTicket {
+        Queue*                             queue         = nullptr;
+        std::uint64_t                      timelineValue = 0;  // on queue
+    };
+
+    // Creates every requested image through one staging buffer, one command buffer and one submit.
+    // Waits for the upload unless a ticket is passed.
+    ReturnCode createImages(RendererState&                      state,
+                            std::span<const ImageCreateRequest> requests,
+                            UploadTicket*                       ticket = nullptr);
+    bool       isUploadComplete(RendererState& state, UploadTicket& ticket);
+    ReturnCode waitForUpload(RendererState& state, UploadTicket& ticket);
+
     ReturnCode createCubemap(AllocatedImage&         image,
                              RendererState&          state,
                              const CubemapContents&  data,
                              const VkFormat          format,
                              const VkExtent2D        extent,
-                             const VkImageUsageFlags usageFlags);
+                             const VkImageUsageFlags usageFlags,
+                             std::uint32_t           mipLevels = 1);
+
+    // KTX2 containers. Payloads with a vkFormat are uploaded as-is, Basis Universal payloads
+    // (ETC1S / UASTC, optionally zstd supercompressed) are transcoded to the best format the
+    // device can sample from. Transcoding requires KVK_BASISU.
+    ReturnCode loadKtx2(AllocatedImage&         image,
+                        RendererState&          state,
+                        std::span<const u8>     fileContents,
+                        const VkImageUsageFlags usageFlags = VK_IMAGE_USAGE_SAMPLED_BIT);
+
+    ReturnCode loadKtx2(AllocatedImage&         image,
+                        RendererState&          state,
+                        const char*             path,
+                        const VkImageUsageFlags usageFlags = VK_IMAGE_USAGE_SAMPLED_BIT);
+
+    // Small textures packed into one 2D array image, 4 bytes per texel like createImage. Formats of
+    // any other texel size and block compressed formats are rejected.
+    // Sample with texture(atlas, vec3(region.uvOffset + uv * region.uvScale, region.layer)).
+    struct AtlasTexture {
+        const void* data;
+        VkExtent2D  extent;
+    };
+
+    struct AtlasRegion {
+        glm::vec2     uvOffset;
+        glm::vec2     uvScale;
+        std::uint32_t layer;
+    };
+
+    struct TextureAtlas {
+        AllocatedImage           image     = {};
+        VkImageView              arrayView = VK_NULL_HANDLE;  // from the image view cache, valid for one layer too
+        std::vector<AtlasRegion> regions;                     // same order as the packed textures
+    };
+
+    // Skyline packs textures into layerSize x layerSize layers, opening a new layer when one is full.
+    // Every texture is surrounded by guardBand texels of clamped edge so filtering never bleeds,
+    // with mips the guard band has to cover the footprint of the smallest mip (1 << (mipLevels - 1)).
+    ReturnCode createTextureAtlas(TextureAtlas&                 atlas,
+                                  RendererState&                state,
+                                  std::span<const AtlasTexture> textures,
+                                  const VkFormat                format,
+                                  std::uint32_t                 layerSize = 2048,
+                                  std::uint32_t                 guardBand = 2,
+                                  std::uint32_t                 mipLevels = 1);
+    void       destroyTextureAtlas(TextureAtlas& atlas, RendererState& state);
+
+    struct GpuZoneResult {
+        const char*                           name;
+        std::chrono::steady_clock::time_point start;  // on the CPU clock
+        float                                 milliseconds;
+    };
+
+    // Timestamp pairs around named zones with one query pool per frame slot. A slot is read back when
+    // it is reused, its frame has retired by then so nothing waits, and results lag framesInFlight frames.
+    // GPU ticks are mapped to the CPU clock with VK_KHR_calibrated_timestamps every readback, otherwise
+    // once at init. With PROFILER_ENABLED the zones are forwarded to Tracy as GPU zones.
+    struct GpuProfiler {
+        static constexpr std::uint32_t MAX_ZONES = 512;
+
+        struct FrameQueries {
+            VkQueryPool                pool;
+            const char*                names[MAX_ZONES];
+            std::atomic<std::uint32_t> zoneCount;
+        };
+
+        FrameQueries                          frames[MAX_IN_FLIGHT_FRAMES];
+        std::uint32_t                         currentFrame;
+        float                                 timestampPeriod;  // nanoseconds per tick
+        std::uint64_t                         timestampMask;
+        std::uint64_t                         gpuReference;  // ticks that were current at cpuReference
+        std::chrono::steady_clock::time_point cpuReference;
+        std::uint64_t                         calibrationDeviation;  // ns, of the read behind the references, UINT64_MAX without the extension
+        std::vector<GpuZoneResult>            results;  // of the last frame read back, in begin order
+        std::uint8_t                          tracyContext;
+    };
+
+    ReturnCode    initGpuProfiler(GpuProfiler& profiler, RendererState& state);
+    void          destroyGpuProfiler(GpuProfiler& profiler, RendererState& state);
+    // Reads back frameIndex's previous results and resets its queries, record it before any zone
+    void          cmdBeginGpuProfilerFrame(GpuProfiler& profiler, RendererState& state, VkCommandBuffer cmd, std::uint32_t frameIndex);
+    // Zones can be recorded from several threads into the frame's command buffers. name has to
+    // outlive the readback (string literals), returns UINT32_MAX once MAX_ZONES are in use
+    std::uint32_t cmdBeginGpuZone(GpuProfiler& profiler, VkCommandBuffer cmd, const char* name);
+    void          cmdEndGpuZone(GpuProfiler& profiler, VkCommandBuffer cmd, std::uint32_t zone);
+
+    struct GpuZone {
+        GpuProfiler&    profiler;
+        VkCommandBuffer cmd;
+        std::uint32_t   zone;
+
+        GpuZone(GpuProfiler& profiler, VkCommandBuffer cmd, const char* name)
+            : profiler(profiler), cmd(cmd), zone(cmdBeginGpuZone(profiler, cmd, name)) {
+        }
+        ~GpuZone() {
+            cmdEndGpuZone(profiler, cmd, zone);
+        }
+        GpuZone(const GpuZone&)            = delete;
+        GpuZone& operator=(const GpuZone&) = delete;
+    };
+
+    struct DynamicResolutionSettings {
+        float         targetMs;             // GPU time per frame to stay under
+        float         minScale     = 0.5f;  // per axis
+        float         maxScale     = 1.0f;
+        float         scaleStep    = 0.05f; // the scale moves in these steps, at most two per change
+        float         headroom     = 0.85f; // grows only below targetMs * headroom
+        std::uint32_t shrinkFrames = 2;     // consecutive frames over target before shrinking
+        std::uint32_t growFrames   = 30;    // consecutive frames under the headroom before growing
+        // Frames between recording and its GPU time arriving, InitSettings::framesInFlight with
+        // the GPU profiler. That many samples are dropped after every extent change
+        std::uint32_t sampleLag    = MAX_IN_FLIGHT_FRAMES;
+    };
+
+    //
+    // Scales the internal render extent to keep GPU frame time under a budget. Offscreen targets are
+    // allocated once at maxExtent and rendered into the top left renderExtent sub-rectangle (pass it
+    // to RenderPassBuilder::cmdBeginRendering), so a change never reallocates. Shrinking reacts within
+    // a few frames, growing waits for a sustained margin so the extent does not oscillate.
+    //
+    struct DynamicResolution {
+        DynamicResolutionSettings settings;
+        VkExtent2D                maxExtent;
+        VkExtent2D                renderExtent;
+        float                     scale;
+        float                     averageMs;
+        std::uint32_t             overFrames;
+        std::uint32_t             underFrames;
+        std::uint32_t             staleSamples;  // still to drop, they were rendered at an older extent
+    };
+
+    void       initDynamicResolution(DynamicResolution& resolution, const DynamicResolutionSettings& settings, VkExtent2D maxExtent);
+    // After a swapchain resize, the targets have to be recreated at the new maxExtent. Restarts the
+    // averages like a scale change
+    void       resizeDynamicResolution(DynamicResolution& resolution, VkExtent2D maxExtent);
+    // Feeds one frame's GPU time, returns true when renderExtent changed
+    bool       updateDynamicResolution(DynamicResolution& resolution, float gpuMilliseconds);
+    // Uses the span from the first zone start to the last zone end of the profiler's last readback,
+    // false without results
+    bool       updateDynamicResolution(DynamicResolution& resolution, const GpuProfiler& profiler);
+    // Multiplier from [0, 1] over the rendered sub-rectangle to UVs over the whole target
+    glm::vec2  dynamicResolutionUvScale(const DynamicResolution& resolution);
+    // Linear blit of source's renderExtent sub-rectangle onto dst, which has to be in
+    // TRANSFER_DST_OPTIMAL already (swapchain images are not tracked)
+    void       cmdUpscale(VkCommandBuffer          cmd,
+                          const DynamicResolution& resolution,
+                          AllocatedImage&          source,
+                          VkImage                  dst,
+                          VkExtent2D               dstExtent);
+
+    using RenderResource = std::uint32_t;
+
+    struct RenderGraphImageDesc {
+        VkFormat      format;
+        VkExtent2D    extent;
+        std::uint32_t mipCount   = 1;
+        std::uint32_t layerCount = 1;
+    };
+
+    //
+    // Frame graph over images. Passes declare how they access virtual resources, compile culls the
+    // passes nothing depends on, derives attachment load / store ops and places transient images,
+    // execute records the barriers each pass needs through require() as one batch ahead of it and
+    // runs attachment passes inside dynamic rendering.
+    //
+    // A pass is kept when it has side effects or writes something a kept pass or an imported image
+    // needs afterwards. Dependencies are tracked per mip and layer, a pass that clears one mip while
+    // sampling another keeps the writer of the sampled one. Passes run in declaration order, which is
+    // also what dependencies are derived from, so a read sees the last write declared before it.
+    //
+    // Transient images are kept across frames and reused for the same descriptor, the ones a
+    // compile leaves unused are destroyed once the frame retires.
+    //
+    // compile reuses the previous results while the declared topology stays the same, which makes
+    // rebuilding an unchanged graph every frame cheap. Imported images (as long as their mip and layer
+    // counts stay), clear values, extents and execute functions are read at execute and can change freely.
+    //
+    struct RenderGraph {
+        using ExecuteFunction = std::function<void(VkCommandBuffer, RenderGraph&)>;
+
+        struct Resource {
+            const char*          name;
+            AllocatedImage*      imported;     // null for transients
+            RenderGraphImageDesc desc;         // transients only
+            VkImageUsageFlags    usage;        // transients only, every access ORed together
+            std::uint32_t        transient;    // index into transients, set by compile
+            ImageUsage           finalUsage;   // imported only, required after the last pass
+        };
+
+        struct Access {
+            RenderResource resource;
+            ImageUsage     usage;
+            ImageRange     range;
+            bool           discard;  // set by compile, nothing earlier is kept so the layout starts UNDEFINED
+        };
+
+        struct Attachment {
+            RenderResource      resource;
+            VkAttachmentLoadOp  loadOp;   // LOAD turns into DONT_CARE when there is nothing to load
+            VkAttachmentStoreOp storeOp;  // set by compile
+            glm::vec4           clearColor;
+            float               depthClear;
+        };
+
+        struct Pass {
+            const char*             name;
+            ExecuteFunction         execute;
+            std::vector<Access>     accesses;      // attachments included
+            std::vector<Attachment> colorAttachments;
+            Attachment              depthAttachment;
+            bool                    hasDepth;
+            bool                    hasSideEffects;
+            bool                    isLive;        // set by compile
+            VkExtent2D              renderExtent;  // {0, 0} for the extent of the first attachment
+        };
+
+        struct TransientImage {
+            RenderGraphImageDesc desc;
+            VkImageUsageFlags    usage;
+            AllocatedImage       image;
+            bool                 isUsed;
+        };
+
+        // Results of the last full compile in declaration order, attachments color first then depth
+        struct CompiledPlan {
+            std::size_t                      hash;
+            std::vector<std::uint32_t>       signature;
+            std::vector<bool>                isLive;
+            std::vector<bool>                discards;
+            std::vector<VkAttachmentLoadOp>  loadOps;
+            std::vector<VkAttachmentStoreOp> storeOps;
+            std::vector<std::uint32_t>       transients;
+            bool                             isValid = false;
+        };
+
+        std::vector<Resource>       resources;
+        std::vector<Pass>           passes;
+        std::vector<TransientImage> transients;
+        CompiledPlan                plan;
+        std::vector<std::uint32_t>  signature;  // scratch, swapped with the plan's on a full compile
+
+        // Drops the passes and resources, transient images stay for the next compile
+        void            reset();
+        void            destroy(RendererState& state);
+
+        RenderResource  importImage(const char* name, AllocatedImage& image, ImageUsage finalUsage = ImageUsage::UNDEFINED);
+        RenderResource  createImage(const char* name, const RenderGraphImageDesc& desc);
+
+        std::uint32_t   addPass(const char* name, ExecuteFunction&& execute);
+        RenderGraph&    read(std::uint32_t pass, RenderResource resource, ImageUsage usage = ImageUsage::SAMPLED_GRAPHICS, ImageRange range = {});
+        // Storage writes are taken as read-modify-write, only cleared attachments drop earlier contents
+        RenderGraph&    write(std::uint32_t pass, RenderResource resource, ImageUsage usage = ImageUsage::STORAGE_WRITE_COMPUTE, ImageRange range = {});
+        // Attachments cover mip 0 of every layer. Array images are rendered layered (shaders pick the
+        // layer), every attachment of a pass needs the same layer count
+        RenderGraph&    colorAttachment(std::uint32_t      pass,
+                                        RenderResource     resource,
+                                        VkAttachmentLoadOp loadOp     = VK_ATTACHMENT_LOAD_OP_LOAD,
+                                        glm::vec4          clearColor = { 0.0f, 0.0f, 0.0f, 1.0f });
+        RenderGraph&    depthAttachment(std::uint32_t      pass,
+                                        RenderResource     resource,
+                                        VkAttachmentLoadOp loadOp     = VK_ATTACHMENT_LOAD_OP_LOAD,
+                                        float              depthClear = 1.0f);
+        // Kept even though nothing reads what it writes (presenting, readbacks, queries)
+        RenderGraph&    setSideEffects(std::uint32_t pass);
+        RenderGraph&    setRenderExtent(std::uint32_t pass, VkExtent2D extent);
+
+        ReturnCode      compile(RendererState& state);
+        // Ignores the cached plan, compile calls it when the topology changed
+        ReturnCode      compileFull(RendererState& state);
+        // Zones are recorded per pass when profiler is given
+        void            execute(VkCommandBuffer cmd, RendererState& state, GpuProfiler* profiler = nullptr);
+
+        AllocatedImage& image(RenderResource resource);
+    };
 
     void       destroyImage(AllocatedImage& image,
                             VkDevice        device,
                             VmaAllocator    allocator);
 
+    // Records the narrowest barrier that makes range of image ready for usage, nothing when the
+    // subresources are already in the right layout and only read. A queueFamily different from the
+    // tracked one acquires ownership, the other queue has to call releaseImage first. Images without
+    // states are assumed to be in usage's layout and get a barrier on everything before every time.
+    void       require(VkCommandBuffer cmd,
+                       AllocatedImage& image,
+                       ImageUsage      usage,
+                       ImageRange      range       = {},
+                       std::uint32_t   queueFamily = VK_QUEUE_FAMILY_IGNORED);
+    // Same as above but only collects the barriers, flush batch before the access
+    void       require(BarrierBatch&   batch,
+                       AllocatedImage& image,
+                       ImageUsage      usage,
+                       ImageRange      range       = {},
+                       std::uint32_t   queueFamily = VK_QUEUE_FAMILY_IGNORED);
+
+    void       releaseImage(VkCommandBuffer cmd,
+                            AllocatedImage& image,
+                            ImageUsage      usage,
+                            std::uint32_t   srcQueueFamily,
+                            std::uint32_t   dstQueueFamily,
+                            ImageRange      range = {});
+    void       releaseImage(BarrierBatch&   batch,
+                            AllocatedImage& image,
+                            ImageUsage      usage,
+                            std::uint32_t   srcQueueFamily,
+                            std::uint32_t   dstQueueFamily,
+                            ImageRange      range = {});
+
+    // Returns the view of image described by key, creating it on first use. Views live until
+    // destroyImage, VK_NULL_HANDLE if the view could not be created.
+    VkImageView imageView(RendererState& state, AllocatedImage& image, const ImageViewKey& key);
+    // Same view without the cache, for views only a single recording uses. The caller destroys it
+    // (deferDestroy once the submit retires).
+    VkImageView createImageView(RendererState& state, const AllocatedImage& image, const ImageViewKey& key);
+
+    // For transitions recorded without require (raw barriers, render pass layouts), stage / access
+    // are the destination scope of that barrier
+    void       setImageState(AllocatedImage&       image,
+                             VkImageLayout         layout,
+                             VkPipelineStageFlags2 stage  = VK_PIPELINE_STAGE_2_NONE,
+                             VkAccessFlags2        access = 0,
+                             ImageRange            range  = {});
+
     ReturnCode createMesh(kvk::Mesh&               mesh,
                           RendererState&           state,
                           std::span<std::uint32_t> indices,
@@ -702,8 +1623,79 @@ namespace kvk {
                            bool           hasSecondaryQueue = false);
 
     PoolInfo   lockCommandPool(RendererState& state, VkQueueFlags desiredQueueFlags = VK_QUEUE_GRAPHICS_BIT);
+    // Never blocks, false when every pool of the queue is locked
+    bool       tryLockCommandPool(RendererState& state, PoolInfo& poolInfo, VkQueueFlags desiredQueueFlags = VK_QUEUE_GRAPHICS_BIT);
     void       unlockCommandPool(RendererState& state, PoolInfo& poolInfo);
 
+    //
+    // Deferred destruction keyed by the graphics queue timeline. The default value waits for the frame
+    // being recorded, retireDestroys runs in startFrame with whatever the GPU has finished
+    //
+    void          deferDestroy(RendererState& state, const DeferredDestroy& record, std::uint64_t timelineValue = PENDING_FRAME_VALUE);
+    void          deferDestroy(RendererState& state, const AllocatedBuffer& buffer, std::uint64_t timelineValue = PENDING_FRAME_VALUE);
+    void          deferDestroy(RendererState& state, const AllocatedImage& image, std::uint64_t timelineValue = PENDING_FRAME_VALUE);
+    void          retireDestroys(RendererState& state, std::uint64_t completedValue);
+
+    //
+    // Submission batching: enqueueSubmit collects a batch and returns the queue timeline value it will
+    // signal, flushSubmits hands everything collected to one vkQueueSubmit2. endFrame flushes every
+    // queue, waiting on or polling an unflushed value flushes its queue
+    //
+    std::uint64_t enqueueSubmit(Queue&                                 queue,
+                                std::span<const VkCommandBuffer>       commandBuffers,
+                                std::span<const VkSemaphoreSubmitInfo> waits   = {},
+                                std::span<const VkSemaphoreSubmitInfo> signals = {});
+    VkResult      flushSubmits(RendererState& state, Queue& queue);
+    VkResult      flushAllSubmits(RendererState& state);
+    std::uint64_t completedTimelineValue(RendererState& state, Queue& queue);
+    bool          isTimelineReached(RendererState& state, Queue& queue, std::uint64_t value);
+    VkResult      waitTimeline(RendererState& state,
+                               Queue&         queue,
+                               std::uint64_t  value,
+                               std::uint64_t  timeout = std::numeric_limits<std::uint64_t>::max());
+
+    // An in-flight submitAsync, holds on to its command pool until it completed
+    struct SubmitTicket {
+        PoolInfo      poolInfo      = {};
+        std::uint64_t timelineValue = 0;  // on poolInfo.queue
+    };
+
+    VkResult   beginOneTimeSubmit(VkCommandBuffer cmd);
+    VkResult   endImmediateSubmit(RendererState& state, const PoolInfo& poolInfo);
+    ReturnCode endAsyncSubmit(RendererState& state, SubmitTicket& ticket);
+    // Both release the pool once the submit retired, a default ticket counts as complete
+    bool       isSubmitComplete(RendererState& state, SubmitTicket& ticket);
+    ReturnCode waitForSubmit(RendererState& state, SubmitTicket& ticket);
+
+    // Records function(cmd) into the pool's command buffer, submits it and waits for it to retire
+    template <typename Function>
+    VkResult immediateSubmit(RendererState& state, const PoolInfo& poolInfo, Function&& function) {
+        const VkCommandBuffer cmd = poolInfo.queue->commandBuffers[poolInfo.poolIndex];
+        if(VkResult res = beginOneTimeSubmit(cmd)) {
+            return res;
+        }
+        function(cmd);
+        return endImmediateSubmit(state, poolInfo);
+    }
+
+    // Like immediateSubmit on a pool of its own, but returns as soon as the work is queued.
+    // The ticket is only valid on success
+    template <typename Function>
+    ReturnCode submitAsync(SubmitTicket&  ticket,
+                           RendererState& state,
+                           Function&&     function,
+                           VkQueueFlags   queueFlags = VK_QUEUE_GRAPHICS_BIT) {
+        ticket                    = { .poolInfo = lockCommandPool(state, queueFlags) };
+        const VkCommandBuffer cmd = ticket.poolInfo.queue->commandBuffers[ticket.poolInfo.poolIndex];
+        if(beginOneTimeSubmit(cmd) != VK_SUCCESS) {
+            unlockCommandPool(state, ticket.poolInfo);
+            ticket = {};
+            return ReturnCode::UNKNOWN;
+        }
+        function(cmd);
+        return endAsyncSubmit(state, ticket);
+    }
+
     template <typename... Sets>
     void bindDescriptorSetsInternal(VkCommandBuffer      commandBuffer,
                                     kvk::Pipeline&       pipeline,
@@ -745,4 +1737,14 @@ namespace kvk {
                                                        bool                 isPushDescriptor,
                                                        std::string_view     name);
 
+    //
+    // Returns the shared sampler for info, creating it on first use. Samplers are owned by the
+    // cache and must not be destroyed by the caller, VK_NULL_HANDLE when info chains anything
+    // but VkSamplerReductionModeCreateInfo or maxSamplerAllocationCount would be exceeded
+    //
+    VkSampler             samplerFromCache(Cache&                     cache,
+                                           const VkSamplerCreateInfo& info,
+                                           std::string_view           name = {});
+    void                  destroyCachedSamplers(Cache& cache);
+
 }
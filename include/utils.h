@@ -3,6 +3,10 @@
 #include <span>
 #include <functional>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <vector>
 
 #include "common.h"
 #include "vulkan/vulkan_core.h"
@@ -12,6 +16,14 @@ namespace kvk {
 	  Misc.
 	  =====================================*/
     std::uint32_t getMipLevels(std::uint32_t width, std::uint32_t height);
+    // Format storage views of an image in `format` have to use, sRGB formats map to their UNORM twin
+    VkFormat      storageCompatibleFormat(VkFormat format);
+    // Bytes per texel, or per block for compressed formats. Unknown formats report 16
+    std::uint32_t formatBlockSize(VkFormat format);
+    // Next buffer-image copy offset at or after offset for format, a multiple of its block size and of 4
+    std::uint64_t alignStagingOffset(std::uint64_t offset, VkFormat format);
+    // 64-bit FNV-1a over size bytes, pass the previous result as seed to hash several ranges as one
+    std::uint64_t hashContents(const void* data, std::uint64_t size, std::uint64_t seed = 0xCBF29CE484222325ull);
 
 	/*=====================================
 	  Struct fillers
@@ -69,12 +81,6 @@ namespace kvk {
 	/*=====================================
 	  Commands
 	  =====================================*/
-	VkResult immediateSubmit(VkCommandBuffer cmd,
-							 VkDevice device,
-							 VkQueue queue,
-                             std::mutex& queueMutex,
-							 std::function<void(VkCommandBuffer)>&& function);
-
 	void transitionImage(VkCommandBuffer cmd,
 						 VkImage image,
 						 VkImageLayout currentLayout,
@@ -104,5 +110,69 @@ namespace kvk {
 						  VkExtent2D dstExtent,
                           VkImageAspectFlags aspect = VK_IMAGE_ASPECT_COLOR_BIT,
                           std::uint32_t srcMipLevel = 0,
-                          std::uint32_t dstMipLevel = 0);
+                          std::uint32_t dstMipLevel = 0,
+                          std::uint32_t layerCount = 1);
+
+    // Collects barriers until the next point something depends on them and records them as a single
+    // vkCmdPipelineBarrier2. Image / buffer barriers with identical masks and layouts on neighbouring
+    // subresources / ranges merge, memory barriers always fold into one.
+    struct BarrierBatch {
+        std::vector<VkImageMemoryBarrier2>  imageBarriers;
+        std::vector<VkBufferMemoryBarrier2> bufferBarriers;
+        VkMemoryBarrier2                    memoryBarrier    = { .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2 };
+        bool                                hasMemoryBarrier = false;
+
+        BarrierBatch& image(VkImage                 image,
+                            VkImageLayout           oldLayout,
+                            VkImageLayout           newLayout,
+                            VkPipelineStageFlags2   srcStageMask,
+                            VkAccessFlags2          srcAccessMask,
+                            VkPipelineStageFlags2   dstStageMask,
+                            VkAccessFlags2          dstAccessMask,
+                            VkImageSubresourceRange range,
+                            std::uint32_t           srcQueueFamily = VK_QUEUE_FAMILY_IGNORED,
+                            std::uint32_t           dstQueueFamily = VK_QUEUE_FAMILY_IGNORED);
+        BarrierBatch& buffer(VkBuffer              buffer,
+                             VkPipelineStageFlags2 srcStageMask,
+                             VkAccessFlags2        srcAccessMask,
+                             VkPipelineStageFlags2 dstStageMask,
+                             VkAccessFlags2        dstAccessMask,
+                             VkDeviceSize          offset = 0,
+                             VkDeviceSize          size   = VK_WHOLE_SIZE);
+        BarrierBatch& memory(VkPipelineStageFlags2 srcStageMask,
+                             VkAccessFlags2        srcAccessMask,
+                             VkPipelineStageFlags2 dstStageMask,
+                             VkAccessFlags2        dstAccessMask);
+
+        bool          isEmpty() const;
+        void          clear();
+        // Records everything collected so far, no-op when empty
+        void          flush(VkCommandBuffer cmd);
+    };
+
+	/*=====================================
+	  Workers
+	  =====================================*/
+    // Threads that live for the whole process so parallel loops don't pay for thread creation each call.
+    // parallelFor runs function(index) once for every index in [0, count), the calling thread included, and
+    // returns when all of them finished. Called from inside a job it runs the loop inline.
+    struct WorkerPool {
+        std::vector<std::thread>          threads;
+        std::deque<std::function<void()>> jobs;
+        std::mutex                        mutex;
+        std::condition_variable           jobReady;
+        bool                              stopping = false;
+
+        WorkerPool();
+        ~WorkerPool();
+        WorkerPool(const WorkerPool&)            = delete;
+        WorkerPool& operator=(const WorkerPool&) = delete;
+
+        // Worker threads plus the caller
+        std::uint32_t concurrency() const;
+        void          parallelFor(std::uint32_t count, const std::function<void(std::uint32_t)>& function);
+    };
+
+    // The process wide pool, started on first use
+    WorkerPool& workerPool();
 }
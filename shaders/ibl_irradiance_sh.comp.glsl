@@ -0,0 +1,47 @@
+#version 460
+
+// Expands projected SH coefficients into a low resolution irradiance cube.
+// Stores irradiance / PI so a Lambertian surface only multiplies by albedo.
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+layout(set = 0, binding = 1) writeonly uniform image2DArray outputFaces;
+layout(set = 0, binding = 2) readonly buffer ShCoefficients {
+    vec4 coefficients[9];
+};
+
+const float PI = 3.14159265359;
+
+vec3 cubeDirection(uint face, vec2 uv) {
+    const vec2 p = uv * 2.0 - 1.0;
+    switch(face) {
+    case 0: return normalize(vec3( 1.0, -p.y, -p.x));
+    case 1: return normalize(vec3(-1.0, -p.y,  p.x));
+    case 2: return normalize(vec3( p.x,  1.0,  p.y));
+    case 3: return normalize(vec3( p.x, -1.0, -p.y));
+    case 4: return normalize(vec3( p.x, -p.y,  1.0));
+    default: return normalize(vec3(-p.x, -p.y, -1.0));
+    }
+}
+
+void main() {
+    const uvec3 id   = gl_GlobalInvocationID;
+    const ivec2 size = imageSize(outputFaces).xy;
+    if(any(greaterThanEqual(ivec2(id.xy), size))) {
+        return;
+    }
+
+    const vec3 d = cubeDirection(id.z, (vec2(id.xy) + 0.5) / vec2(size));
+
+    // Cosine lobe convolution: A0 = PI, A1 = 2PI/3, A2 = PI/4
+    const float a0 = PI;
+    const float a1 = 2.0 * PI / 3.0;
+    const float a2 = PI / 4.0;
+    vec3 irradiance = a0 * 0.282095 * coefficients[0].rgb
+                    + a1 * 0.488603 * (coefficients[1].rgb * d.y + coefficients[2].rgb * d.z + coefficients[3].rgb * d.x)
+                    + a2 * (1.092548 * (coefficients[4].rgb * d.x * d.y + coefficients[5].rgb * d.y * d.z + coefficients[7].rgb * d.x * d.z)
+                          + 0.315392 * coefficients[6].rgb * (3.0 * d.z * d.z - 1.0)
+                          + 0.546274 * coefficients[8].rgb * (d.x * d.x - d.y * d.y));
+
+    imageStore(outputFaces, ivec3(id), vec4(max(irradiance, vec3(0.0)) / PI, 1.0));
+}
@@ -0,0 +1,94 @@
+#version 460
+
+// GGX specular prefiltering of an environment cube, one output mip per dispatch.
+// Uses filtered importance sampling: every sample reads the source mip whose
+// texel solid angle matches the solid angle the sample covers.
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+layout(set = 0, binding = 0) uniform samplerCube environment;
+layout(set = 0, binding = 1) writeonly uniform image2DArray outputFaces;
+
+layout(push_constant) uniform constants {
+    float roughness;
+    uint  sampleCount;
+    uint  sourceSize;
+    uint  sourceMipCount;
+} PushConstants;
+
+const float PI = 3.14159265359;
+
+vec3 cubeDirection(uint face, vec2 uv) {
+    const vec2 p = uv * 2.0 - 1.0;
+    switch(face) {
+    case 0: return normalize(vec3( 1.0, -p.y, -p.x));
+    case 1: return normalize(vec3(-1.0, -p.y,  p.x));
+    case 2: return normalize(vec3( p.x,  1.0,  p.y));
+    case 3: return normalize(vec3( p.x, -1.0, -p.y));
+    case 4: return normalize(vec3( p.x, -p.y,  1.0));
+    default: return normalize(vec3(-p.x, -p.y, -1.0));
+    }
+}
+
+vec2 hammersley(uint i, uint count) {
+    uint bits = bitfieldReverse(i);
+    return vec2(float(i) / float(count), float(bits) * 2.3283064365386963e-10);
+}
+
+vec3 importanceSampleGGX(vec2 xi, vec3 n, float alpha) {
+    const float phi      = 2.0 * PI * xi.x;
+    const float cosTheta = sqrt((1.0 - xi.y) / (1.0 + (alpha * alpha - 1.0) * xi.y));
+    const float sinTheta = sqrt(1.0 - cosTheta * cosTheta);
+    const vec3  h        = vec3(cos(phi) * sinTheta, sin(phi) * sinTheta, cosTheta);
+
+    const vec3  up       = abs(n.z) < 0.999 ? vec3(0.0, 0.0, 1.0) : vec3(1.0, 0.0, 0.0);
+    const vec3  tangent  = normalize(cross(up, n));
+    const vec3  binormal = cross(n, tangent);
+    return normalize(tangent * h.x + binormal * h.y + n * h.z);
+}
+
+float distributionGGX(float nDotH, float alpha) {
+    const float a2    = alpha * alpha;
+    const float denom = nDotH * nDotH * (a2 - 1.0) + 1.0;
+    return a2 / (PI * denom * denom);
+}
+
+void main() {
+    const uvec3 id   = gl_GlobalInvocationID;
+    const ivec2 size = imageSize(outputFaces).xy;
+    if(any(greaterThanEqual(ivec2(id.xy), size))) {
+        return;
+    }
+
+    const vec3 n = cubeDirection(id.z, (vec2(id.xy) + 0.5) / vec2(size));
+    if(PushConstants.roughness == 0.0) {
+        imageStore(outputFaces, ivec3(id), vec4(textureLod(environment, n, 0.0).rgb, 1.0));
+        return;
+    }
+
+    const float alpha            = PushConstants.roughness * PushConstants.roughness;
+    const float texelSolidAngle  = 4.0 * PI / (6.0 * float(PushConstants.sourceSize * PushConstants.sourceSize));
+    const float maxLod           = float(PushConstants.sourceMipCount - 1u);
+
+    vec3        color            = vec3(0.0);
+    float       weight           = 0.0;
+    for(uint i = 0u; i != PushConstants.sampleCount; i++) {
+        // N = V = R, so L is H mirrored around the normal
+        const vec3  h     = importanceSampleGGX(hammersley(i, PushConstants.sampleCount), n, alpha);
+        const vec3  l     = 2.0 * dot(n, h) * h - n;
+        const float nDotL = dot(n, l);
+        if(nDotL <= 0.0) {
+            continue;
+        }
+
+        const float nDotH            = max(dot(n, h), 0.0);
+        const float pdf              = distributionGGX(nDotH, alpha) * 0.25;
+        const float sampleSolidAngle = 1.0 / (float(PushConstants.sampleCount) * pdf + 1e-4);
+        const float lod              = clamp(0.5 * log2(sampleSolidAngle / texelSolidAngle) + 1.0, 0.0, maxLod);
+
+        color  += textureLod(environment, l, lod).rgb * nDotL;
+        weight += nDotL;
+    }
+
+    imageStore(outputFaces, ivec3(id), vec4(color / max(weight, 1e-4), 1.0));
+}
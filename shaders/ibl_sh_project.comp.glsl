@@ -0,0 +1,99 @@
+#version 460
+
+// Projects an environment cube onto 3rd order (9 coefficient) spherical harmonics.
+// Dispatched as a single workgroup that walks a <= 32x32 mip of every face.
+
+layout(local_size_x = 64) in;
+
+layout(set = 0, binding = 0) uniform samplerCube environment;
+layout(set = 0, binding = 2) writeonly buffer ShCoefficients {
+    vec4 coefficients[9];
+};
+
+layout(push_constant) uniform constants {
+    float roughness;
+    uint  sampleCount;
+    uint  sourceSize;
+    uint  sourceMipCount;
+} PushConstants;
+
+shared vec3 partialSums[64][9];
+
+vec3 cubeDirection(uint face, vec2 uv) {
+    const vec2 p = uv * 2.0 - 1.0;
+    switch(face) {
+    case 0: return normalize(vec3( 1.0, -p.y, -p.x));
+    case 1: return normalize(vec3(-1.0, -p.y,  p.x));
+    case 2: return normalize(vec3( p.x,  1.0,  p.y));
+    case 3: return normalize(vec3( p.x, -1.0, -p.y));
+    case 4: return normalize(vec3( p.x, -p.y,  1.0));
+    default: return normalize(vec3(-p.x, -p.y, -1.0));
+    }
+}
+
+float areaElement(float x, float y) {
+    return atan(x * y, sqrt(x * x + y * y + 1.0));
+}
+
+float texelSolidAngle(vec2 texel, float size) {
+    const vec2  p0 = (texel / size) * 2.0 - 1.0;
+    const vec2  p1 = ((texel + 1.0) / size) * 2.0 - 1.0;
+    return areaElement(p0.x, p0.y) - areaElement(p0.x, p1.y) - areaElement(p1.x, p0.y) + areaElement(p1.x, p1.y);
+}
+
+void evaluateSh(vec3 d, out float basis[9]) {
+    basis[0] = 0.282095;
+    basis[1] = 0.488603 * d.y;
+    basis[2] = 0.488603 * d.z;
+    basis[3] = 0.488603 * d.x;
+    basis[4] = 1.092548 * d.x * d.y;
+    basis[5] = 1.092548 * d.y * d.z;
+    basis[6] = 0.315392 * (3.0 * d.z * d.z - 1.0);
+    basis[7] = 1.092548 * d.x * d.z;
+    basis[8] = 0.546274 * (d.x * d.x - d.y * d.y);
+}
+
+void main() {
+    const uint  index     = gl_LocalInvocationIndex;
+    const uint  lod       = min(uint(max(int(findMSB(PushConstants.sourceSize)) - 5, 0)), PushConstants.sourceMipCount - 1u);
+    const uint  size      = max(PushConstants.sourceSize >> lod, 1u);
+    const uint  faceTexels = size * size;
+
+    vec3        sums[9];
+    for(uint i = 0u; i != 9u; i++) {
+        sums[i] = vec3(0.0);
+    }
+
+    for(uint texel = index; texel < faceTexels * 6u; texel += 64u) {
+        const uint  face        = texel / faceTexels;
+        const uint  faceTexel   = texel % faceTexels;
+        const vec2  coord       = vec2(faceTexel % size, faceTexel / size);
+        const vec3  direction   = cubeDirection(face, (coord + 0.5) / float(size));
+        const vec3  radiance    = textureLod(environment, direction, float(lod)).rgb;
+        const float solidAngle  = texelSolidAngle(coord, float(size));
+
+        float       basis[9];
+        evaluateSh(direction, basis);
+        for(uint i = 0u; i != 9u; i++) {
+            sums[i] += radiance * basis[i] * solidAngle;
+        }
+    }
+
+    for(uint i = 0u; i != 9u; i++) {
+        partialSums[index][i] = sums[i];
+    }
+    barrier();
+
+    for(uint stride = 32u; stride != 0u; stride >>= 1u) {
+        if(index < stride) {
+            for(uint i = 0u; i != 9u; i++) {
+                partialSums[index][i] += partialSums[index + stride][i];
+            }
+        }
+        barrier();
+    }
+
+    if(index < 9u) {
+        coefficients[index] = vec4(partialSums[0][index], 0.0);
+    }
+}
@@ -0,0 +1,155 @@
+#version 460
+#extension GL_KHR_shader_subgroup_basic : require
+#extension GL_KHR_shader_subgroup_quad : require
+#extension GL_EXT_shader_image_load_formatted : require
+
+// Single pass mip generation.
+// Every workgroup reduces a 64x64 tile of baseMip down to a single texel (6 mips),
+// the last workgroup to finish then reduces the resulting (at most 64x64) mip
+// another 6 times. Array layers / cube faces are dispatched along z.
+
+layout(local_size_x = 256) in;
+
+layout(constant_id = 0) const uint FILTER = 0;
+
+#define FILTER_AVERAGE 0
+#define FILTER_MIN     1
+#define FILTER_MAX     2
+
+#define MAX_MIP_COUNT  16
+#define FLAG_SRGB      1u
+
+layout(set = 0, binding = 0) coherent uniform image2DArray mips[MAX_MIP_COUNT];
+layout(set = 0, binding = 1) coherent buffer Counters {
+    uint counters[];
+};
+
+layout(push_constant) uniform constants {
+    uint baseMip;
+    uint mipCount;
+    uint counterBase;
+    uint flags;
+} PushConstants;
+
+shared vec4 reductionTile[64];
+shared uint isLastWorkgroup;
+
+vec4 toLinear(vec4 color) {
+    const vec3 lo = color.rgb / 12.92;
+    const vec3 hi = pow((color.rgb + 0.055) / 1.055, vec3(2.4));
+    return vec4(mix(hi, lo, lessThanEqual(color.rgb, vec3(0.04045))), color.a);
+}
+
+vec4 toSrgb(vec4 color) {
+    const vec3 lo = color.rgb * 12.92;
+    const vec3 hi = 1.055 * pow(color.rgb, vec3(1.0 / 2.4)) - 0.055;
+    return vec4(mix(hi, lo, lessThanEqual(color.rgb, vec3(0.0031308))), color.a);
+}
+
+vec4 reduce4(vec4 a, vec4 b, vec4 c, vec4 d) {
+    if(FILTER == FILTER_MIN) {
+        return min(min(a, b), min(c, d));
+    } else if(FILTER == FILTER_MAX) {
+        return max(max(a, b), max(c, d));
+    }
+    return (a + b + c + d) * 0.25;
+}
+
+vec4 reduceQuad(vec4 v) {
+    return reduce4(v,
+                   subgroupQuadSwapHorizontal(v),
+                   subgroupQuadSwapVertical(v),
+                   subgroupQuadSwapDiagonal(v));
+}
+
+// Morton order: every 4 consecutive invocations form a 2x2 block,
+// every 16 a 4x4 block and so on
+uvec2 mortonDecode(uint index) {
+    const uint x = (index & 1u) | ((index >> 1u) & 2u) | ((index >> 2u) & 4u) | ((index >> 3u) & 8u);
+    const uint y = ((index >> 1u) & 1u) | ((index >> 2u) & 2u) | ((index >> 3u) & 4u) | ((index >> 4u) & 8u);
+    return uvec2(x, y);
+}
+
+vec4 loadTexel(uint mip, ivec2 coord, int layer) {
+    const ivec2 size  = imageSize(mips[mip]).xy;
+    const vec4  texel = imageLoad(mips[mip], ivec3(min(coord, size - 1), layer));
+    return (PushConstants.flags & FLAG_SRGB) != 0u ? toLinear(texel) : texel;
+}
+
+void storeTexel(uint mip, ivec2 coord, int layer, vec4 texel) {
+    const ivec2 size = imageSize(mips[mip]).xy;
+    if(all(lessThan(coord, size))) {
+        imageStore(mips[mip], ivec3(coord, layer), (PushConstants.flags & FLAG_SRGB) != 0u ? toSrgb(texel) : texel);
+    }
+}
+
+// Writes mips srcMip + 1 ..= srcMip + mipsToWrite (at most 6) of a 64x64 tile of srcMip
+void downsampleTile(uint srcMip, uvec2 tile, int layer, uint mipsToWrite) {
+    const uint  index = gl_LocalInvocationIndex;
+    const uvec2 local = mortonDecode(index);
+
+    // Level 1: every invocation owns a 2x2 block of level 1 texels
+    vec4        level1[4];
+    const ivec2 base1 = ivec2(tile * 32u + local * 2u);
+    for(uint i = 0u; i != 4u; i++) {
+        const ivec2 p1 = base1 + ivec2(i & 1u, i >> 1u);
+        const ivec2 p0 = p1 * 2;
+        level1[i]      = reduce4(loadTexel(srcMip, p0, layer),
+                                 loadTexel(srcMip, p0 + ivec2(1, 0), layer),
+                                 loadTexel(srcMip, p0 + ivec2(0, 1), layer),
+                                 loadTexel(srcMip, p0 + ivec2(1, 1), layer));
+        storeTexel(srcMip + 1u, p1, layer, level1[i]);
+    }
+    if(mipsToWrite == 1u) {
+        return;
+    }
+
+    // Level 2: one texel per invocation, 16x16 per tile
+    vec4 value = reduce4(level1[0], level1[1], level1[2], level1[3]);
+    storeTexel(srcMip + 2u, ivec2(tile * 16u + local), layer, value);
+
+    // Levels 3-6: quads reduce through subgroup ops, the results are compacted
+    // through shared memory so the next level again sits in consecutive quads
+    uint activeCount = 256u;
+    for(uint level = 3u; level <= mipsToWrite; level++) {
+        if(index < activeCount) {
+            value = reduceQuad(value);
+            if((index & 3u) == 0u) {
+                const uint next = index >> 2u;
+                storeTexel(srcMip + level, ivec2(tile * (64u >> level) + mortonDecode(next)), layer, value);
+                reductionTile[next] = value;
+            }
+        }
+        activeCount >>= 2u;
+        barrier();
+        if(index < activeCount) {
+            value = reductionTile[index];
+        }
+        barrier();
+    }
+}
+
+void main() {
+    const int  layer       = int(gl_WorkGroupID.z);
+    const uint mipsToWrite = PushConstants.mipCount;
+
+    downsampleTile(PushConstants.baseMip, gl_WorkGroupID.xy, layer, min(mipsToWrite, 6u));
+    if(mipsToWrite <= 6u) {
+        return;
+    }
+
+    // The 1x1 result of this tile has to be visible to whichever workgroup finishes last
+    memoryBarrierImage();
+    barrier();
+    if(gl_LocalInvocationIndex == 0u) {
+        const uint workgroupCount = gl_NumWorkGroups.x * gl_NumWorkGroups.y;
+        const uint finished       = atomicAdd(counters[PushConstants.counterBase + layer], 1u);
+        isLastWorkgroup           = finished == workgroupCount - 1u ? 1u : 0u;
+    }
+    barrier();
+    if(isLastWorkgroup == 0u) {
+        return;
+    }
+
+    downsampleTile(PushConstants.baseMip + 6u, uvec2(0u), layer, mipsToWrite - 6u);
+}
@@ -0,0 +1,286 @@
+#include "vulkan/vulkan_core.h"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <limits>
+
+#include "common.h"
+#include "krender.h"
+#include "utils.h"
+
+namespace kvk {
+
+    static constexpr std::uint32_t ATLAS_TEXEL_SIZE = 4;
+
+    struct SkylineNode {
+        std::uint32_t x;
+        std::uint32_t y;
+        std::uint32_t width;
+    };
+
+    // Nodes cover [0, size) without gaps, every node is the height of the skyline over its span
+    struct SkylineLayer {
+        std::vector<SkylineNode> nodes;
+    };
+
+    static bool skylineFit(const SkylineLayer& layer,
+                           std::uint64_t       index,
+                           std::uint32_t       width,
+                           std::uint32_t       height,
+                           std::uint32_t       size,
+                           std::uint32_t&      y) {
+        const std::uint32_t x = layer.nodes[index].x;
+        if(x + width > size) {
+            return false;
+        }
+
+        y                       = 0;
+        std::uint32_t remaining = width;
+        for(std::uint64_t i = index; remaining != 0; i++) {
+            y          = std::max(y, layer.nodes[i].y);
+            remaining -= std::min(remaining, layer.nodes[i].width);
+            if(y + height > size) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    //
+    // Bottom-left: the lowest resulting top edge wins, ties go to the narrowest node
+    //
+    static bool skylineInsert(SkylineLayer&  layer,
+                              std::uint32_t  width,
+                              std::uint32_t  height,
+                              std::uint32_t  size,
+                              std::uint32_t& outX,
+                              std::uint32_t& outY) {
+        std::vector<SkylineNode>& nodes     = layer.nodes;
+        std::uint64_t             bestIndex = nodes.size();
+        std::uint32_t             bestTop   = std::numeric_limits<std::uint32_t>::max();
+        std::uint32_t             bestWidth = std::numeric_limits<std::uint32_t>::max();
+        std::uint32_t             bestY     = 0;
+        for(std::uint64_t i = 0; i != nodes.size(); i++) {
+            std::uint32_t y;
+            if(!skylineFit(layer, i, width, height, size, y)) {
+                continue;
+            }
+            if(y + height < bestTop || (y + height == bestTop && nodes[i].width < bestWidth)) {
+                bestIndex = i;
+                bestTop   = y + height;
+                bestWidth = nodes[i].width;
+                bestY     = y;
+            }
+        }
+        if(bestIndex == nodes.size()) {
+            return false;
+        }
+
+        outX = nodes[bestIndex].x;
+        outY = bestY;
+        nodes.insert(nodes.begin() + bestIndex, SkylineNode{ outX, bestTop, width });
+
+        // Cut the nodes now hidden under the new one
+        for(std::uint64_t i = bestIndex + 1; i < nodes.size();) {
+            const SkylineNode&  previous    = nodes[i - 1];
+            SkylineNode&        node        = nodes[i];
+            const std::uint32_t previousEnd = previous.x + previous.width;
+            if(node.x >= previousEnd) {
+                break;
+            }
+            const std::uint32_t overlap = previousEnd - node.x;
+            if(node.width <= overlap) {
+                nodes.erase(nodes.begin() + i);
+                continue;
+            }
+            node.x     += overlap;
+            node.width -= overlap;
+            break;
+        }
+
+        for(std::uint64_t i = 0; i + 1 < nodes.size();) {
+            if(nodes[i].y == nodes[i + 1].y) {
+                nodes[i].width += nodes[i + 1].width;
+                nodes.erase(nodes.begin() + i + 1);
+            } else {
+                i++;
+            }
+        }
+        return true;
+    }
+
+    //
+    // Copies texture into dst with guardBand texels of its clamped edge on every side
+    //
+    static void writePadded(u8*                 dst,
+                            const AtlasTexture& texture,
+                            std::uint32_t       guardBand) {
+        const std::uint32_t width        = texture.extent.width;
+        const std::uint32_t height       = texture.extent.height;
+        const std::uint32_t paddedWidth  = width + 2 * guardBand;
+        const std::uint32_t paddedHeight = height + 2 * guardBand;
+        const u8*           src          = (const u8*)texture.data;
+        for(std::uint32_t y = 0; y != paddedHeight; y++) {
+            const std::uint32_t srcY   = std::min(height - 1, y > guardBand ? y - guardBand : 0);
+            const u8*           srcRow = src + std::uint64_t(srcY) * width * ATLAS_TEXEL_SIZE;
+            u8*                 dstRow = dst + std::uint64_t(y) * paddedWidth * ATLAS_TEXEL_SIZE;
+            for(std::uint32_t x = 0; x != guardBand; x++) {
+                memcpy(dstRow + x * ATLAS_TEXEL_SIZE, srcRow, ATLAS_TEXEL_SIZE);
+                memcpy(dstRow + (guardBand + width + x) * ATLAS_TEXEL_SIZE, srcRow + (width - 1) * ATLAS_TEXEL_SIZE, ATLAS_TEXEL_SIZE);
+            }
+            memcpy(dstRow + guardBand * ATLAS_TEXEL_SIZE, srcRow, std::uint64_t(width) * ATLAS_TEXEL_SIZE);
+        }
+    }
+
+    ReturnCode createTextureAtlas(TextureAtlas&                 atlas,
+                                  RendererState&                state,
+                                  std::span<const AtlasTexture> textures,
+                                  const VkFormat                format,
+                                  std::uint32_t                 layerSize,
+                                  std::uint32_t                 guardBand,
+                                  std::uint32_t                 mipLevels) {
+        KAMSKI_PROFILE();
+        if(textures.empty()) {
+            logError("Texture atlas needs at least one texture");
+            return ReturnCode::WRONG_PARAMETERS;
+        }
+        // Guard bands are written texel by texel, which rules out block compressed formats too
+        if(formatBlockSize(format) != ATLAS_TEXEL_SIZE) {
+            logError("Texture atlas format %d is not %u bytes per texel", int(format), ATLAS_TEXEL_SIZE);
+            return ReturnCode::WRONG_PARAMETERS;
+        }
+        if(mipLevels > 1 && guardBand < (1u << (mipLevels - 1))) {
+            logWarning("Atlas guard band of %u texels is too small for %u mips, the last mips will bleed", guardBand, mipLevels);
+        }
+
+        //
+        // Pack tallest first, which keeps the skyline flat
+        //
+        std::vector<std::uint32_t> order(textures.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](std::uint32_t a, std::uint32_t b) {
+            if(textures[a].extent.height != textures[b].extent.height) {
+                return textures[a].extent.height > textures[b].extent.height;
+            }
+            return textures[a].extent.width > textures[b].extent.width;
+        });
+
+        struct Placement {
+            std::uint32_t x;
+            std::uint32_t y;
+            std::uint32_t layer;
+        };
+        std::vector<Placement>    placements(textures.size());
+        std::vector<SkylineLayer> layers;
+        std::uint64_t             stagingSize = 0;
+        for(std::uint32_t index : order) {
+            const AtlasTexture& texture      = textures[index];
+            const std::uint32_t paddedWidth  = texture.extent.width + 2 * guardBand;
+            const std::uint32_t paddedHeight = texture.extent.height + 2 * guardBand;
+            if(texture.extent.width == 0 || texture.extent.height == 0 || paddedWidth > layerSize || paddedHeight > layerSize) {
+                logError("Texture %u (%ux%u) does not fit an atlas layer of %u", index, texture.extent.width, texture.extent.height, layerSize);
+                return ReturnCode::WRONG_PARAMETERS;
+            }
+
+            Placement& placement = placements[index];
+            bool       placed    = false;
+            for(std::uint32_t layer = 0; layer != layers.size() && !placed; layer++) {
+                placed          = skylineInsert(layers[layer], paddedWidth, paddedHeight, layerSize, placement.x, placement.y);
+                placement.layer = layer;
+            }
+            if(!placed) {
+                layers.push_back({ .nodes = { { 0, 0, layerSize } } });
+                placement.layer = std::uint32_t(layers.size() - 1);
+                placed          = skylineInsert(layers.back(), paddedWidth, paddedHeight, layerSize, placement.x, placement.y);
+                assert(placed);
+            }
+            stagingSize += std::uint64_t(paddedWidth) * paddedHeight * ATLAS_TEXEL_SIZE;
+        }
+        if(layers.size() > state.limits.maxImageArrayLayers) {
+            logError("Texture atlas needs %llu layers, the device supports %u", (unsigned long long)layers.size(), state.limits.maxImageArrayLayers);
+            return ReturnCode::WRONG_PARAMETERS;
+        }
+
+        AllocatedBuffer stagingBuffer = {};
+        ReturnCode      rc            = createBuffer(stagingBuffer,
+                                                     state.device,
+                                                     state.allocator,
+                                                     stagingSize,
+                                                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                                     VMA_MEMORY_USAGE_CPU_ONLY);
+        if(rc != ReturnCode::OK) {
+            logError("Could not create atlas staging buffer");
+            return rc;
+        }
+        defer {
+            destroyBuffer(stagingBuffer, state.allocator);
+        };
+
+        u8*                            staging = (u8*)stagingBuffer.allocation->GetMappedData();
+        std::vector<VkBufferImageCopy> regions(textures.size());
+        std::uint64_t                  offset  = 0;
+        atlas.regions.resize(textures.size());
+        for(std::uint32_t i = 0; i != textures.size(); i++) {
+            const AtlasTexture& texture      = textures[i];
+            const Placement&    placement    = placements[i];
+            const std::uint32_t paddedWidth  = texture.extent.width + 2 * guardBand;
+            const std::uint32_t paddedHeight = texture.extent.height + 2 * guardBand;
+            writePadded(staging + offset, texture, guardBand);
+            regions[i] = VkBufferImageCopy{
+                .bufferOffset      = offset,
+                .bufferRowLength   = 0,
+                .bufferImageHeight = 0,
+                .imageSubresource  = {
+                     .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+                     .mipLevel       = 0,
+                     .baseArrayLayer = placement.layer,
+                     .layerCount     = 1,
+                },
+                .imageOffset = { std::int32_t(placement.x), std::int32_t(placement.y), 0 },
+                .imageExtent = { paddedWidth, paddedHeight, 1 },
+            };
+            offset           += std::uint64_t(paddedWidth) * paddedHeight * ATLAS_TEXEL_SIZE;
+
+            atlas.regions[i]  = AtlasRegion{
+                 .uvOffset = glm::vec2(placement.x + guardBand, placement.y + guardBand) / float(layerSize),
+                 .uvScale  = glm::vec2(texture.extent.width, texture.extent.height) / float(layerSize),
+                 .layer    = placement.layer,
+            };
+        }
+
+        rc = createImage(atlas.image,
+                         state,
+                         stagingBuffer,
+                         regions,
+                         format,
+                         { layerSize, layerSize, 1 },
+                         VK_IMAGE_USAGE_SAMPLED_BIT,
+                         mipLevels,
+                         false,
+                         mipLevels > 1,
+                         std::uint32_t(layers.size()));
+        if(rc != ReturnCode::OK) {
+            logError("Could not create atlas image");
+            atlas.regions.clear();
+            return rc;
+        }
+
+        atlas.arrayView = imageView(state, atlas.image, { .type = VK_IMAGE_VIEW_TYPE_2D_ARRAY });
+        if(atlas.arrayView == VK_NULL_HANDLE) {
+            destroyTextureAtlas(atlas, state);
+            return ReturnCode::UNKNOWN;
+        }
+        return ReturnCode::OK;
+    }
+
+    void destroyTextureAtlas(TextureAtlas& atlas, RendererState& state) {
+        KAMSKI_PROFILE();
+        if(atlas.image.image != VK_NULL_HANDLE) {
+            destroyImage(atlas.image, state.device, state.allocator);
+        }
+        atlas = {};
+    }
+
+}
@@ -0,0 +1,612 @@
+#include "vulkan/vulkan_core.h"
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+
+#include "common.h"
+#include "krender.h"
+#include "utils.h"
+
+namespace kvk {
+
+    static constexpr std::uint32_t IBL_CACHE_MAGIC   = 0x4C42494B; // "KIBL"
+    static constexpr std::uint32_t IBL_CACHE_VERSION = 2;
+    static constexpr std::uint64_t IBL_TEXEL_SIZE    = 8;
+    static constexpr std::uint64_t IBL_SH_SIZE       = IblProbe::SH_COEFFICIENTS * 4 * sizeof(float);
+
+    struct IblCacheHeader {
+        std::uint32_t magic;
+        std::uint32_t version;
+        std::uint64_t environmentHash;
+        std::uint32_t format;
+        std::uint32_t specularSize;
+        std::uint32_t specularMipCount;
+        std::uint32_t irradianceSize;
+        std::uint32_t sampleCount;
+        std::uint32_t reserved;
+    };
+
+    static std::uint64_t cubeMipSize(std::uint32_t size, std::uint32_t mip) {
+        const std::uint64_t mipSize = std::max(1u, size >> mip);
+        return mipSize * mipSize * 6 * IBL_TEXEL_SIZE;
+    }
+
+    // Fills one VkBufferImageCopy per mip of a tightly packed cube starting at offset, returns the end offset
+    static std::uint64_t cubeCopyRegions(VkBufferImageCopy* regions,
+                                         std::uint64_t      offset,
+                                         std::uint32_t      size,
+                                         std::uint32_t      mipCount) {
+        for(std::uint32_t mip = 0; mip != mipCount; mip++) {
+            const std::uint32_t mipSize = std::max(1u, size >> mip);
+            regions[mip]                = VkBufferImageCopy{
+                .bufferOffset      = offset,
+                .bufferRowLength   = 0,
+                .bufferImageHeight = 0,
+                .imageSubresource  = {
+                     .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+                     .mipLevel       = mip,
+                     .baseArrayLayer = 0,
+                     .layerCount     = 6,
+                },
+                .imageExtent = { mipSize, mipSize, 1 },
+            };
+            offset += cubeMipSize(size, mip);
+        }
+        return offset;
+    }
+
+    ReturnCode IblBaker::init(RendererState&   state,
+                              Cache&           cache,
+                              std::string_view prefilterShaderName,
+                              std::string_view shShaderName,
+                              std::string_view irradianceShaderName) {
+        KAMSKI_PROFILE();
+        if(!state.storageImageWithoutFormat) {
+            logWarning("Storage images without format are not available, IBL probes cannot be baked");
+            return ReturnCode::UNKNOWN;
+        }
+
+        DescriptorSetLayoutBuilder builder;
+        builder.addBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER)
+            .addBinding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE)
+            .addBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+        if(!builder.buildPush(setLayout, state.device, VK_SHADER_STAGE_COMPUTE_BIT)) {
+            return ReturnCode::UNKNOWN;
+        }
+
+        const VkPushConstantRange pushConstantRange = {
+            .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+            .offset     = 0,
+            .size       = sizeof(PushConstants),
+        };
+        const VkPipelineLayoutCreateInfo layoutCreateInfo = {
+            .sType                  = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+            .setLayoutCount         = 1,
+            .pSetLayouts            = &setLayout,
+            .pushConstantRangeCount = 1,
+            .pPushConstantRanges    = &pushConstantRange,
+        };
+        VK_CHECK(vkCreatePipelineLayout(state.device, &layoutCreateInfo, nullptr, &layout));
+
+        const VkSamplerCreateInfo samplerInfo = {
+            .sType        = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+            .magFilter    = VK_FILTER_LINEAR,
+            .minFilter    = VK_FILTER_LINEAR,
+            .mipmapMode   = VK_SAMPLER_MIPMAP_MODE_LINEAR,
+            .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+            .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+            .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+            .minLod       = 0.0f,
+            .maxLod       = VK_LOD_CLAMP_NONE,
+        };
+        sampler = samplerFromCache(cache, samplerInfo, "ibl_sampler");
+        if(sampler == VK_NULL_HANDLE) {
+            return ReturnCode::UNKNOWN;
+        }
+
+        struct {
+            Pipeline*        pipeline;
+            std::string_view shaderName;
+            const char*      name;
+        } pipelines[] = {
+            { &prefilterPipeline, prefilterShaderName, "ibl_prefilter_ggx" },
+            { &shPipeline, shShaderName, "ibl_sh_project" },
+            { &irradiancePipeline, irradianceShaderName, "ibl_irradiance_sh" },
+        };
+        for(auto& pipeline : pipelines) {
+            ReturnCode rc = PipelineBuilder()
+                                .addShaders(pipeline.shaderName, VK_SHADER_STAGE_COMPUTE_BIT)
+                                .setPipelineLayout(layout)
+                                .buildCompute(*pipeline.pipeline, cache, state.device, pipeline.name);
+            if(rc != ReturnCode::OK) {
+                logError("Could not build %s pipeline", pipeline.name);
+                return rc;
+            }
+        }
+
+        return ReturnCode::OK;
+    }
+
+    void IblBaker::destroy(RendererState& state) {
+        KAMSKI_PROFILE();
+        vkDestroyPipeline(state.device, prefilterPipeline.handle, nullptr);
+        vkDestroyPipeline(state.device, shPipeline.handle, nullptr);
+        vkDestroyPipeline(state.device, irradiancePipeline.handle, nullptr);
+        vkDestroyPipelineLayout(state.device, layout, nullptr);
+        vkDestroyDescriptorSetLayout(state.device, setLayout, nullptr);
+        *this = {};
+    }
+
+    ReturnCode IblBaker::cmdBake(VkCommandBuffer           cmd,
+                                 RendererState&            state,
+                                 IblProbe&                 probe,
+                                 const AllocatedImage&     environment,
+                                 std::uint32_t             sampleCount,
+                                 std::vector<VkImageView>& views) {
+        KAMSKI_PROFILE();
+        const ImageViewKey faceView = {
+            .type  = VK_IMAGE_VIEW_TYPE_2D_ARRAY,
+            .range = { .mipCount = 1 },
+        };
+        VkImageView specularViews[16];
+        assert(probe.specular.mipCount <= 16);
+        for(std::uint32_t mip = 0; mip != probe.specular.mipCount; mip++) {
+            ImageViewKey key   = faceView;
+            key.range.baseMip  = mip;
+            specularViews[mip] = createImageView(state, probe.specular, key);
+            if(specularViews[mip] == VK_NULL_HANDLE) {
+                return ReturnCode::UNKNOWN;
+            }
+            views.push_back(specularViews[mip]);
+        }
+        const VkImageView irradianceView = createImageView(state, probe.irradiance, faceView);
+        if(irradianceView == VK_NULL_HANDLE) {
+            return ReturnCode::UNKNOWN;
+        }
+        views.push_back(irradianceView);
+
+        VkImageMemoryBarrier2 imageBarriers[2];
+        for(std::uint32_t i = 0; i != 2; i++) {
+            imageBarriers[i] = VkImageMemoryBarrier2{
+                .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                .srcStageMask        = VK_PIPELINE_STAGE_2_NONE,
+                .srcAccessMask       = 0,
+                .dstStageMask        = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                .dstAccessMask       = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                .oldLayout           = VK_IMAGE_LAYOUT_UNDEFINED,
+                .newLayout           = VK_IMAGE_LAYOUT_GENERAL,
+                .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .image               = i == 0 ? probe.specular.image : probe.irradiance.image,
+                .subresourceRange    = imageSubresourceRange(VK_IMAGE_ASPECT_COLOR_BIT),
+            };
+        }
+        VkDependencyInfo dependencyInfo = {
+            .sType                   = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+            .imageMemoryBarrierCount = 2,
+            .pImageMemoryBarriers    = imageBarriers,
+        };
+        vkCmdPipelineBarrier2(cmd, &dependencyInfo);
+
+        PushConstants pushConstants = {
+            .roughness      = 0.0f,
+            .sampleCount    = sampleCount,
+            .sourceSize     = environment.extent.width,
+            .sourceMipCount = environment.mipCount,
+        };
+
+        //
+        // Specular, every mip reads only the environment so they need no barriers in between
+        //
+        prefilterPipeline.bind(cmd);
+        const std::uint32_t specularSize = probe.specular.extent.width;
+        for(std::uint32_t mip = 0; mip != probe.specular.mipCount; mip++) {
+            DescriptorWriter writer;
+            writer.writeImage(0, environment.view, sampler, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+            writer.writeImage(1, specularViews[mip], VK_NULL_HANDLE, VK_IMAGE_LAYOUT_GENERAL, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+            writer.push(cmd, 0, prefilterPipeline);
+
+            pushConstants.roughness = probe.specular.mipCount > 1 ? float(mip) / float(probe.specular.mipCount - 1) : 0.0f;
+            prefilterPipeline.pushConstants(cmd, pushConstants);
+
+            const std::uint32_t mipSize = std::max(1u, specularSize >> mip);
+            vkCmdDispatch(cmd, (mipSize + 7) / 8, (mipSize + 7) / 8, 6);
+        }
+
+        //
+        // Irradiance
+        //
+        {
+            shPipeline.bind(cmd);
+            DescriptorWriter writer;
+            writer.writeImage(0, environment.view, sampler, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+            writer.writeBuffer(2, probe.sh.buffer, IBL_SH_SIZE, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+            writer.push(cmd, 0, shPipeline);
+            shPipeline.pushConstants(cmd, pushConstants);
+            vkCmdDispatch(cmd, 1, 1, 1);
+        }
+
+        const VkBufferMemoryBarrier2 shBarrier = {
+            .sType               = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+            .srcStageMask        = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+            .srcAccessMask       = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+            .dstStageMask        = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+            .dstAccessMask       = VK_ACCESS_2_SHADER_STORAGE_READ_BIT,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .buffer              = probe.sh.buffer,
+            .offset              = 0,
+            .size                = IBL_SH_SIZE,
+        };
+        const VkDependencyInfo shDependency = {
+            .sType                    = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+            .bufferMemoryBarrierCount = 1,
+            .pBufferMemoryBarriers    = &shBarrier,
+        };
+        vkCmdPipelineBarrier2(cmd, &shDependency);
+
+        {
+            irradiancePipeline.bind(cmd);
+            DescriptorWriter writer;
+            writer.writeImage(1, irradianceView, VK_NULL_HANDLE, VK_IMAGE_LAYOUT_GENERAL, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+            writer.writeBuffer(2, probe.sh.buffer, IBL_SH_SIZE, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+            writer.push(cmd, 0, irradiancePipeline);
+
+            const std::uint32_t irradianceSize = probe.irradiance.extent.width;
+            vkCmdDispatch(cmd, (irradianceSize + 7) / 8, (irradianceSize + 7) / 8, 6);
+        }
+
+        for(VkImageMemoryBarrier2& barrier : imageBarriers) {
+            barrier.srcStageMask  = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+            barrier.srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+            barrier.dstStageMask  = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+            barrier.dstAccessMask = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT;
+            barrier.oldLayout     = VK_IMAGE_LAYOUT_GENERAL;
+            barrier.newLayout     = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        }
+        vkCmdPipelineBarrier2(cmd, &dependencyInfo);
+        setImageState(probe.specular, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT);
+        setImageState(probe.irradiance, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT);
+        return ReturnCode::OK;
+    }
+
+    ReturnCode IblBaker::bake(IblProbe&             probe,
+                              RendererState&        state,
+                              const AllocatedImage& environment,
+                              std::uint64_t         environmentHash,
+                              std::uint32_t         specularSize,
+                              std::uint32_t         specularMipCount,
+                              std::uint32_t         irradianceSize,
+                              std::uint32_t         sampleCount,
+                              const char*           cachePath) {
+        KAMSKI_PROFILE();
+        const IblCacheKey key = {
+            .environmentHash  = environmentHash,
+            .specularSize     = specularSize,
+            .specularMipCount = specularMipCount,
+            .irradianceSize   = irradianceSize,
+            .sampleCount      = sampleCount,
+        };
+        if(cachePath && loadIblProbe(probe, state, cachePath, key) == ReturnCode::OK) {
+            return ReturnCode::OK;
+        }
+
+        const VkImageUsageFlags usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+        ReturnCode              rc    = createImage(probe.specular,
+                                                    state,
+                                                    IblProbe::IBL_FORMAT,
+                                                    VkExtent3D{ specularSize, specularSize, 1 },
+                                                    usage,
+                                                    true,
+                                                    specularMipCount);
+        if(rc != ReturnCode::OK) {
+            logError("Could not create specular cube");
+            destroyIblProbe(probe, state);
+            return rc;
+        }
+        rc = createImage(probe.irradiance,
+                         state,
+                         IblProbe::IBL_FORMAT,
+                         VkExtent3D{ irradianceSize, irradianceSize, 1 },
+                         usage,
+                         true,
+                         1);
+        if(rc != ReturnCode::OK) {
+            logError("Could not create irradiance cube");
+            destroyIblProbe(probe, state);
+            return rc;
+        }
+        rc = createBuffer(probe.sh,
+                          state.device,
+                          state.allocator,
+                          IBL_SH_SIZE,
+                          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                          VMA_MEMORY_USAGE_GPU_ONLY);
+        if(rc != ReturnCode::OK) {
+            logError("Could not create SH buffer");
+            destroyIblProbe(probe, state);
+            return rc;
+        }
+
+        PoolInfo poolInfo = lockCommandPool(state, VK_QUEUE_GRAPHICS_BIT);
+        defer {
+            unlockCommandPool(state, poolInfo);
+        };
+        std::vector<VkImageView> views;
+        VkResult                 res = kvk::immediateSubmit(state,
+                                                            poolInfo,
+                                                            [&](VkCommandBuffer cmd) {
+                                                                rc = cmdBake(cmd, state, probe, environment, sampleCount, views);
+                                                            });
+        // immediateSubmit waited for the bake, on failure the views wait for the next frame to retire
+        for(VkImageView view : views) {
+            if(res == VK_SUCCESS) {
+                vkDestroyImageView(state.device, view, nullptr);
+            } else {
+                deferDestroy(state, { .view = view, .type = DeferredDestroy::IMAGE_VIEW });
+            }
+        }
+        if(res != VK_SUCCESS) {
+            logError("IBL bake failed: %d", res);
+            destroyIblProbe(probe, state);
+            return ReturnCode::UNKNOWN;
+        }
+        // Nothing was recorded, the probe holds garbage and must not be cached
+        if(rc != ReturnCode::OK) {
+            logError("Could not record the IBL bake");
+            destroyIblProbe(probe, state);
+            return rc;
+        }
+
+        if(cachePath) {
+            saveIblProbe(probe, state, cachePath, key);
+        }
+        return ReturnCode::OK;
+    }
+
+    void destroyIblProbe(IblProbe& probe, RendererState& state) {
+        KAMSKI_PROFILE();
+        if(probe.specular.image != VK_NULL_HANDLE) {
+            destroyImage(probe.specular, state.device, state.allocator);
+        }
+        if(probe.irradiance.image != VK_NULL_HANDLE) {
+            destroyImage(probe.irradiance, state.device, state.allocator);
+        }
+        if(probe.sh.buffer != VK_NULL_HANDLE) {
+            destroyBuffer(probe.sh, state.allocator);
+        }
+        probe = {};
+    }
+
+    ReturnCode saveIblProbe(const IblProbe& probe, RendererState& state, const char* path, const IblCacheKey& key) {
+        KAMSKI_PROFILE();
+        const std::uint32_t specularSize     = probe.specular.extent.width;
+        const std::uint32_t specularMipCount = probe.specular.mipCount;
+        const std::uint32_t irradianceSize   = probe.irradiance.extent.width;
+
+        VkBufferImageCopy   specularRegions[16];
+        VkBufferImageCopy   irradianceRegion;
+        const std::uint64_t irradianceOffset = cubeCopyRegions(specularRegions, 0, specularSize, specularMipCount);
+        const std::uint64_t shOffset         = cubeCopyRegions(&irradianceRegion, irradianceOffset, irradianceSize, 1);
+        const std::uint64_t totalSize        = shOffset + IBL_SH_SIZE;
+
+        AllocatedBuffer     readbackBuffer   = {};
+        ReturnCode          rc               = createBuffer(readbackBuffer,
+                                                            state.device,
+                                                            state.allocator,
+                                                            totalSize,
+                                                            VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                                            VMA_MEMORY_USAGE_GPU_TO_CPU);
+        if(rc != ReturnCode::OK) {
+            logError("Could not create readback buffer");
+            return rc;
+        }
+        defer {
+            destroyBuffer(readbackBuffer, state.allocator);
+        };
+
+        auto readbackFunc = [&](VkCommandBuffer cmd) {
+            KAMSKI_PROFILE();
+            const VkImage images[] = { probe.specular.image, probe.irradiance.image };
+            for(VkImage image : images) {
+                transitionImage(cmd,
+                                image,
+                                VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                                VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                                VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                                0,
+                                VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                                VK_ACCESS_2_TRANSFER_READ_BIT);
+            }
+            vkCmdCopyImageToBuffer(cmd,
+                                   probe.specular.image,
+                                   VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                                   readbackBuffer.buffer,
+                                   specularMipCount,
+                                   specularRegions);
+            vkCmdCopyImageToBuffer(cmd,
+                                   probe.irradiance.image,
+                                   VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                                   readbackBuffer.buffer,
+                                   1,
+                                   &irradianceRegion);
+            const VkBufferCopy shCopy = {
+                .srcOffset = 0,
+                .dstOffset = shOffset,
+                .size      = IBL_SH_SIZE,
+            };
+            vkCmdCopyBuffer(cmd, probe.sh.buffer, readbackBuffer.buffer, 1, &shCopy);
+            for(VkImage image : images) {
+                transitionImage(cmd,
+                                image,
+                                VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                                VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                                VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                                0,
+                                VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                                VK_ACCESS_2_SHADER_SAMPLED_READ_BIT);
+            }
+        };
+
+        PoolInfo poolInfo = lockCommandPool(state, VK_QUEUE_GRAPHICS_BIT);
+        defer {
+            unlockCommandPool(state, poolInfo);
+        };
+        VkResult res = kvk::immediateSubmit(state,
+                                            poolInfo,
+                                            readbackFunc);
+        if(res != VK_SUCCESS) {
+            logError("IBL readback failed: %d", res);
+            return ReturnCode::UNKNOWN;
+        }
+        vmaInvalidateAllocation(state.allocator, readbackBuffer.allocation, 0, VK_WHOLE_SIZE);
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if(!file.is_open()) {
+            logError("Could not open %s for writing", path);
+            return ReturnCode::FILE_NOT_FOUND;
+        }
+        const IblCacheHeader header = {
+            .magic            = IBL_CACHE_MAGIC,
+            .version          = IBL_CACHE_VERSION,
+            .environmentHash  = key.environmentHash,
+            .format           = std::uint32_t(IblProbe::IBL_FORMAT),
+            .specularSize     = specularSize,
+            .specularMipCount = specularMipCount,
+            .irradianceSize   = irradianceSize,
+            .sampleCount      = key.sampleCount,
+            .reserved         = 0,
+        };
+        file.write((const char*)&header, sizeof(header));
+        file.write((const char*)readbackBuffer.allocation->GetMappedData(), totalSize);
+        return file.good() ? ReturnCode::OK : ReturnCode::UNKNOWN;
+    }
+
+    ReturnCode loadIblProbe(IblProbe& probe, RendererState& state, const char* path, const IblCacheKey& key) {
+        KAMSKI_PROFILE();
+        std::ifstream file(path, std::ios::ate | std::ios::binary);
+        if(!file.is_open()) {
+            return ReturnCode::FILE_NOT_FOUND;
+        }
+        const std::uint64_t fileSize = file.tellg();
+        file.seekg(0);
+
+        IblCacheHeader header;
+        if(fileSize < sizeof(header) || !file.read((char*)&header, sizeof(header))) {
+            logError("%s is not an IBL cache", path);
+            return ReturnCode::UNKNOWN;
+        }
+        if(header.magic != IBL_CACHE_MAGIC ||
+           header.version != IBL_CACHE_VERSION ||
+           header.format != std::uint32_t(IblProbe::IBL_FORMAT) ||
+           header.specularMipCount == 0 ||
+           header.specularMipCount > 16) {
+            logError("%s is not a compatible IBL cache", path);
+            return ReturnCode::UNKNOWN;
+        }
+        if(header.environmentHash != key.environmentHash ||
+           header.specularSize != key.specularSize ||
+           header.specularMipCount != key.specularMipCount ||
+           header.irradianceSize != key.irradianceSize ||
+           header.sampleCount != key.sampleCount) {
+            logInfo("IBL cache %s is stale", path);
+            return ReturnCode::UNKNOWN;
+        }
+
+        VkBufferImageCopy   specularRegions[16];
+        VkBufferImageCopy   irradianceRegion;
+        const std::uint64_t irradianceOffset = cubeCopyRegions(specularRegions, 0, header.specularSize, header.specularMipCount);
+        const std::uint64_t shOffset         = cubeCopyRegions(&irradianceRegion, 0, header.irradianceSize, 1);
+        const std::uint64_t totalSize        = irradianceOffset + shOffset + IBL_SH_SIZE;
+        if(fileSize != sizeof(header) + totalSize) {
+            logError("IBL cache %s is truncated", path);
+            return ReturnCode::UNKNOWN;
+        }
+
+        AllocatedBuffer stagingBuffer = {};
+        ReturnCode      rc            = createBuffer(stagingBuffer,
+                                                     state.device,
+                                                     state.allocator,
+                                                     totalSize,
+                                                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                                     VMA_MEMORY_USAGE_CPU_ONLY);
+        if(rc != ReturnCode::OK) {
+            logError("Could not create staging buffer");
+            return rc;
+        }
+        defer {
+            destroyBuffer(stagingBuffer, state.allocator);
+        };
+        std::uint8_t* stagingData = (std::uint8_t*)stagingBuffer.allocation->GetMappedData();
+        if(!file.read((char*)stagingData, totalSize)) {
+            logError("Could not read %s", path);
+            return ReturnCode::UNKNOWN;
+        }
+
+        const VkImageUsageFlags usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+        rc                            = createImage(probe.specular,
+                                                    state,
+                                                    stagingBuffer,
+                                                    std::span<const VkBufferImageCopy>(specularRegions, header.specularMipCount),
+                                                    IblProbe::IBL_FORMAT,
+                                                    VkExtent3D{ header.specularSize, header.specularSize, 1 },
+                                                    usage,
+                                                    header.specularMipCount,
+                                                    true);
+        if(rc != ReturnCode::OK) {
+            destroyIblProbe(probe, state);
+            return rc;
+        }
+
+        irradianceRegion.bufferOffset = irradianceOffset;
+        rc                            = createImage(probe.irradiance,
+                                                    state,
+                                                    stagingBuffer,
+                                                    std::span<const VkBufferImageCopy>(&irradianceRegion, 1),
+                                                    IblProbe::IBL_FORMAT,
+                                                    VkExtent3D{ header.irradianceSize, header.irradianceSize, 1 },
+                                                    usage,
+                                                    1,
+                                                    true);
+        if(rc != ReturnCode::OK) {
+            destroyIblProbe(probe, state);
+            return rc;
+        }
+
+        rc = createBuffer(probe.sh,
+                          state.device,
+                          state.allocator,
+                          IBL_SH_SIZE,
+                          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                          VMA_MEMORY_USAGE_GPU_ONLY);
+        if(rc != ReturnCode::OK) {
+            destroyIblProbe(probe, state);
+            return rc;
+        }
+
+        PoolInfo poolInfo = lockCommandPool(state, VK_QUEUE_GRAPHICS_BIT);
+        defer {
+            unlockCommandPool(state, poolInfo);
+        };
+        VkResult res = kvk::immediateSubmit(state,
+                                            poolInfo,
+                                            [&](VkCommandBuffer cmd) {
+                                                const VkBufferCopy shCopy = {
+                                                    .srcOffset = irradianceOffset + shOffset,
+                                                    .dstOffset = 0,
+                                                    .size      = IBL_SH_SIZE,
+                                                };
+                                                vkCmdCopyBuffer(cmd, stagingBuffer.buffer, probe.sh.buffer, 1, &shCopy);
+                                            });
+        if(res != VK_SUCCESS) {
+            logError("SH upload failed: %d", res);
+            destroyIblProbe(probe, state);
+            return ReturnCode::UNKNOWN;
+        }
+
+        return ReturnCode::OK;
+    }
+
+}
@@ -4,6 +4,7 @@
 #include <limits>
 #include <mutex>
 #include <thread>
+#include <bit>
 
 #define VMA_IMPLEMENTATION
 #include "common.h"
@@ -142,6 +143,10 @@ namespace kvk {
           ===========================*/
         if(!settings)
             return ReturnCode::WRONG_PARAMETERS;
+        if(settings->framesInFlight == 0 || settings->framesInFlight > MAX_IN_FLIGHT_FRAMES) {
+            logError("framesInFlight has to be between 1 and %u, got %u", MAX_IN_FLIGHT_FRAMES, settings->framesInFlight);
+            return ReturnCode::WRONG_PARAMETERS;
+        }
 
         VkApplicationInfo appInfo = {
             .sType              = VK_STRUCTURE_TYPE_APPLICATION_INFO,
@@ -152,7 +157,13 @@ namespace kvk {
             .apiVersion         = VK_API_VERSION_1_4
         };
 
-        state.currentFrame = 0;
+        state.currentFrame              = 0;
+        state.framesInFlight            = settings->framesInFlight;
+        state.presentPolicy             = settings->presentPolicy;
+        state.vkWaitForPresent          = nullptr;
+        state.vkGetCalibratedTimestamps = nullptr;
+        state.presentId                 = 0;
+        state.presentTiming             = {};
 
         /*=====================================
                 Validation layer handling
@@ -404,6 +415,74 @@ namespace kvk {
         vkGetPhysicalDeviceProperties(state.physicalDevice, &props);
         state.limits = props.limits;
 
+        //
+        // Optional extensions: LOW_LATENCY degrades to plain FIFO without present wait and the GPU
+        // profiler aligns its clock once at startup without calibrated timestamps
+        //
+        std::vector<const char*> enabledDeviceExtensions(std::begin(desiredDeviceExtensions), std::end(desiredDeviceExtensions));
+        bool                     presentWaitSupported          = false;
+        bool                     calibratedTimestampsSupported = false;
+        {
+            std::uint32_t extensionCount = 0;
+            vkEnumerateDeviceExtensionProperties(state.physicalDevice, nullptr, &extensionCount, nullptr);
+            std::vector<VkExtensionProperties> deviceExtensions(extensionCount);
+            vkEnumerateDeviceExtensionProperties(state.physicalDevice, nullptr, &extensionCount, deviceExtensions.data());
+
+            std::uint32_t found = 0;
+            for(const VkExtensionProperties& ext : deviceExtensions) {
+                if(strcmp(ext.extensionName, VK_KHR_PRESENT_ID_EXTENSION_NAME) == 0 ||
+                   strcmp(ext.extensionName, VK_KHR_PRESENT_WAIT_EXTENSION_NAME) == 0) {
+                    found++;
+                }
+                if(strcmp(ext.extensionName, VK_KHR_CALIBRATED_TIMESTAMPS_EXTENSION_NAME) == 0) {
+                    calibratedTimestampsSupported = true;
+                }
+            }
+            if(found == 2) {
+                VkPhysicalDevicePresentWaitFeaturesKHR presentWaitFeatures = {
+                    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR,
+                };
+                VkPhysicalDevicePresentIdFeaturesKHR presentIdFeatures = {
+                    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR,
+                    .pNext = &presentWaitFeatures,
+                };
+                VkPhysicalDeviceFeatures2 features = {
+                    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+                    .pNext = &presentIdFeatures,
+                };
+                vkGetPhysicalDeviceFeatures2(state.physicalDevice, &features);
+                presentWaitSupported = presentIdFeatures.presentId && presentWaitFeatures.presentWait;
+            }
+            if(presentWaitSupported) {
+                enabledDeviceExtensions.push_back(VK_KHR_PRESENT_ID_EXTENSION_NAME);
+                enabledDeviceExtensions.push_back(VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+            } else {
+                logInfo("VK_KHR_present_wait not supported, presents are not paced");
+            }
+            if(calibratedTimestampsSupported) {
+                // Only useful when the device clock can be read together with the clock steady_clock uses
+                auto getTimeDomains = (PFN_vkGetPhysicalDeviceCalibrateableTimeDomainsKHR)vkGetInstanceProcAddr(
+                    state.instance, "vkGetPhysicalDeviceCalibrateableTimeDomainsKHR");
+                std::uint32_t domainCount = 0;
+                if(getTimeDomains) {
+                    getTimeDomains(state.physicalDevice, &domainCount, nullptr);
+                }
+                std::vector<VkTimeDomainKHR> domains(domainCount);
+                if(domainCount != 0) {
+                    getTimeDomains(state.physicalDevice, &domainCount, domains.data());
+                }
+                const bool hasDevice          = std::find(domains.begin(), domains.end(), VK_TIME_DOMAIN_DEVICE_KHR) != domains.end();
+                const bool hasHost            = std::find(domains.begin(), domains.end(), HOST_TIME_DOMAIN) != domains.end();
+                calibratedTimestampsSupported = hasDevice && hasHost;
+                if(!calibratedTimestampsSupported) {
+                    logInfo("Calibrated timestamps lack the device or host time domain, the profiler aligns once");
+                }
+            }
+            if(calibratedTimestampsSupported) {
+                enabledDeviceExtensions.push_back(VK_KHR_CALIBRATED_TIMESTAMPS_EXTENSION_NAME);
+            }
+        }
+
         /*=====================================
                 Logical device creation
           =====================================*/
@@ -467,11 +546,14 @@ namespace kvk {
             .sType    = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
             .pNext    = &features12,
             .features = {
-                .independentBlend         = VK_TRUE,
-                .fillModeNonSolid         = VK_TRUE,
-                .fragmentStoresAndAtomics = VK_TRUE,
-                .shaderInt16              = VK_TRUE,
-                .sparseBinding            = VK_TRUE,
+                .independentBlend                        = VK_TRUE,
+                .fillModeNonSolid                        = VK_TRUE,
+                .fragmentStoresAndAtomics                = VK_TRUE,
+                .shaderStorageImageReadWithoutFormat     = VK_TRUE,
+                .shaderStorageImageWriteWithoutFormat    = VK_TRUE,
+                .shaderStorageImageArrayDynamicIndexing  = VK_TRUE,
+                .shaderInt16                             = VK_TRUE,
+                .sparseBinding                           = VK_TRUE,
             },
         };
 
@@ -489,6 +571,7 @@ namespace kvk {
         CHECK_FEATURE(features13, dynamicRendering);
         CHECK_FEATURE(features12, bufferDeviceAddress);
         CHECK_FEATURE(features12, samplerFilterMinmax);
+        CHECK_FEATURE(features12, timelineSemaphore);
         CHECK_FEATURE(features12, runtimeDescriptorArray);
         CHECK_FEATURE(features12, storageBuffer8BitAccess);
         CHECK_FEATURE(features12, uniformAndStorageBuffer8BitAccess);
@@ -512,8 +595,27 @@ namespace kvk {
 
 #undef CHECK_FEATURE
 
+        // Only the compute mip generator and the IBL baker need these, both fall back or fail at init
+        state.storageImageWithoutFormat = allDeviceFeatures.features.shaderStorageImageReadWithoutFormat &&
+                                          allDeviceFeatures.features.shaderStorageImageWriteWithoutFormat &&
+                                          allDeviceFeatures.features.shaderStorageImageArrayDynamicIndexing;
+        if(!state.storageImageWithoutFormat) {
+            logInfo("Storage images without format are not available");
+        }
+
+        VkPhysicalDevicePresentWaitFeaturesKHR presentWaitFeatures = {
+            .sType       = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR,
+            .presentWait = VK_TRUE,
+        };
+        VkPhysicalDevicePresentIdFeaturesKHR presentIdFeatures = {
+            .sType     = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR,
+            .pNext     = &presentWaitFeatures,
+            .presentId = VK_TRUE,
+        };
+
         features14 = VkPhysicalDeviceVulkan14Features{
             .sType          = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_4_FEATURES,
+            .pNext          = presentWaitSupported ? &presentIdFeatures : nullptr,
             .pushDescriptor = VK_TRUE,
         };
 
@@ -545,6 +647,7 @@ namespace kvk {
             .descriptorBindingVariableDescriptorCount  = VK_TRUE,
             .runtimeDescriptorArray                    = VK_TRUE,
             .samplerFilterMinmax                       = VK_TRUE,
+            .timelineSemaphore                         = VK_TRUE,
             .bufferDeviceAddress                       = VK_TRUE,
         };
 
@@ -552,14 +655,17 @@ namespace kvk {
             .sType    = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
             .pNext    = &features12,
             .features = {
-                .independentBlend          = VK_TRUE,
-                .multiDrawIndirect         = VK_TRUE,
-                .drawIndirectFirstInstance = VK_TRUE,
-                .fillModeNonSolid          = VK_TRUE,
-                .samplerAnisotropy         = VK_TRUE,
-                .fragmentStoresAndAtomics  = VK_TRUE,
-                .shaderInt16               = VK_TRUE,
-                .sparseBinding             = VK_TRUE,
+                .independentBlend                       = VK_TRUE,
+                .multiDrawIndirect                      = VK_TRUE,
+                .drawIndirectFirstInstance              = VK_TRUE,
+                .fillModeNonSolid                       = VK_TRUE,
+                .samplerAnisotropy                      = VK_TRUE,
+                .fragmentStoresAndAtomics               = VK_TRUE,
+                .shaderStorageImageReadWithoutFormat    = state.storageImageWithoutFormat,
+                .shaderStorageImageWriteWithoutFormat   = state.storageImageWithoutFormat,
+                .shaderStorageImageArrayDynamicIndexing = state.storageImageWithoutFormat,
+                .shaderInt16                            = VK_TRUE,
+                .sparseBinding                          = VK_TRUE,
             },
         };
 
@@ -568,8 +674,8 @@ namespace kvk {
             .pNext                   = &allDeviceFeatures,
             .queueCreateInfoCount    = static_cast<std::uint32_t>(queueCreateInfos.size()),
             .pQueueCreateInfos       = queueCreateInfos.data(),
-            .enabledExtensionCount   = sizeof(desiredDeviceExtensions) / sizeof(desiredDeviceExtensions[0]),
-            .ppEnabledExtensionNames = desiredDeviceExtensions,
+            .enabledExtensionCount   = static_cast<std::uint32_t>(enabledDeviceExtensions.size()),
+            .ppEnabledExtensionNames = enabledDeviceExtensions.data(),
         };
 
         if(vkCreateDevice(state.physicalDevice, &deviceCreateInfo, nullptr, &state.device) != VK_SUCCESS) {
@@ -577,6 +683,12 @@ namespace kvk {
             return ReturnCode::UNKNOWN;
         }
         logDebug("Logical device created");
+        if(presentWaitSupported) {
+            state.vkWaitForPresent = (PFN_vkWaitForPresentKHR)vkGetDeviceProcAddr(state.device, "vkWaitForPresentKHR");
+        }
+        if(calibratedTimestampsSupported) {
+            state.vkGetCalibratedTimestamps = (PFN_vkGetCalibratedTimestampsKHR)vkGetDeviceProcAddr(state.device, "vkGetCalibratedTimestampsKHR");
+        }
 
         state.queues     = new Queue[uniqueQueueFamilies.size()];
         state.queueCount = uniqueQueueFamilies.size();
@@ -620,10 +732,25 @@ namespace kvk {
         }
         state.swapchainImageFormat         = chosenFormat;
 
-        VkPresentModeKHR chosenPresentMode = surfacePresentModes[0];
-        for(const VkPresentModeKHR pm : surfacePresentModes) {
-            if(pm == VK_PRESENT_MODE_IMMEDIATE_KHR) {
-                chosenPresentMode = pm;
+        // FIFO is the only mode every surface supports
+        VkPresentModeKHR preferredModes[2] = { VK_PRESENT_MODE_FIFO_KHR, VK_PRESENT_MODE_FIFO_KHR };
+        switch(state.presentPolicy) {
+        case PresentPolicy::UNCAPPED: {
+            preferredModes[0] = VK_PRESENT_MODE_IMMEDIATE_KHR;
+            preferredModes[1] = VK_PRESENT_MODE_MAILBOX_KHR;
+        } break;
+
+        case PresentPolicy::MAILBOX: {
+            preferredModes[0] = VK_PRESENT_MODE_MAILBOX_KHR;
+        } break;
+
+        default: {
+        } break;
+        }
+        VkPresentModeKHR chosenPresentMode = VK_PRESENT_MODE_FIFO_KHR;
+        for(const VkPresentModeKHR preferred : preferredModes) {
+            if(std::find(surfacePresentModes.begin(), surfacePresentModes.end(), preferred) != surfacePresentModes.end()) {
+                chosenPresentMode = preferred;
                 break;
             }
         }
@@ -646,7 +773,8 @@ namespace kvk {
         }
         state.swapchainExtent    = chosenExtent;
 
-        std::uint32_t imageCount = surfaceCapabilities.minImageCount + 1;
+        // One image more than frames in flight so acquiring never waits on a frame still queued
+        std::uint32_t imageCount = std::max(surfaceCapabilities.minImageCount + 1, state.framesInFlight + 1);
         if(surfaceCapabilities.maxImageCount > 0 && imageCount > surfaceCapabilities.maxImageCount) {
             imageCount = surfaceCapabilities.maxImageCount;
         }
@@ -661,6 +789,10 @@ namespace kvk {
         };
 
         state.descriptors.init(state.device, 100000, ratios);
+        state.deletions.records.resize(256);
+        state.deletions.head         = 0;
+        state.deletions.count        = 0;
+        state.deletions.pendingCount = 0;
 
         if(createSwapchain(state,
                            chosenExtent,
@@ -675,22 +807,12 @@ namespace kvk {
             .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
         };
 
-        VkFenceCreateInfo fenceCreateInfo = {
-            .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-            .flags = VK_FENCE_CREATE_SIGNALED_BIT,
-        };
-
-        state.renderFinishedSemaphores.resize(imageCount);
-        for(int i = 0; i != imageCount; i++) {
-            if(vkCreateSemaphore(state.device, &semaphoreCreateInfo, nullptr, &state.renderFinishedSemaphores[i]) != VK_SUCCESS) {
-                logError("Could not create sync objects");
-                return ReturnCode::UNKNOWN;
-            }
-        }
-
-        for(int i = 0; i != MAX_IN_FLIGHT_FRAMES; i++) {
-            if(vkCreateSemaphore(state.device, &semaphoreCreateInfo, nullptr, &state.frames[i].imageAvailableSemaphore) != VK_SUCCESS ||
-               vkCreateFence(state.device, &fenceCreateInfo, nullptr, &state.frames[i].inFlightFence) != VK_SUCCESS) {
+        for(std::uint32_t i = 0; i != state.framesInFlight; i++) {
+            state.frames[i].queue         = nullptr;
+            state.frames[i].timelineValue = 0;
+            state.frames[i].workerCount   = 0;
+            state.frames[i].presentId     = 0;
+            if(vkCreateSemaphore(state.device, &semaphoreCreateInfo, nullptr, &state.frames[i].imageAvailableSemaphore) != VK_SUCCESS) {
                 logError("Could not create sync objects");
                 return ReturnCode::UNKNOWN;
             }
@@ -709,6 +831,7 @@ namespace kvk {
         state.swapchainImageFormat         = format;
         state.swapchainPresentMode         = presentMode;
         state.swapchainImageCount          = imageCount;
+        state.swapchainPresentIdBase       = state.presentId;
 
         std::uint32_t queueFamilyIndices[] = {
             state.graphicsFamilyIndex,
@@ -785,6 +908,18 @@ namespace kvk {
             }
             state.swapchainImageViews.push_back(imageView);
         }
+
+        // One per image, a present may still wait on the previous set so it is never reused
+        const VkSemaphoreCreateInfo semaphoreCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        };
+        state.renderFinishedSemaphores.resize(imageCount);
+        for(VkSemaphore& semaphore : state.renderFinishedSemaphores) {
+            if(vkCreateSemaphore(state.device, &semaphoreCreateInfo, nullptr, &semaphore) != VK_SUCCESS) {
+                logError("Could not create sync objects");
+                return ReturnCode::UNKNOWN;
+            }
+        }
         return ReturnCode::OK;
     }
 
@@ -792,20 +927,15 @@ namespace kvk {
                                  const std::uint32_t x,
                                  const std::uint32_t y) {
         KAMSKI_PROFILE();
-        vkDeviceWaitIdle(state.device);
         if(x == 0 || y == 0) {
             state.swapchainExtent.width  = x;
             state.swapchainExtent.height = y;
             return ReturnCode::OK;
         }
 
-        for(VkImageView imageView : state.swapchainImageViews) {
-            vkDestroyImageView(state.device,
-                               imageView,
-                               nullptr);
-        }
-
-        VkSwapchainKHR           oldSwapchain = state.swapchain;
+        VkSwapchainKHR           oldSwapchain  = state.swapchain;
+        std::vector<VkImageView> oldViews      = std::move(state.swapchainImageViews);
+        std::vector<VkSemaphore> oldSemaphores = std::move(state.renderFinishedSemaphores);
 
         VkExtent2D               chosenExtent;
         VkSurfaceCapabilitiesKHR surfaceCapabilities;
@@ -825,9 +955,42 @@ namespace kvk {
                                         state.swapchainPresentMode,
                                         state.swapchainImageCount,
                                         oldSwapchain);
-        vkDestroySwapchainKHR(state.device,
-                              oldSwapchain,
-                              nullptr);
+
+        //
+        // No device wait: the old swapchain and everything tied to it go once the next frame's
+        // submit retired. Frames recorded before it were submitted earlier on the same queue and
+        // their presents were queued ahead of it, the old swapchain is retired so none follow.
+        //
+        for(VkImageView view : oldViews) {
+            deferDestroy(state, { .view = view, .type = DeferredDestroy::IMAGE_VIEW });
+        }
+        for(VkSemaphore semaphore : oldSemaphores) {
+            deferDestroy(state, { .semaphore = semaphore, .type = DeferredDestroy::SEMAPHORE });
+        }
+        if(rc != ReturnCode::OK) {
+            //
+            // The old swapchain is retired either way. Whatever createSwapchain got to before
+            // failing goes with it, and the next attempt starts without an oldSwapchain
+            //
+            for(VkImageView view : state.swapchainImageViews) {
+                deferDestroy(state, { .view = view, .type = DeferredDestroy::IMAGE_VIEW });
+            }
+            for(VkSemaphore semaphore : state.renderFinishedSemaphores) {
+                if(semaphore != VK_NULL_HANDLE) {
+                    deferDestroy(state, { .semaphore = semaphore, .type = DeferredDestroy::SEMAPHORE });
+                }
+            }
+            if(state.swapchain != oldSwapchain) {
+                deferDestroy(state, { .swapchain = state.swapchain, .type = DeferredDestroy::SWAPCHAIN });
+            }
+            state.swapchain = VK_NULL_HANDLE;
+            state.swapchainImages.clear();
+            state.swapchainImageViews.clear();
+            state.renderFinishedSemaphores.clear();
+        }
+        if(oldSwapchain != VK_NULL_HANDLE && state.swapchain != oldSwapchain) {
+            deferDestroy(state, { .swapchain = oldSwapchain, .type = DeferredDestroy::SWAPCHAIN });
+        }
         return rc;
     }
 
@@ -1405,31 +1568,48 @@ namespace kvk {
                          buffer.allocation);
     }
 
+    static VkImageAspectFlags imageAspect(VkFormat format) {
+        switch(format) {
+        case VK_FORMAT_D24_UNORM_S8_UINT: {
+            return VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT;
+        } break;
+
+        case VK_FORMAT_D32_SFLOAT: {
+            return VK_IMAGE_ASPECT_DEPTH_BIT;
+        } break;
+
+        default: {
+            return VK_IMAGE_ASPECT_COLOR_BIT;
+        } break;
+        }
+    }
+
     ReturnCode createImage(AllocatedImage&         image,
                            RendererState&          state,
                            const VkFormat          format,
                            const VkExtent3D        extent,
                            const VkImageUsageFlags usageFlags,
                            bool                    isCubemap,
-                           std::uint32_t           mipLevels) {
+                           std::uint32_t           mipLevels,
+                           std::uint32_t           layerCount) {
         KAMSKI_PROFILE();
         if(image.image != VK_NULL_HANDLE) {
             destroyImage(image, state.device, state.allocator);
         }
 
-        if(mipLevels > 1) {
-            VkFormatProperties formatProps;
-            vkGetPhysicalDeviceFormatProperties(state.physicalDevice, format, &formatProps);
-            assert(formatProps.optimalTilingFeatures & VK_FORMAT_FEATURE_BLIT_SRC_BIT);
-            assert(formatProps.optimalTilingFeatures & VK_FORMAT_FEATURE_BLIT_DST_BIT);
-        }
-
+        layerCount                             = isCubemap ? 6 : layerCount;
         VkImageCreateInfo       imageInfo      = imageCreateInfo(state.physicalDevice,
                                                                  format,
                                                                  usageFlags,
                                                                  extent,
-                                                      isCubemap ? 6 : 1,
+                                                                 layerCount,
                                                                  mipLevels);
+        if(!isCubemap) {
+            imageInfo.flags &= ~VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT;
+        }
+        if((usageFlags & VK_IMAGE_USAGE_STORAGE_BIT) && storageCompatibleFormat(format) != format) {
+            imageInfo.flags |= VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT;
+        }
 
         VmaAllocationCreateInfo imageAllocInfo = {
             .usage         = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
@@ -1446,29 +1626,23 @@ namespace kvk {
             return ReturnCode::UNKNOWN;
         }
 
-        VkImageAspectFlags aspect;
-        switch(format) {
-        case VK_FORMAT_D24_UNORM_S8_UINT: {
-            aspect = VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT;
-        } break;
-
-        case VK_FORMAT_D32_SFLOAT: {
-            aspect = VK_IMAGE_ASPECT_DEPTH_BIT;
-        } break;
-
-        default: {
-            aspect = VK_IMAGE_ASPECT_COLOR_BIT;
-        } break;
+        const VkImageAspectFlags aspect        = imageAspect(format);
+        VkImageViewCreateInfo    imageViewInfo = imageViewCreateInfo(format, image.image, aspect, isCubemap, 0, mipLevels);
+        if(!isCubemap && layerCount > 1) {
+            imageViewInfo.viewType                    = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+            imageViewInfo.subresourceRange.layerCount = layerCount;
         }
-
-        VkImageViewCreateInfo imageViewInfo = imageViewCreateInfo(format, image.image, aspect, isCubemap, 0, mipLevels);
         if(vkCreateImageView(state.device, &imageViewInfo, nullptr, &image.view) != VK_SUCCESS) {
             logError("Could not create draw image");
             return ReturnCode::UNKNOWN;
         }
-        image.format = format;
-        image.extent = extent;
-        image.usage  = usageFlags;
+        image.format     = format;
+        image.extent     = extent;
+        image.usage      = usageFlags;
+        image.mipCount   = mipLevels;
+        image.layerCount = layerCount;
+        image.states     = std::make_shared<ImageState[]>(image.mipCount * image.layerCount);
+        image.views      = std::make_shared<ImageViewCache>();
         return ReturnCode::OK;
     }
 
@@ -1480,142 +1654,406 @@ namespace kvk {
                            const VkImageUsageFlags usage,
                            const std::uint32_t     mipLevels) {
         KAMSKI_PROFILE();
-        const VkImageUsageFlags usageFlags    = usage | VK_IMAGE_USAGE_TRANSFER_DST_BIT | (mipLevels > 1 ? VK_IMAGE_USAGE_TRANSFER_SRC_BIT : 0);
-        const std::uint64_t     size          = extent.width * extent.height * extent.depth * 4;
-        AllocatedBuffer         stagingBuffer = {};
-        ReturnCode              rc            = createBuffer(stagingBuffer,
-                                                             state.device,
-                                                             state.allocator,
-                                                             size,
-                                                             VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                                                             VMA_MEMORY_USAGE_CPU_ONLY);
+        const std::uint64_t size          = extent.width * extent.height * extent.depth * 4;
+        AllocatedBuffer     stagingBuffer = {};
+        ReturnCode          rc            = createBuffer(stagingBuffer,
+                                                         state.device,
+                                                         state.allocator,
+                                                         size,
+                                                         VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                                         VMA_MEMORY_USAGE_CPU_ONLY);
 
         if(rc != ReturnCode::OK) {
             logError("Could not create staging buffer");
             return rc;
         }
+        defer {
+            destroyBuffer(stagingBuffer, state.allocator);
+        };
         memcpy(stagingBuffer.allocation->GetMappedData(), data, size);
 
-        rc = createImage(image,
-                         state,
-                         format,
-                         extent,
-                         usageFlags,
-                         false,
-                         mipLevels);
-        if(rc != ReturnCode::OK) {
-            logError("Could not create image");
-            return rc;
+        const VkBufferImageCopy copyRegion = {
+            .bufferOffset      = 0,
+            .bufferRowLength   = 0,
+            .bufferImageHeight = 0,
+
+            .imageSubresource  = {
+                 .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+                 .mipLevel       = 0,
+                 .baseArrayLayer = 0,
+                 .layerCount     = 1,
+            },
+            .imageExtent = extent,
+        };
+
+        return createImage(image,
+                           state,
+                           stagingBuffer,
+                           std::span(&copyRegion, 1),
+                           format,
+                           extent,
+                           usage,
+                           mipLevels,
+                           false,
+                           mipLevels > 1);
+    }
+
+    //
+    // Shared by every upload path: whether the mips come from the compute downsampler, the usage
+    // that requires and the commands copying the regions in and building / transitioning the chain
+    //
+    static bool useComputeMips(RendererState& state, VkFormat format, std::uint32_t mipLevels, bool generateMips) {
+        return generateMips && mipLevels <= MipGenerator::MAX_MIP_COUNT && state.mipGenerator.supportsFormat(state.physicalDevice, format);
+    }
+
+    static VkImageUsageFlags uploadUsage(RendererState& state, VkFormat format, VkImageUsageFlags usage, std::uint32_t mipLevels, bool generateMips) {
+        const bool              computeMips = useComputeMips(state, format, mipLevels, generateMips);
+        const VkImageUsageFlags mipUsage    = computeMips ? VK_IMAGE_USAGE_STORAGE_BIT : VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+        if(generateMips && !computeMips) {
+            VkFormatProperties formatProps;
+            vkGetPhysicalDeviceFormatProperties(state.physicalDevice, format, &formatProps);
+            assert(formatProps.optimalTilingFeatures & VK_FORMAT_FEATURE_BLIT_SRC_BIT);
+            assert(formatProps.optimalTilingFeatures & VK_FORMAT_FEATURE_BLIT_DST_BIT);
         }
+        return usage | VK_IMAGE_USAGE_TRANSFER_DST_BIT | (generateMips ? mipUsage : 0);
+    }
 
-        auto transferFunc = [&](VkCommandBuffer cmd) {
-            KAMSKI_PROFILE();
-            transitionImageMip(cmd,
+    // Destroys views a finished recording created, right away when timelineValue is 0
+    static void releaseViews(RendererState& state, std::span<const VkImageView> views, std::uint64_t timelineValue) {
+        for(VkImageView view : views) {
+            if(timelineValue == 0) {
+                vkDestroyImageView(state.device, view, nullptr);
+            } else {
+                deferDestroy(state, { .view = view, .type = DeferredDestroy::IMAGE_VIEW }, timelineValue);
+            }
+        }
+    }
+
+    static void addUploadBarriers(BarrierBatch& batch, const AllocatedImage& image) {
+        batch.image(image.image,
+                    VK_IMAGE_LAYOUT_UNDEFINED,
+                    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                    VK_PIPELINE_STAGE_2_NONE,
+                    0,
+                    VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                    VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                    imageSubresourceRange(VK_IMAGE_ASPECT_COLOR_BIT));
+    }
+
+    static void cmdCopyUpload(VkCommandBuffer                    cmd,
+                              const AllocatedImage&              image,
+                              VkBuffer                           stagingBuffer,
+                              std::span<const VkBufferImageCopy> regions) {
+        vkCmdCopyBufferToImage(cmd,
+                               stagingBuffer,
                                image.image,
-                               0, 1,
-                               VK_IMAGE_LAYOUT_UNDEFINED,
                                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                               VK_PIPELINE_STAGE_2_TRANSFER_BIT,
-                               0,
-                               VK_PIPELINE_STAGE_2_TRANSFER_BIT,
-                               VK_ACCESS_2_MEMORY_WRITE_BIT);
-
-            VkBufferImageCopy copyRegion = {
-                .bufferOffset      = 0,
-                .bufferRowLength   = 0,
-                .bufferImageHeight = 0,
-
-                .imageSubresource  = {
-                     .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
-                     .mipLevel       = 0,
-                     .baseArrayLayer = 0,
-                     .layerCount     = 1,
-                },
-                .imageExtent = extent,
-            };
+                               std::uint32_t(regions.size()),
+                               regions.data());
+    }
 
-            vkCmdCopyBufferToImage(cmd,
-                                   stagingBuffer.buffer,
-                                   image.image,
-                                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                                   1,
-                                   &copyRegion);
-            if(mipLevels > 1) {
-                std::uint32_t mipWidth  = extent.width;
-                std::uint32_t mipHeight = extent.height;
-
-                transitionImageMip(cmd,
-                                   image.image,
-                                   0, 1,
-                                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                                   VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                                   VK_PIPELINE_STAGE_2_TRANSFER_BIT,
-                                   VK_ACCESS_2_MEMORY_WRITE_BIT,
-                                   VK_PIPELINE_STAGE_2_TRANSFER_BIT,
-                                   VK_ACCESS_2_MEMORY_READ_BIT);
-                for(int i = 1; i != mipLevels; i++) {
-                    transitionImageMip(cmd,
-                                       image.image,
-                                       i, 1,
-                                       VK_IMAGE_LAYOUT_UNDEFINED,
-                                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                                       0,
-                                       0,
-                                       VK_PIPELINE_STAGE_2_TRANSFER_BIT,
-                                       VK_ACCESS_2_MEMORY_WRITE_BIT);
-                    blitImageToImage(cmd,
-                                     image.image,
-                                     image.image,
-                                     { mipWidth, mipHeight },
-                                     { mipWidth > 1 ? mipWidth / 2 : 1, mipHeight > 1 ? mipHeight / 2 : 1 },
-                                     VK_IMAGE_ASPECT_COLOR_BIT,
-                                     i - 1,
-                                     i);
-                    mipWidth  = std::max(1u, mipWidth / 2);
-                    mipHeight = std::max(1u, mipHeight / 2);
-                    transitionImageMip(cmd,
-                                       image.image,
-                                       i, 1,
-                                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                                       VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                                       VK_PIPELINE_STAGE_2_TRANSFER_BIT,
-                                       VK_ACCESS_2_MEMORY_WRITE_BIT,
-                                       VK_PIPELINE_STAGE_2_TRANSFER_BIT,
-                                       VK_ACCESS_2_MEMORY_READ_BIT);
-                }
-                transitionImageMip(cmd,
-                                   image.image,
-                                   0, mipLevels,
-                                   VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                                   VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-            } else {
-                transitionImage(cmd,
-                                image.image,
-                                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                                VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-                                VK_PIPELINE_STAGE_2_TRANSFER_BIT,
-                                VK_ACCESS_2_MEMORY_WRITE_BIT,
-                                VK_PIPELINE_STAGE_2_NONE,
-                                0);
-            }
+    //
+    // Builds the mip chain after the copies or leaves the final transition in batch,
+    // every image ends up in SHADER_READ_ONLY once batch is flushed
+    //
+    static void cmdFinishUpload(VkCommandBuffer           cmd,
+                                BarrierBatch&             batch,
+                                RendererState&            state,
+                                AllocatedImage&           image,
+                                bool                      generateMips,
+                                std::vector<VkImageView>& mipViews) {
+        KAMSKI_PROFILE();
+        const std::uint32_t mipLevels   = image.mipCount;
+        const bool          computeMips = useComputeMips(state, image.format, mipLevels, generateMips);
+        setImageState(image, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT);
+
+        if(computeMips) {
+            state.mipGenerator.cmdGenerate(cmd,
+                                           state,
+                                           image,
+                                           MipFilter::AVERAGE,
+                                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                           VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                                           mipViews);
+            return;
+        }
+
+        if(!generateMips) {
+            batch.image(image.image,
+                        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                        VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                        VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                        VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                        VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+                        imageSubresourceRange(VK_IMAGE_ASPECT_COLOR_BIT));
+            return;
+        }
+
+        //
+        // Blit chain: every mip becomes a blit source right after it was written,
+        // the last one goes straight to SHADER_READ_ONLY with the rest of the chain
+        //
+        const std::uint32_t layerCount = image.layerCount;
+        std::uint32_t       mipWidth   = image.extent.width;
+        std::uint32_t       mipHeight  = image.extent.height;
+        BarrierBatch        blitBatch;
+        for(std::uint32_t i = 1; i != mipLevels; i++) {
+            blitBatch.image(image.image,
+                            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                            VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                            VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                            VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                            VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                            VK_ACCESS_2_TRANSFER_READ_BIT,
+                            imageSubresourceRange(VK_IMAGE_ASPECT_COLOR_BIT, i - 1, 1));
+            blitBatch.flush(cmd);
+            blitImageToImage(cmd,
+                             image.image,
+                             image.image,
+                             { mipWidth, mipHeight },
+                             { mipWidth > 1 ? mipWidth / 2 : 1, mipHeight > 1 ? mipHeight / 2 : 1 },
+                             VK_IMAGE_ASPECT_COLOR_BIT,
+                             i - 1,
+                             i,
+                             layerCount);
+            mipWidth  = std::max(1u, mipWidth / 2);
+            mipHeight = std::max(1u, mipHeight / 2);
+        }
+        batch.image(image.image,
+                    VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                    VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                    VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                    0,
+                    VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                    VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+                    imageSubresourceRange(VK_IMAGE_ASPECT_COLOR_BIT, 0, mipLevels - 1));
+        batch.image(image.image,
+                    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                    VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                    VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                    VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                    VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                    VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+                    imageSubresourceRange(VK_IMAGE_ASPECT_COLOR_BIT, mipLevels - 1, 1));
+    }
+
+    static void cmdUploadImage(VkCommandBuffer                    cmd,
+                               RendererState&                     state,
+                               AllocatedImage&                    image,
+                               VkBuffer                           stagingBuffer,
+                               std::span<const VkBufferImageCopy> regions,
+                               bool                               generateMips,
+                               std::vector<VkImageView>&          mipViews) {
+        KAMSKI_PROFILE();
+        BarrierBatch batch;
+        addUploadBarriers(batch, image);
+        batch.flush(cmd);
+        cmdCopyUpload(cmd, image, stagingBuffer, regions);
+        cmdFinishUpload(cmd, batch, state, image, generateMips, mipViews);
+        batch.flush(cmd);
+    }
+
+    ReturnCode createImage(AllocatedImage&                    image,
+                           RendererState&                     state,
+                           const AllocatedBuffer&             stagingBuffer,
+                           std::span<const VkBufferImageCopy> regions,
+                           const VkFormat                     format,
+                           const VkExtent3D                   extent,
+                           const VkImageUsageFlags            usage,
+                           const std::uint32_t                mipLevels,
+                           const bool                         isCubemap,
+                           const bool                         generateMips,
+                           const std::uint32_t                layerCount) {
+        KAMSKI_PROFILE();
+        const VkImageUsageFlags usageFlags = uploadUsage(state, format, usage, mipLevels, generateMips);
+        ReturnCode              rc         = createImage(image,
+                                                         state,
+                                                         format,
+                                                         extent,
+                                                         usageFlags,
+                                                         isCubemap,
+                                                         mipLevels,
+                                                         layerCount);
+        if(rc != ReturnCode::OK) {
+            logError("Could not create image");
+            return rc;
+        }
+
+        std::vector<VkImageView> mipViews;
+        auto                     transferFunc = [&](VkCommandBuffer cmd) {
+            cmdUploadImage(cmd, state, image, stagingBuffer.buffer, regions, generateMips, mipViews);
         };
 
         PoolInfo poolInfo = lockCommandPool(state, VK_QUEUE_GRAPHICS_BIT);
         defer {
             unlockCommandPool(state, poolInfo);
         };
-        VkResult res = kvk::immediateSubmit(poolInfo.queue->commandBuffers[poolInfo.poolIndex],
-                                            state.device,
-                                            poolInfo.queue->handle,
-                                            poolInfo.queue->submitMutex,
+        VkResult res = kvk::immediateSubmit(state,
+                                            poolInfo,
                                             transferFunc);
+        releaseViews(state, mipViews, res == VK_SUCCESS ? 0 : PENDING_FRAME_VALUE);
         if(res != VK_SUCCESS) {
             logError("transfer failed: %d", res);
             return ReturnCode::UNKNOWN;
         }
 
-        destroyBuffer(stagingBuffer,
-                      state.allocator);
+        return ReturnCode::OK;
+    }
+
+    ReturnCode createImages(RendererState& state, std::span<const ImageCreateRequest> requests, UploadTicket* ticket) {
+        KAMSKI_PROFILE();
+        if(requests.empty()) {
+            if(ticket) {
+                *ticket = {};
+            }
+            return ReturnCode::OK;
+        }
+
+        std::vector<std::uint64_t>     offsets(requests.size());
+        std::vector<std::uint64_t>     sizes(requests.size());
+        std::uint64_t                  stagingSize = 0;
+        for(std::uint64_t i = 0; i != requests.size(); i++) {
+            const ImageCreateRequest& request = requests[i];
+            sizes[i]                          = request.dataSize ? request.dataSize : std::uint64_t(request.extent.width) * request.extent.height * request.extent.depth * 4;
+            offsets[i]                        = alignStagingOffset(stagingSize, request.format);
+            stagingSize                       = offsets[i] + sizes[i];
+        }
+
+        AllocatedBuffer stagingBuffer = {};
+        ReturnCode      rc            = createBuffer(stagingBuffer,
+                                                     state.device,
+                                                     state.allocator,
+                                                     stagingSize,
+                                                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                                     VMA_MEMORY_USAGE_CPU_ONLY);
+        if(rc != ReturnCode::OK) {
+            logError("Could not create staging buffer");
+            return rc;
+        }
+
+        std::uint8_t* stagingData = (std::uint8_t*)stagingBuffer.allocation->GetMappedData();
+        for(std::uint64_t i = 0; i != requests.size(); i++) {
+            const ImageCreateRequest& request      = requests[i];
+            const bool                generateMips = request.mipLevels > 1;
+            rc                                     = createImage(*request.image,
+                                                                 state,
+                                                                 request.format,
+                                                                 request.extent,
+                                                                 uploadUsage(state, request.format, request.usageFlags, request.mipLevels, generateMips),
+                                                                 false,
+                                                                 request.mipLevels);
+            if(rc != ReturnCode::OK) {
+                logError("Could not create image %llu of the batch", (unsigned long long)i);
+                for(std::uint64_t created = 0; created != i; created++) {
+                    destroyImage(*requests[created].image, state.device, state.allocator);
+                }
+                destroyBuffer(stagingBuffer, state.allocator);
+                return rc;
+            }
+            memcpy(stagingData + offsets[i], request.data, sizes[i]);
+        }
+
+        const VkCommandBufferBeginInfo beginInfo = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+            .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+        };
+        const PoolInfo           poolInfo = lockCommandPool(state, VK_QUEUE_GRAPHICS_BIT);
+        const VkCommandBuffer    cmd      = poolInfo.queue->commandBuffers[poolInfo.poolIndex];
+        std::vector<VkImageView> mipViews;
+        VkResult                 res      = vkBeginCommandBuffer(cmd, &beginInfo);
+        if(res == VK_SUCCESS) {
+            //
+            // One barrier into TRANSFER_DST for the whole batch, then every copy,
+            // then the mip chains with the plain transitions sharing a final barrier
+            //
+            BarrierBatch batch;
+            for(const ImageCreateRequest& request : requests) {
+                addUploadBarriers(batch, *request.image);
+            }
+            batch.flush(cmd);
+
+            for(std::uint64_t i = 0; i != requests.size(); i++) {
+                const ImageCreateRequest& request = requests[i];
+                const VkBufferImageCopy   region  = {
+                    .bufferOffset      = offsets[i],
+                    .bufferRowLength   = 0,
+                    .bufferImageHeight = 0,
+                    .imageSubresource  = {
+                         .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+                         .mipLevel       = 0,
+                         .baseArrayLayer = 0,
+                         .layerCount     = 1,
+                    },
+                    .imageExtent = request.extent,
+                };
+                cmdCopyUpload(cmd, *request.image, stagingBuffer.buffer, std::span(&region, 1));
+            }
+            for(const ImageCreateRequest& request : requests) {
+                cmdFinishUpload(cmd, batch, state, *request.image, request.mipLevels > 1, mipViews);
+            }
+            batch.flush(cmd);
+            res = vkEndCommandBuffer(cmd);
+        }
+        if(res != VK_SUCCESS) {
+            logError("Batched image upload failed: %d", res);
+            releaseViews(state, mipViews, 0);
+            unlockCommandPool(state, poolInfo);
+            for(const ImageCreateRequest& request : requests) {
+                destroyImage(*request.image, state.device, state.allocator);
+            }
+            destroyBuffer(stagingBuffer, state.allocator);
+            return ReturnCode::UNKNOWN;
+        }
+
+        //
+        // The command buffer and the staging memory go back through the deletion ring once the
+        // submit retires, the ticket only remembers what to wait for
+        //
+        UploadTicket upload = {
+            .queue         = poolInfo.queue,
+            .timelineValue = enqueueSubmit(*poolInfo.queue, { &cmd, 1 }),
+        };
+        deferDestroy(state, { .poolInfo = poolInfo, .type = DeferredDestroy::POOL_SLOT }, upload.timelineValue);
+        deferDestroy(state, stagingBuffer, upload.timelineValue);
+        releaseViews(state, mipViews, upload.timelineValue);
+
+        if(ticket) {
+            *ticket = upload;
+            return ReturnCode::OK;
+        }
+        return waitForUpload(state, upload);
+    }
+
+    bool isUploadComplete(RendererState& state, UploadTicket& ticket) {
+        KAMSKI_PROFILE();
+        if(ticket.timelineValue == 0) {
+            return true;
+        }
+        if(!isTimelineReached(state, *ticket.queue, ticket.timelineValue)) {
+            return false;
+        }
+        ticket = {};
+        return true;
+    }
+
+    ReturnCode waitForUpload(RendererState& state, UploadTicket& ticket) {
+        KAMSKI_PROFILE();
+        if(ticket.timelineValue == 0) {
+            return ReturnCode::OK;
+        }
+        // Uploads run on the graphics queue the deletion ring follows, so whatever retired along
+        // with this one (its own command buffer slot and staging memory included) is freed right away
+        VkResult res = waitTimeline(state, *ticket.queue, ticket.timelineValue);
+        if(res == VK_SUCCESS) {
+            retireDestroys(state, completedTimelineValue(state, *ticket.queue));
+        }
+        ticket = {};
+
+        if(res != VK_SUCCESS) {
+            logError("Waiting for upload failed: %d", res);
+            return ReturnCode::UNKNOWN;
+        }
         return ReturnCode::OK;
     }
 
@@ -1624,20 +2062,19 @@ namespace kvk {
                              const CubemapContents& data,
                              const VkFormat         format,
                              const VkExtent2D       extent,
-                             VkImageUsageFlags      usage) {
+                             VkImageUsageFlags      usage,
+                             const std::uint32_t    mipLevels) {
         KAMSKI_PROFILE();
-        const VkImageUsageFlags usageFlags    = usage | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+        const std::uint64_t size          = extent.width * extent.height * 6 * 4;
+        const std::uint64_t imageSize     = extent.width * extent.height * 4;
 
-        const std::uint64_t     size          = extent.width * extent.height * 6 * 4;
-        const std::uint64_t     imageSize     = extent.width * extent.height * 4;
-
-        AllocatedBuffer         stagingBuffer = {};
-        ReturnCode              rc            = createBuffer(stagingBuffer,
-                                                             state.device,
-                                                             state.allocator,
-                                                             size,
-                                                             VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                                                             VMA_MEMORY_USAGE_CPU_ONLY);
+        AllocatedBuffer     stagingBuffer = {};
+        ReturnCode          rc            = createBuffer(stagingBuffer,
+                                                         state.device,
+                                                         state.allocator,
+                                                         size,
+                                                         VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                                         VMA_MEMORY_USAGE_CPU_ONLY);
 
         if(rc != ReturnCode::OK) {
             logError("Could not create staging buffer");
@@ -1654,76 +2091,34 @@ namespace kvk {
                    imageSize);
         }
 
-        rc = createImage(image,
-                         state,
-                         format,
-                         VkExtent3D{ extent.width, extent.height, 1 },
-                         usageFlags,
-                         true);
-        if(rc != ReturnCode::OK) {
-            logError("Could not create image");
-            return rc;
-        }
-
-        auto transferFunc = [&](VkCommandBuffer cmd) {
-            KAMSKI_PROFILE();
-            transitionImage(cmd,
-                            image.image,
-                            VK_IMAGE_LAYOUT_UNDEFINED,
-                            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                            VK_PIPELINE_STAGE_2_NONE,
-                            0,
-                            VK_PIPELINE_STAGE_2_TRANSFER_BIT);
-
-            VkBufferImageCopy copyRegion = {
-                .bufferOffset      = 0,
-                .bufferRowLength   = 0,
-                .bufferImageHeight = 0,
-
-                .imageSubresource  = {
-                     .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
-                     .mipLevel       = 0,
-                     .baseArrayLayer = 0,
-                     .layerCount     = 6,
-                },
-                .imageExtent = {
-                    .width  = extent.width,
-                    .height = extent.height,
-                    .depth  = 1,
-                },
-            };
-
-            vkCmdCopyBufferToImage(cmd,
-                                   stagingBuffer.buffer,
-                                   image.image,
-                                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                                   1,
-                                   &copyRegion);
-            transitionImage(cmd,
-                            image.image,
-                            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                            VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-                            VK_PIPELINE_STAGE_2_TRANSFER_BIT,
-                            VK_ACCESS_2_MEMORY_WRITE_BIT,
-                            VK_PIPELINE_STAGE_2_NONE,
-                            0);
-        };
+        const VkBufferImageCopy copyRegion = {
+            .bufferOffset      = 0,
+            .bufferRowLength   = 0,
+            .bufferImageHeight = 0,
 
-        PoolInfo poolInfo = lockCommandPool(state, VK_QUEUE_TRANSFER_BIT);
-        defer {
-            unlockCommandPool(state, poolInfo);
+            .imageSubresource  = {
+                 .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+                 .mipLevel       = 0,
+                 .baseArrayLayer = 0,
+                 .layerCount     = 6,
+            },
+            .imageExtent = {
+                .width  = extent.width,
+                .height = extent.height,
+                .depth  = 1,
+            },
         };
-        VkResult res = kvk::immediateSubmit(poolInfo.queue->commandBuffers[poolInfo.poolIndex],
-                                            state.device,
-                                            poolInfo.queue->handle,
-                                            poolInfo.queue->submitMutex,
-                                            transferFunc);
-        if(res != VK_SUCCESS) {
-            logError("transfer failed: %d", res);
-            return ReturnCode::UNKNOWN;
-        }
 
-        return ReturnCode::OK;
+        return createImage(image,
+                           state,
+                           stagingBuffer,
+                           std::span(&copyRegion, 1),
+                           format,
+                           VkExtent3D{ extent.width, extent.height, 1 },
+                           usage,
+                           mipLevels,
+                           true,
+                           mipLevels > 1);
     }
 
     void destroyImage(AllocatedImage& image,
@@ -1733,25 +2128,599 @@ namespace kvk {
         vkDestroyImageView(device,
                            image.view,
                            nullptr);
+        if(image.views) {
+            std::lock_guard lck(image.views->mutex);
+            for(const ImageViewCache::Entry& entry : image.views->entries) {
+                vkDestroyImageView(device, entry.view, nullptr);
+            }
+            image.views->entries.clear();
+        }
         vmaDestroyImage(allocator,
                         image.image,
                         image.allocation);
+        image.views.reset();
+        image.states.reset();
     }
 
+    struct ImageUsageInfo {
+        VkPipelineStageFlags2 stage;
+        VkAccessFlags2        access;
+        VkImageLayout         layout;
+    };
+
+    static constexpr VkAccessFlags2 WRITE_ACCESS_MASK = VK_ACCESS_2_SHADER_WRITE_BIT |
+                                                        VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT |
+                                                        VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT |
+                                                        VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+                                                        VK_ACCESS_2_TRANSFER_WRITE_BIT |
+                                                        VK_ACCESS_2_HOST_WRITE_BIT |
+                                                        VK_ACCESS_2_MEMORY_WRITE_BIT;
+
+    static constexpr ImageUsageInfo IMAGE_USAGE_INFOS[std::uint32_t(ImageUsage::COUNT)] = {
+        { VK_PIPELINE_STAGE_2_NONE, 0, VK_IMAGE_LAYOUT_UNDEFINED },
+        { VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL },
+        { VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL },
+        { VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL },
+        { VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL },
+        { VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT, VK_IMAGE_LAYOUT_GENERAL },
+        { VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_IMAGE_LAYOUT_GENERAL },
+        { VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_ATTACHMENT_OPTIMAL },
+        { VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT, VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_ATTACHMENT_OPTIMAL },
+        { VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT, VK_IMAGE_LAYOUT_READ_ONLY_OPTIMAL },
+        { VK_PIPELINE_STAGE_2_NONE, 0, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR },
+    };
+
+    static ImageRange resolveRange(const AllocatedImage& image, ImageRange range) {
+        if(range.mipCount == VK_REMAINING_MIP_LEVELS) {
+            range.mipCount = image.mipCount - range.baseMip;
+        }
+        if(range.layerCount == VK_REMAINING_ARRAY_LAYERS) {
+            range.layerCount = image.layerCount - range.baseLayer;
+        }
+        assert(range.baseMip + range.mipCount <= image.mipCount);
+        assert(range.baseLayer + range.layerCount <= image.layerCount);
+        return range;
+    }
 
-    void DescriptorAllocator::init(VkDevice                 device,
-                                   std::uint32_t            initialSets,
-                                   std::span<PoolSizeRatio> poolRatios) {
-        KAMSKI_PROFILE();
-        ratios.clear();
-        VkDescriptorPool newPool = createPool(device, initialSets, poolRatios);
-        setsPerPool              = initialSets * 1.5f;
-        readyPools.push_back(newPool);
+    // Whether the barriers since the last write already cover a read with usage
+    static bool isVisible(const ImageState& state, const ImageUsageInfo& usage) {
+        const bool stageCovered  = (state.visibleStage & VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT) ||
+                                  (usage.stage & ~state.visibleStage) == 0;
+        const bool accessCovered = (state.visibleAccess & VK_ACCESS_2_MEMORY_READ_BIT) ||
+                                   (usage.access & ~state.visibleAccess) == 0;
+        return stageCovered && accessCovered;
     }
 
-    VkDescriptorPool DescriptorAllocator::getPool(VkDevice device) {
-        KAMSKI_PROFILE();
-        VkDescriptorPool retval;
+    static void addImageBarrier(BarrierBatch&         batch,
+                                const AllocatedImage& image,
+                                const ImageState&     oldState,
+                                const ImageUsageInfo& newUsage,
+                                std::uint32_t         srcQueueFamily,
+                                std::uint32_t         dstQueueFamily,
+                                std::uint32_t         mip,
+                                std::uint32_t         layer) {
+        batch.image(image.image,
+                    oldState.layout,
+                    newUsage.layout,
+                    oldState.stage,
+                    oldState.access & WRITE_ACCESS_MASK,
+                    newUsage.stage,
+                    newUsage.access,
+                    VkImageSubresourceRange{
+                        .aspectMask     = imageAspect(image.format),
+                        .baseMipLevel   = mip,
+                        .levelCount     = 1,
+                        .baseArrayLayer = layer,
+                        .layerCount     = 1,
+                    },
+                    srcQueueFamily,
+                    dstQueueFamily);
+    }
+
+    //
+    // Images without states (swapchain images, images wrapped by hand) are assumed to already be in
+    // the layout usage needs, so all that can be done is waiting for everything before the access
+    //
+    static void addUntrackedBarrier(BarrierBatch&         batch,
+                                    const AllocatedImage& image,
+                                    const ImageUsageInfo& newUsage,
+                                    ImageRange            range,
+                                    std::uint32_t         srcQueueFamily,
+                                    std::uint32_t         dstQueueFamily) {
+        batch.image(image.image,
+                    newUsage.layout,
+                    newUsage.layout,
+                    VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                    VK_ACCESS_2_MEMORY_WRITE_BIT,
+                    newUsage.stage,
+                    newUsage.access,
+                    VkImageSubresourceRange{
+                        .aspectMask     = imageAspect(image.format),
+                        .baseMipLevel   = range.baseMip,
+                        .levelCount     = range.mipCount,
+                        .baseArrayLayer = range.baseLayer,
+                        .layerCount     = range.layerCount,
+                    },
+                    srcQueueFamily,
+                    dstQueueFamily);
+    }
+
+    void require(BarrierBatch&   batch,
+                 AllocatedImage& image,
+                 ImageUsage      usage,
+                 ImageRange      range,
+                 std::uint32_t   queueFamily) {
+        KAMSKI_PROFILE();
+        const ImageUsageInfo& newUsage = IMAGE_USAGE_INFOS[std::uint32_t(usage)];
+        const bool            isWrite  = (newUsage.access & WRITE_ACCESS_MASK) != 0;
+        if(!image.states) {
+            // Acquiring needs the family that released, only tracked images know it
+            assert(queueFamily == VK_QUEUE_FAMILY_IGNORED);
+            addUntrackedBarrier(batch, image, newUsage, range, VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED);
+            return;
+        }
+
+        range                          = resolveRange(image, range);
+        for(std::uint32_t layer = range.baseLayer; layer != range.baseLayer + range.layerCount; layer++) {
+            for(std::uint32_t mip = range.baseMip; mip != range.baseMip + range.mipCount; mip++) {
+                ImageState& state        = image.states[layer * image.mipCount + mip];
+                const bool  isAcquire    = queueFamily != VK_QUEUE_FAMILY_IGNORED &&
+                                       state.queueFamily != VK_QUEUE_FAMILY_IGNORED &&
+                                       state.queueFamily != queueFamily;
+                const bool  needsBarrier = isAcquire ||
+                                          isWrite ||
+                                          state.layout != newUsage.layout ||
+                                          (state.access & WRITE_ACCESS_MASK) != 0;
+                if(!needsBarrier) {
+                    //
+                    // Read after read in the same layout. A reader the last barrier did not cover waits
+                    // on the earlier readers, which chains it to that barrier, the contents are already
+                    // available so making them visible is enough. Later writes wait for it too
+                    //
+                    if(!isVisible(state, newUsage)) {
+                        addImageBarrier(batch, image, state, newUsage, VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, mip, layer);
+                        state.visibleStage  |= newUsage.stage;
+                        state.visibleAccess |= newUsage.access;
+                    }
+                    state.stage  |= newUsage.stage;
+                    state.access |= newUsage.access;
+                    continue;
+                }
+
+                addImageBarrier(batch,
+                                image,
+                                state,
+                                newUsage,
+                                isAcquire ? state.queueFamily : VK_QUEUE_FAMILY_IGNORED,
+                                isAcquire ? queueFamily : VK_QUEUE_FAMILY_IGNORED,
+                                mip,
+                                layer);
+                state = ImageState{
+                    .layout        = newUsage.layout,
+                    .stage         = newUsage.stage,
+                    .access        = newUsage.access,
+                    .visibleStage  = newUsage.stage,
+                    .visibleAccess = newUsage.access,
+                    .queueFamily   = queueFamily == VK_QUEUE_FAMILY_IGNORED ? state.queueFamily : queueFamily,
+                };
+            }
+        }
+    }
+
+    void require(VkCommandBuffer cmd,
+                 AllocatedImage& image,
+                 ImageUsage      usage,
+                 ImageRange      range,
+                 std::uint32_t   queueFamily) {
+        BarrierBatch batch;
+        require(batch, image, usage, range, queueFamily);
+        batch.flush(cmd);
+    }
+
+    void releaseImage(BarrierBatch&   batch,
+                      AllocatedImage& image,
+                      ImageUsage      usage,
+                      std::uint32_t   srcQueueFamily,
+                      std::uint32_t   dstQueueFamily,
+                      ImageRange      range) {
+        KAMSKI_PROFILE();
+        const ImageUsageInfo& newUsage = IMAGE_USAGE_INFOS[std::uint32_t(usage)];
+        // The release half only has to make the writes available, the acquire waits on the other queue
+        const ImageUsageInfo  release  = { VK_PIPELINE_STAGE_2_NONE, 0, newUsage.layout };
+        if(!image.states) {
+            addUntrackedBarrier(batch, image, release, range, srcQueueFamily, dstQueueFamily);
+            return;
+        }
+
+        range                          = resolveRange(image, range);
+        for(std::uint32_t layer = range.baseLayer; layer != range.baseLayer + range.layerCount; layer++) {
+            for(std::uint32_t mip = range.baseMip; mip != range.baseMip + range.mipCount; mip++) {
+                ImageState& state = image.states[layer * image.mipCount + mip];
+                addImageBarrier(batch, image, state, release, srcQueueFamily, dstQueueFamily, mip, layer);
+                // The matching require on the destination queue performs the same layout transition
+                state = ImageState{
+                    .layout      = state.layout,
+                    .stage       = VK_PIPELINE_STAGE_2_NONE,
+                    .access      = 0,
+                    .queueFamily = srcQueueFamily,
+                };
+            }
+        }
+    }
+
+    void releaseImage(VkCommandBuffer cmd,
+                      AllocatedImage& image,
+                      ImageUsage      usage,
+                      std::uint32_t   srcQueueFamily,
+                      std::uint32_t   dstQueueFamily,
+                      ImageRange      range) {
+        BarrierBatch batch;
+        releaseImage(batch, image, usage, srcQueueFamily, dstQueueFamily, range);
+        batch.flush(cmd);
+    }
+
+    static ImageViewKey resolveViewKey(const AllocatedImage& image, const ImageViewKey& key) {
+        ImageViewKey resolved = key;
+        if(resolved.format == VK_FORMAT_UNDEFINED) {
+            resolved.format = image.format;
+        }
+        if(resolved.aspect == 0) {
+            resolved.aspect = imageAspect(resolved.format);
+        }
+        resolved.range = resolveRange(image, key.range);
+        return resolved;
+    }
+
+    static VkImageView createResolvedView(RendererState& state, const AllocatedImage& image, const ImageViewKey& resolved) {
+        const VkImageViewCreateInfo viewInfo = {
+            .sType            = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+            .image            = image.image,
+            .viewType         = resolved.type,
+            .format           = resolved.format,
+            .subresourceRange = {
+                .aspectMask     = resolved.aspect,
+                .baseMipLevel   = resolved.range.baseMip,
+                .levelCount     = resolved.range.mipCount,
+                .baseArrayLayer = resolved.range.baseLayer,
+                .layerCount     = resolved.range.layerCount,
+            },
+        };
+        VkImageView view;
+        if(vkCreateImageView(state.device, &viewInfo, nullptr, &view) != VK_SUCCESS) {
+            logError("Could not create image view");
+            return VK_NULL_HANDLE;
+        }
+        return view;
+    }
+
+    VkImageView imageView(RendererState& state, AllocatedImage& image, const ImageViewKey& key) {
+        KAMSKI_PROFILE();
+        if(!image.views) {
+            logError("Image has no view cache, it was not created by createImage");
+            return VK_NULL_HANDLE;
+        }
+        const ImageViewKey resolved = resolveViewKey(image, key);
+
+        std::lock_guard lck(image.views->mutex);
+        for(const ImageViewCache::Entry& entry : image.views->entries) {
+            if(entry.key.type == resolved.type &&
+               entry.key.format == resolved.format &&
+               entry.key.aspect == resolved.aspect &&
+               memcmp(&entry.key.range, &resolved.range, sizeof(ImageRange)) == 0) {
+                return entry.view;
+            }
+        }
+
+        const VkImageView view = createResolvedView(state, image, resolved);
+        if(view != VK_NULL_HANDLE) {
+            image.views->entries.push_back({ resolved, view });
+        }
+        return view;
+    }
+
+    VkImageView createImageView(RendererState& state, const AllocatedImage& image, const ImageViewKey& key) {
+        return createResolvedView(state, image, resolveViewKey(image, key));
+    }
+
+    void setImageState(AllocatedImage&       image,
+                       VkImageLayout         layout,
+                       VkPipelineStageFlags2 stage,
+                       VkAccessFlags2        access,
+                       ImageRange            range) {
+        if(!image.states) {
+            return;
+        }
+        range = resolveRange(image, range);
+        for(std::uint32_t layer = range.baseLayer; layer != range.baseLayer + range.layerCount; layer++) {
+            for(std::uint32_t mip = range.baseMip; mip != range.baseMip + range.mipCount; mip++) {
+                ImageState& state = image.states[layer * image.mipCount + mip];
+                state.layout        = layout;
+                state.stage         = stage;
+                state.access        = access;
+                state.visibleStage  = stage;
+                state.visibleAccess = access;
+            }
+        }
+    }
+
+
+    ReturnCode MipGenerator::init(RendererState& state, Cache& cache, std::string_view shaderName) {
+        KAMSKI_PROFILE();
+        if(!state.storageImageWithoutFormat) {
+            logWarning("Storage images without format are not available, mips will be blitted");
+            return ReturnCode::UNKNOWN;
+        }
+
+        VkPhysicalDeviceSubgroupProperties subgroupProps = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES,
+        };
+        VkPhysicalDeviceProperties2 props = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+            .pNext = &subgroupProps,
+        };
+        vkGetPhysicalDeviceProperties2(state.physicalDevice, &props);
+        if(!(subgroupProps.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT) ||
+           !(subgroupProps.supportedOperations & VK_SUBGROUP_FEATURE_QUAD_BIT)) {
+            logWarning("Quad subgroup operations are not available in compute shaders, mips will be blitted");
+            return ReturnCode::UNKNOWN;
+        }
+
+        DescriptorSetLayoutBuilder builder;
+        builder.addBinding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, MAX_MIP_COUNT)
+            .addBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+        if(!builder.buildPush(setLayout, state.device, VK_SHADER_STAGE_COMPUTE_BIT)) {
+            return ReturnCode::UNKNOWN;
+        }
+
+        const VkPushConstantRange pushConstantRange = {
+            .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+            .offset     = 0,
+            .size       = sizeof(PushConstants),
+        };
+        const VkPipelineLayoutCreateInfo layoutCreateInfo = {
+            .sType                  = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+            .setLayoutCount         = 1,
+            .pSetLayouts            = &setLayout,
+            .pushConstantRangeCount = 1,
+            .pPushConstantRanges    = &pushConstantRange,
+        };
+        VK_CHECK(vkCreatePipelineLayout(state.device, &layoutCreateInfo, nullptr, &layout));
+
+        for(std::uint32_t filter = 0; filter != std::uint32_t(MipFilter::COUNT); filter++) {
+            ReturnCode rc = PipelineBuilder()
+                                .addShaders(shaderName, VK_SHADER_STAGE_COMPUTE_BIT)
+                                .setPipelineLayout(layout)
+                                .addSpecializationConstant(filter, 0, PipelineBuilder::SHADER_STAGE_COMPUTE)
+                                .buildCompute(pipelines[filter], cache, state.device, "mip_generator");
+            if(rc != ReturnCode::OK) {
+                logError("Could not build mip generator pipeline %u", filter);
+                return rc;
+            }
+        }
+
+        return createBuffer(counters,
+                            state.device,
+                            state.allocator,
+                            COUNTER_COUNT * sizeof(std::uint32_t),
+                            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                            VMA_MEMORY_USAGE_GPU_ONLY);
+    }
+
+    void MipGenerator::destroy(RendererState& state) {
+        KAMSKI_PROFILE();
+        for(Pipeline& pipeline : pipelines) {
+            vkDestroyPipeline(state.device, pipeline.handle, nullptr);
+            pipeline.handle = VK_NULL_HANDLE;
+        }
+        vkDestroyPipelineLayout(state.device, layout, nullptr);
+        vkDestroyDescriptorSetLayout(state.device, setLayout, nullptr);
+        destroyBuffer(counters, state.allocator);
+        layout         = VK_NULL_HANDLE;
+        setLayout      = VK_NULL_HANDLE;
+        counters       = {};
+    }
+
+    bool MipGenerator::isInitialized() const {
+        return counters.buffer != VK_NULL_HANDLE;
+    }
+
+    bool MipGenerator::supportsFormat(VkPhysicalDevice physicalDevice, VkFormat format) const {
+        if(!isInitialized()) {
+            return false;
+        }
+        VkFormatProperties formatProps;
+        vkGetPhysicalDeviceFormatProperties(physicalDevice, storageCompatibleFormat(format), &formatProps);
+        return formatProps.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT;
+    }
+
+    void MipGenerator::cmdGenerate(VkCommandBuffer           cmd,
+                                   RendererState&            state,
+                                   AllocatedImage&           image,
+                                   MipFilter                 filter,
+                                   VkImageLayout             currentLayout,
+                                   VkImageLayout             finalLayout,
+                                   std::vector<VkImageView>& views) {
+        KAMSKI_PROFILE();
+        assert(image.mipCount <= MAX_MIP_COUNT);
+        assert(image.usage & VK_IMAGE_USAGE_STORAGE_BIT);
+
+        const std::uint32_t mipCount   = image.mipCount;
+        const std::uint32_t layerCount = image.layerCount;
+        const VkFormat      viewFormat = storageCompatibleFormat(image.format);
+        if(mipCount <= 1) {
+            if(currentLayout != finalLayout) {
+                transitionImage(cmd, image.image, currentLayout, finalLayout);
+                setImageState(image, finalLayout, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_MEMORY_READ_BIT);
+            }
+            return;
+        }
+
+        VkDescriptorImageInfo imageInfos[MAX_MIP_COUNT];
+        for(std::uint32_t mip = 0; mip != mipCount; mip++) {
+            const VkImageView view = createImageView(state,
+                                                     image,
+                                                     {
+                                                         .type   = VK_IMAGE_VIEW_TYPE_2D_ARRAY,
+                                                         .format = viewFormat,
+                                                         .range  = { .baseMip = mip, .mipCount = 1 },
+                                                     });
+            if(view == VK_NULL_HANDLE) {
+                logError("Could not create mip %u storage view", mip);
+                return;
+            }
+            views.push_back(view);
+            imageInfos[mip] = VkDescriptorImageInfo{
+                .imageView   = view,
+                .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+            };
+        }
+        // Every array element has to be valid, the shader never touches the ones past mipCount
+        for(std::uint32_t mip = mipCount; mip != MAX_MIP_COUNT; mip++) {
+            imageInfos[mip] = imageInfos[mipCount - 1];
+        }
+
+        // The second half of a dispatch only reduces a single 64x64 tile,
+        // so mips above 4096 texels only get the first 6 levels per dispatch
+        auto mipsInDispatch = [&](std::uint32_t baseMip) {
+            const std::uint32_t size     = std::max(image.extent.width, image.extent.height) >> baseMip;
+            const std::uint32_t maxCount = size > 4096 ? MAX_MIPS_PER_DISPATCH / 2 : MAX_MIPS_PER_DISPATCH;
+            return std::min(maxCount, mipCount - 1 - baseMip);
+        };
+        std::uint32_t dispatchCount = 0;
+        for(std::uint32_t baseMip = 0; baseMip < mipCount - 1; baseMip += mipsInDispatch(baseMip)) {
+            dispatchCount++;
+        }
+        //
+        // Slices are handed out round robin and may still be in use by an earlier generation that
+        // has not retired. Every generation is recorded for the graphics queue, so waiting on the
+        // compute work submitted before this one orders the refill after any previous user
+        //
+        const std::uint32_t counterCount = dispatchCount * layerCount;
+        assert(counterCount <= COUNTER_COUNT);
+        std::uint32_t counterBase = nextCounter.fetch_add(counterCount) % COUNTER_COUNT;
+        if(counterBase + counterCount > COUNTER_COUNT) {
+            counterBase = 0;
+        }
+        const VkBufferMemoryBarrier2 reuseBarrier = {
+            .sType               = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+            .srcStageMask        = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+            .srcAccessMask       = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+            .dstStageMask        = VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+            .dstAccessMask       = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .buffer              = counters.buffer,
+            .offset              = counterBase * sizeof(std::uint32_t),
+            .size                = counterCount * sizeof(std::uint32_t),
+        };
+        const VkDependencyInfo reuseDependency = {
+            .sType                    = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+            .bufferMemoryBarrierCount = 1,
+            .pBufferMemoryBarriers    = &reuseBarrier,
+        };
+        vkCmdPipelineBarrier2(cmd, &reuseDependency);
+        vkCmdFillBuffer(cmd,
+                        counters.buffer,
+                        counterBase * sizeof(std::uint32_t),
+                        counterCount * sizeof(std::uint32_t),
+                        0);
+
+        const VkBufferMemoryBarrier2 counterBarrier = {
+            .sType               = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+            .srcStageMask        = VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+            .srcAccessMask       = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+            .dstStageMask        = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+            .dstAccessMask       = VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .buffer              = counters.buffer,
+            .offset              = counterBase * sizeof(std::uint32_t),
+            .size                = counterCount * sizeof(std::uint32_t),
+        };
+        const VkImageMemoryBarrier2 imageBarrier = {
+            .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+            .srcStageMask        = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+            .srcAccessMask       = VK_ACCESS_2_MEMORY_WRITE_BIT,
+            .dstStageMask        = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+            .dstAccessMask       = VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+            .oldLayout           = currentLayout,
+            .newLayout           = VK_IMAGE_LAYOUT_GENERAL,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image               = image.image,
+            .subresourceRange    = imageSubresourceRange(VK_IMAGE_ASPECT_COLOR_BIT),
+        };
+        const VkDependencyInfo dependencyInfo = {
+            .sType                    = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+            .bufferMemoryBarrierCount = 1,
+            .pBufferMemoryBarriers    = &counterBarrier,
+            .imageMemoryBarrierCount  = 1,
+            .pImageMemoryBarriers     = &imageBarrier,
+        };
+        vkCmdPipelineBarrier2(cmd, &dependencyInfo);
+
+        Pipeline& pipeline = pipelines[std::uint32_t(filter)];
+        pipeline.bind(cmd);
+
+        DescriptorWriter writer;
+        writer.writeImages(0, std::span(imageInfos, MAX_MIP_COUNT), VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+        writer.writeBuffer(1, counters.buffer, VK_WHOLE_SIZE, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+        writer.push(cmd, 0, pipeline);
+
+        std::uint32_t baseMip = 0;
+        for(std::uint32_t dispatch = 0; dispatch != dispatchCount; dispatch++) {
+            if(dispatch != 0) {
+                // The next dispatch reads the tail the previous one wrote
+                const VkMemoryBarrier2 memoryBarrier = {
+                    .sType         = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+                    .srcStageMask  = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                    .srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                    .dstStageMask  = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                    .dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                };
+                const VkDependencyInfo memoryDependency = {
+                    .sType              = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                    .memoryBarrierCount = 1,
+                    .pMemoryBarriers    = &memoryBarrier,
+                };
+                vkCmdPipelineBarrier2(cmd, &memoryDependency);
+            }
+
+            const std::uint32_t width         = std::max(1u, image.extent.width >> baseMip);
+            const std::uint32_t height        = std::max(1u, image.extent.height >> baseMip);
+            const PushConstants pushConstants = {
+                .baseMip     = baseMip,
+                .mipCount    = mipsInDispatch(baseMip),
+                .counterBase = counterBase + dispatch * layerCount,
+                .flags       = viewFormat != image.format ? 1u : 0u,
+            };
+            pipeline.pushConstants(cmd, pushConstants);
+            vkCmdDispatch(cmd, (width + 63) / 64, (height + 63) / 64, layerCount);
+            baseMip += pushConstants.mipCount;
+        }
+
+        transitionImage(cmd,
+                        image.image,
+                        VK_IMAGE_LAYOUT_GENERAL,
+                        finalLayout,
+                        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                        VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+        setImageState(image, finalLayout, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_MEMORY_READ_BIT);
+    }
+
+    void DescriptorAllocator::init(VkDevice                 device,
+                                   std::uint32_t            initialSets,
+                                   std::span<PoolSizeRatio> poolRatios) {
+        KAMSKI_PROFILE();
+        ratios.clear();
+        VkDescriptorPool newPool = createPool(device, initialSets, poolRatios);
+        setsPerPool              = initialSets * 1.5f;
+        readyPools.push_back(newPool);
+    }
+
+    VkDescriptorPool DescriptorAllocator::getPool(VkDevice device) {
+        KAMSKI_PROFILE();
+        VkDescriptorPool retval;
 
         if(!readyPools.empty()) {
             retval = readyPools.back();
@@ -2001,22 +2970,96 @@ namespace kvk {
                                writes.data());
     }
 
+    using PresentClock = std::chrono::steady_clock;
+
+    static float millisecondsBetween(PresentClock::time_point from, PresentClock::time_point to) {
+        return std::chrono::duration<float, std::milli>(to - from).count();
+    }
+
+    static void averageInto(float& average, float sample, float weight = 0.1f) {
+        average = average == 0.0f ? sample : average + (sample - average) * weight;
+    }
+
+    static void recordPresentLatency(PresentTiming& timing, const FrameData& presented, PresentClock::time_point now) {
+        timing.latencyMs = millisecondsBetween(presented.submitTime, now);
+        averageInto(timing.averageLatencyMs, timing.latencyMs);
+    }
+
+    //
+    // LOW_LATENCY: waits until the previous frame is on screen, then sleeps until the next frame
+    // just about finishes before the following vblank. The work estimate is the recording time
+    // plus a decaying minimum of the latency, which is GPU time plus whatever vblank wait is left.
+    //
+    static void paceLowLatency(RendererState& state) {
+        KAMSKI_PROFILE();
+        if(state.presentId == state.swapchainPresentIdBase) {
+            // Nothing presented to this swapchain yet
+            return;
+        }
+        PresentTiming& timing = state.presentTiming;
+        VkResult       res    = state.vkWaitForPresent(state.device, state.swapchain, state.presentId, 100ull * 1000ull * 1000ull);
+        if(res != VK_SUCCESS) {
+            // Timed out or the swapchain is out of date, skip pacing this frame
+            return;
+        }
+
+        const PresentClock::time_point now      = PresentClock::now();
+        const std::uint32_t            previous = (state.currentFrame + state.framesInFlight - 1) % state.framesInFlight;
+        recordPresentLatency(timing, state.frames[previous], now);
+        if(timing.latencyFloorMs == 0.0f || timing.latencyMs < timing.latencyFloorMs) {
+            timing.latencyFloorMs = timing.latencyMs;
+        } else {
+            timing.latencyFloorMs += (timing.latencyMs - timing.latencyFloorMs) * 0.01f;
+        }
+
+        if(timing.lastPresentTime != PresentClock::time_point{}) {
+            // Missed vblanks show up as longer intervals, so track the smallest one seen
+            const float interval = millisecondsBetween(timing.lastPresentTime, now);
+            if(timing.refreshMs == 0.0f || interval < timing.refreshMs) {
+                timing.refreshMs = interval;
+            } else {
+                timing.refreshMs += (interval - timing.refreshMs) * 0.01f;
+            }
+        }
+        timing.lastPresentTime = now;
+
+        constexpr float MARGIN_MS = 1.0f;
+        const float     sleepMs   = timing.refreshMs - timing.recordMs - timing.latencyFloorMs - MARGIN_MS;
+        if(timing.refreshMs != 0.0f && sleepMs > 0.0f) {
+            KAMSKI_PROFILE_NAMED("Sleep until frame start");
+            std::this_thread::sleep_for(std::chrono::duration<float, std::milli>(sleepMs));
+        }
+    }
+
     FrameData* startFrame(RendererState& state, std::uint32_t& frameIndex) {
         KAMSKI_PROFILE();
         frameIndex       = state.currentFrame;
         FrameData& frame = state.frames[state.currentFrame];
-        {
-            KAMSKI_PROFILE_NAMED("WaitForFences");
-            VkResult res = vkWaitForFences(state.device,
-                                           1,
-                                           &frame.inFlightFence,
-                                           VK_TRUE,
-                                           1000ull * 1000ull * 1000ull);
+        const bool paced = state.presentPolicy == PresentPolicy::LOW_LATENCY && state.vkWaitForPresent;
+        if(paced) {
+            paceLowLatency(state);
+        }
+        if(frame.queue) {
+            KAMSKI_PROFILE_NAMED("Wait for frame");
+            VkResult res = waitTimeline(state, *frame.queue, frame.timelineValue);
             if(res != VK_SUCCESS) {
-                logInfo("Wait for fence failed %d", res);
-                assert(false);
+                logError("Waiting for frame %u failed: %d", frameIndex, res);
+                return nullptr;
+            }
+            // Nothing blocked on this frame's present, sample it now that the slot comes around
+            if(!paced) {
+                const bool presented = !state.vkWaitForPresent ||
+                                       (frame.presentId != 0 && state.vkWaitForPresent(state.device, state.swapchain, frame.presentId, 0) == VK_SUCCESS);
+                if(presented) {
+                    recordPresentLatency(state.presentTiming, frame, PresentClock::now());
+                }
             }
         }
+        frame.startTime = PresentClock::now();
+        // A failed recreateSwapchain leaves none, the caller recreates as after OUT_OF_DATE
+        if(state.swapchain == VK_NULL_HANDLE) {
+            return nullptr;
+        }
         std::uint32_t imageIndex;
 
         VkResult      result      = vkAcquireNextImageKHR(state.device,
@@ -2027,10 +3070,6 @@ namespace kvk {
                                                           &imageIndex);
         frame.swapchainImageIndex = imageIndex;
 
-        vkResetFences(state.device,
-                      1,
-                      &frame.inFlightFence);
-
         if(result == VK_ERROR_OUT_OF_DATE_KHR) {
             return nullptr;
         } else if(result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
@@ -2038,59 +3077,80 @@ namespace kvk {
             return nullptr;
         }
 
-        //
-        // Flush the per-frame deletionQueue
-        //
-        for(auto iter = frame.deletionQueue.rbegin(); iter != frame.deletionQueue.rend(); ++iter) {
-            (*iter)();
+        if(frame.queue) {
+            retireDestroys(state, completedTimelineValue(state, *frame.queue));
         }
-        {
-            KAMSKI_PROFILE_NAMED("Clear deletion queue");
-            frame.deletionQueue.clear();
+        for(std::uint32_t i = 0; i != frame.workerCount; i++) {
+            vkResetCommandPool(state.device, frame.workerPools[i], 0);
         }
+        frame.workerCount = 0;
 
         PoolInfo poolInfo   = lockCommandPool(state, VK_QUEUE_GRAPHICS_BIT);
         frame.commandBuffer = poolInfo.queue->commandBuffers[poolInfo.poolIndex];
         frame.queue         = poolInfo.queue;
-        frame.inFlightFence = poolInfo.queue->fences[poolInfo.poolIndex];
-        frame.deletionQueue.emplace_back([&state, poolInfo]() mutable {
-            unlockCommandPool(state, poolInfo);
-        });
+        deferDestroy(state, { .poolInfo = poolInfo, .type = DeferredDestroy::POOL_SLOT });
 
         return &frame;
     }
 
     ReturnCode endFrame(RendererState& state, FrameData& frame) {
         KAMSKI_PROFILE();
-        state.currentFrame                = (state.currentFrame + 1) % MAX_IN_FLIGHT_FRAMES;
+        state.currentFrame                = (state.currentFrame + 1) % state.framesInFlight;
 
 
-        VkPipelineStageFlags waitStages[] = {
-            VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
-        };
+        frame.submitTime = PresentClock::now();
+        averageInto(state.presentTiming.recordMs, millisecondsBetween(frame.startTime, frame.submitTime));
 
-        VkSubmitInfo submitInfo = {
-            .sType                = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-            .waitSemaphoreCount   = 1,
-            .pWaitSemaphores      = &frame.imageAvailableSemaphore,
-            .pWaitDstStageMask    = waitStages,
-            .commandBufferCount   = 1,
-            .pCommandBuffers      = &frame.commandBuffer,
-            .signalSemaphoreCount = 1,
-            .pSignalSemaphores    = &state.renderFinishedSemaphores[frame.swapchainImageIndex],
+        // The primary goes first, the worker buffers follow it in the same batch so split passes resume
+        std::vector<VkCommandBuffer> commandBuffers;
+        commandBuffers.reserve(1 + frame.workerCount);
+        commandBuffers.push_back(frame.commandBuffer);
+        commandBuffers.insert(commandBuffers.end(), frame.workerCommandBuffers.begin(), frame.workerCommandBuffers.begin() + frame.workerCount);
+        const VkSemaphoreSubmitInfo waitInfo = {
+            .sType     = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+            .semaphore = frame.imageAvailableSemaphore,
+            .stageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
         };
+        const VkSemaphoreSubmitInfo signalInfo = {
+            .sType     = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+            .semaphore = state.renderFinishedSemaphores[frame.swapchainImageIndex],
+            .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+        };
+        frame.timelineValue = enqueueSubmit(*frame.queue, commandBuffers, { &waitInfo, 1 }, { &signalInfo, 1 });
 
-        std::lock_guard lck(frame.queue->submitMutex);
-        if(VkResult res = vkQueueSubmit(frame.queue->handle,
-                                        1,
-                                        &submitInfo,
-                                        frame.inFlightFence)) {
-            logError("Queue submit failed: %d", res);
+        // Everything deferred while recording is in use by this submit. Stamped before anything below can
+        // bail out, otherwise the records would wait for a later frame. Pending records sit towards the
+        // back, interleaved with uploads that were deferred with their own value
+        {
+            std::lock_guard lck(state.deletions.mutex);
+            DeletionRing&   ring     = state.deletions;
+            const u32       capacity = u32(ring.records.size());
+            for(std::uint32_t i = ring.count; i != 0 && ring.pendingCount != 0; i--) {
+                DeferredDestroy& record = ring.records[(ring.head + i - 1) % capacity];
+                if(record.timelineValue == PENDING_FRAME_VALUE) {
+                    record.timelineValue = frame.timelineValue;
+                    ring.pendingCount--;
+                }
+            }
+        }
+
+        // Uploads and async work collected since the last frame go out with it, one submit per queue
+        if(flushAllSubmits(state) != VK_SUCCESS) {
             return ReturnCode::UNKNOWN;
         }
 
+        VkPresentIdKHR presentIdInfo = {
+            .sType          = VK_STRUCTURE_TYPE_PRESENT_ID_KHR,
+            .swapchainCount = 1,
+            .pPresentIds    = &frame.presentId,
+        };
+        if(state.vkWaitForPresent) {
+            frame.presentId = ++state.presentId;
+        }
+
         VkPresentInfoKHR presentInfo = {
             .sType              = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+            .pNext              = state.vkWaitForPresent ? &presentIdInfo : nullptr,
             .waitSemaphoreCount = 1,
             .pWaitSemaphores    = &state.renderFinishedSemaphores[frame.swapchainImageIndex],
             .swapchainCount     = 1,
@@ -2099,7 +3159,8 @@ namespace kvk {
             .pResults           = nullptr
         };
 
-        VkResult result = vkQueuePresentKHR(frame.queue->handle, &presentInfo);
+        std::lock_guard lck(frame.queue->submitMutex);
+        VkResult        result = vkQueuePresentKHR(frame.queue->handle, &presentInfo);
         if(result == VK_ERROR_OUT_OF_DATE_KHR) {
             return ReturnCode::UNKNOWN;
         } else if(result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
@@ -2109,6 +3170,197 @@ namespace kvk {
         return ReturnCode::OK;
     }
 
+    ReturnCode acquireWorkerCommandBuffers(RendererState&              state,
+                                           FrameData&                  frame,
+                                           std::uint32_t               count,
+                                           std::span<VkCommandBuffer>& commandBuffers) {
+        KAMSKI_PROFILE();
+        if(frame.queue == nullptr) {
+            logError("Worker command buffers need a started frame");
+            return ReturnCode::WRONG_PARAMETERS;
+        }
+
+        // Pools are created on first use and kept, the frame's pool family never changes
+        while(frame.workerPools.size() < frame.workerCount + count) {
+            const VkCommandPoolCreateInfo poolCreateInfo = {
+                .sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+                .flags            = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+                .queueFamilyIndex = frame.queue->familyIndex,
+            };
+            VkCommandPool pool;
+            if(vkCreateCommandPool(state.device, &poolCreateInfo, nullptr, &pool) != VK_SUCCESS) {
+                logError("Could not create worker command pool");
+                return ReturnCode::UNKNOWN;
+            }
+            const VkCommandBufferAllocateInfo allocInfo = {
+                .sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+                .commandPool        = pool,
+                .level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+                .commandBufferCount = 1,
+            };
+            VkCommandBuffer cmd;
+            if(vkAllocateCommandBuffers(state.device, &allocInfo, &cmd) != VK_SUCCESS) {
+                logError("Could not allocate worker command buffer");
+                vkDestroyCommandPool(state.device, pool, nullptr);
+                return ReturnCode::UNKNOWN;
+            }
+            frame.workerPools.push_back(pool);
+            frame.workerCommandBuffers.push_back(cmd);
+        }
+
+        commandBuffers     = std::span<VkCommandBuffer>(frame.workerCommandBuffers).subspan(frame.workerCount, count);
+        frame.workerCount += count;
+        return ReturnCode::OK;
+    }
+
+    ReturnCode recordWorkerCommandBuffers(RendererState&                                             state,
+                                          FrameData&                                                 frame,
+                                          std::uint32_t                                              workerCount,
+                                          const std::function<void(VkCommandBuffer, std::uint32_t)>& function) {
+        KAMSKI_PROFILE();
+        std::span<VkCommandBuffer> commandBuffers;
+        ReturnCode                 rc = acquireWorkerCommandBuffers(state, frame, std::max(1u, workerCount), commandBuffers);
+        if(rc != ReturnCode::OK) {
+            return rc;
+        }
+
+        std::atomic<bool> failed    = false;
+        auto              recordJob = [&](std::uint32_t workerIndex) {
+            KAMSKI_PROFILE_NAMED("Record worker commands");
+            const VkCommandBuffer          cmd       = commandBuffers[workerIndex];
+            const VkCommandBufferBeginInfo beginInfo = {
+                .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+            };
+            if(vkBeginCommandBuffer(cmd, &beginInfo) != VK_SUCCESS) {
+                failed = true;
+                return;
+            }
+            function(cmd, workerIndex);
+            if(vkEndCommandBuffer(cmd) != VK_SUCCESS) {
+                failed = true;
+            }
+        };
+
+        workerPool().parallelFor(std::uint32_t(commandBuffers.size()), recordJob);
+        if(failed) {
+            logError("Recording worker command buffers failed");
+            return ReturnCode::UNKNOWN;
+        }
+        return ReturnCode::OK;
+    }
+
+    VkRenderingFlags splitRenderingFlags(std::uint32_t partIndex, std::uint32_t partCount) {
+        VkRenderingFlags flags = 0;
+        if(partIndex != 0) {
+            flags |= VK_RENDERING_RESUMING_BIT;
+        }
+        if(partIndex + 1 < partCount) {
+            flags |= VK_RENDERING_SUSPENDING_BIT;
+        }
+        return flags;
+    }
+
+    ReturnCode createCachedCommands(CachedCommands& cached, RendererState& state, const CachedCommandsSettings& settings) {
+        KAMSKI_PROFILE();
+        const VkCommandPoolCreateInfo poolCreateInfo = {
+            .sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+            .flags            = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+            .queueFamilyIndex = state.queues[0].familyIndex,
+        };
+        if(vkCreateCommandPool(state.device, &poolCreateInfo, nullptr, &cached.pool) != VK_SUCCESS) {
+            logError("Could not create cached command pool");
+            return ReturnCode::UNKNOWN;
+        }
+        const VkCommandBufferAllocateInfo allocInfo = {
+            .sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool        = cached.pool,
+            .level              = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+            .commandBufferCount = state.framesInFlight,
+        };
+        if(vkAllocateCommandBuffers(state.device, &allocInfo, cached.buffers) != VK_SUCCESS) {
+            logError("Could not allocate cached command buffers");
+            vkDestroyCommandPool(state.device, cached.pool, nullptr);
+            cached.pool = VK_NULL_HANDLE;
+            return ReturnCode::UNKNOWN;
+        }
+
+        cached.colorFormats.assign(settings.colorFormats.begin(), settings.colorFormats.end());
+        cached.depthFormat     = settings.depthFormat;
+        cached.stencilFormat   = settings.stencilFormat;
+        cached.samples         = settings.samples;
+        cached.insideRendering = settings.insideRendering;
+        invalidateCachedCommands(cached);
+        return ReturnCode::OK;
+    }
+
+    void destroyCachedCommands(CachedCommands& cached, RendererState& state) {
+        KAMSKI_PROFILE();
+        if(cached.pool != VK_NULL_HANDLE) {
+            deferDestroy(state, { .commandPool = cached.pool, .type = DeferredDestroy::COMMAND_POOL });
+        }
+        cached.pool = VK_NULL_HANDLE;
+        for(std::vector<CommandInput>& inputs : cached.recordedInputs) {
+            inputs.clear();
+        }
+    }
+
+    void invalidateCachedCommands(CachedCommands& cached) {
+        for(bool& isRecorded : cached.isRecorded) {
+            isRecorded = false;
+        }
+    }
+
+    ReturnCode cmdExecuteCachedCommands(VkCommandBuffer                             cmd,
+                                        CachedCommands&                             cached,
+                                        RendererState&                              state,
+                                        std::uint32_t                               frameIndex,
+                                        std::span<const CommandInput>               inputs,
+                                        const std::function<void(VkCommandBuffer)>& record) {
+        KAMSKI_PROFILE();
+        assert(frameIndex < state.framesInFlight);
+        const VkCommandBuffer      secondary      = cached.buffers[frameIndex];
+        std::vector<CommandInput>& recordedInputs = cached.recordedInputs[frameIndex];
+        const bool                 isCurrent      = cached.isRecorded[frameIndex] &&
+                                                    std::equal(inputs.begin(), inputs.end(), recordedInputs.begin(), recordedInputs.end());
+        if(!isCurrent) {
+            KAMSKI_PROFILE_NAMED("Record cached commands");
+            const VkCommandBufferInheritanceRenderingInfo renderingInfo = {
+                .sType                   = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO,
+                .colorAttachmentCount    = std::uint32_t(cached.colorFormats.size()),
+                .pColorAttachmentFormats = cached.colorFormats.data(),
+                .depthAttachmentFormat   = cached.depthFormat,
+                .stencilAttachmentFormat = cached.stencilFormat,
+                .rasterizationSamples    = cached.samples,
+            };
+            const VkCommandBufferInheritanceInfo inheritanceInfo = {
+                .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+                .pNext = cached.insideRendering ? &renderingInfo : nullptr,
+            };
+            const VkCommandBufferBeginInfo beginInfo = {
+                .sType            = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                .flags            = cached.insideRendering ? VkCommandBufferUsageFlags(VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT) : 0,
+                .pInheritanceInfo = &inheritanceInfo,
+            };
+            // A failed recording leaves the slot invalid, so the next use tries again
+            cached.isRecorded[frameIndex] = false;
+            if(vkBeginCommandBuffer(secondary, &beginInfo) != VK_SUCCESS) {
+                logError("Could not begin cached command buffer");
+                return ReturnCode::UNKNOWN;
+            }
+            record(secondary);
+            if(vkEndCommandBuffer(secondary) != VK_SUCCESS) {
+                logError("Could not end cached command buffer");
+                return ReturnCode::UNKNOWN;
+            }
+            recordedInputs.assign(inputs.begin(), inputs.end());
+            cached.isRecorded[frameIndex] = true;
+        }
+
+        vkCmdExecuteCommands(cmd, 1, &secondary);
+        return ReturnCode::OK;
+    }
+
     ReturnCode createMesh(kvk::Mesh&               mesh,
                           RendererState&           state,
                           std::span<std::uint32_t> indices,
@@ -2197,10 +3449,8 @@ namespace kvk {
         defer {
             unlockCommandPool(state, poolInfo);
         };
-        vkResult = kvk::immediateSubmit(poolInfo.queue->commandBuffers[poolInfo.poolIndex],
-                                        state.device,
-                                        poolInfo.queue->handle,
-                                        poolInfo.queue->submitMutex,
+        vkResult = kvk::immediateSubmit(state,
+                                        poolInfo,
                                         transferFunc);
 
         if(vkResult != VK_SUCCESS) {
@@ -2293,6 +3543,10 @@ namespace kvk {
         return *this;
     }
 
+    DescriptorSetBuilder& DescriptorSetBuilder::image(VkImageView view, const VkSamplerCreateInfo& samplerInfo, VkImageLayout layout) {
+        return image(view, samplerFromCache(cache, samplerInfo), layout);
+    }
+
     DescriptorSetBuilder& DescriptorSetBuilder::image(VkImageView view, VkDescriptorType type, VkImageLayout layout) {
         descriptors[count].image     = view;
         descriptors[count].imageType = type;
@@ -2344,6 +3598,10 @@ namespace kvk {
         return *this;
     }
 
+    DescriptorSetBuilder& DescriptorSetBuilder::sampler(const VkSamplerCreateInfo& samplerInfo) {
+        return sampler(samplerFromCache(cache, samplerInfo));
+    }
+
     VkDescriptorSetLayout descriptorSetLayoutFromCache(Cache&               cache,
                                                        const DescriptorSet& set,
                                                        const VkDevice       device,
@@ -2412,6 +3670,71 @@ namespace kvk {
         return layout;
     }
 
+    VkSampler samplerFromCache(Cache&                     cache,
+                               const VkSamplerCreateInfo& info,
+                               std::string_view           name) {
+        SamplerKey key = { .info = info };
+        key.info.pNext = nullptr;
+        for(const VkBaseInStructure* next = (const VkBaseInStructure*)info.pNext; next; next = next->pNext) {
+            if(next->sType != VK_STRUCTURE_TYPE_SAMPLER_REDUCTION_MODE_CREATE_INFO) {
+                logError("Cached samplers only support VkSamplerReductionModeCreateInfo in pNext, got sType %u", next->sType);
+                return VK_NULL_HANDLE;
+            }
+            key.reductionMode = ((const VkSamplerReductionModeCreateInfo*)next)->reductionMode;
+        }
+
+        std::lock_guard lck(cache.samplerMutex);
+        VkSampler&      sampler = cache.samplers[key];
+        if(sampler != VK_NULL_HANDLE) {
+            return sampler;
+        }
+
+        const RendererState& state = *cache.state;
+        if(cache.samplers.size() > state.limits.maxSamplerAllocationCount) {
+            logError("Sampler cache is full, maxSamplerAllocationCount is %u", state.limits.maxSamplerAllocationCount);
+            cache.samplers.erase(key);
+            return VK_NULL_HANDLE;
+        }
+
+        const VkSamplerReductionModeCreateInfo reductionInfo = {
+            .sType         = VK_STRUCTURE_TYPE_SAMPLER_REDUCTION_MODE_CREATE_INFO,
+            .reductionMode = key.reductionMode,
+        };
+        VkSamplerCreateInfo createInfo = key.info;
+        if(key.reductionMode != VK_SAMPLER_REDUCTION_MODE_WEIGHTED_AVERAGE) {
+            createInfo.pNext = &reductionInfo;
+        }
+        if(vkCreateSampler(state.device, &createInfo, nullptr, &sampler) != VK_SUCCESS) {
+            logError("Failed to create sampler");
+            cache.samplers.erase(key);
+            return VK_NULL_HANDLE;
+        }
+
+#ifdef KAMSKI_DEBUG
+        if(!name.empty()) {
+            string samplerName(name.begin(), name.end());
+
+            VkDebugUtilsObjectNameInfoEXT nameInfo = {
+                .sType        = VK_STRUCTURE_TYPE_DEBUG_UTILS_OBJECT_NAME_INFO_EXT,
+                .objectType   = VK_OBJECT_TYPE_SAMPLER,
+                .objectHandle = (u64)sampler,
+                .pObjectName  = samplerName.data()
+            };
+            VkResult res = vkSetDebugUtilsObjectName(state.device, &nameInfo);
+            kassert(res == VK_SUCCESS);
+        }
+#endif
+        return sampler;
+    }
+
+    void destroyCachedSamplers(Cache& cache) {
+        std::lock_guard lck(cache.samplerMutex);
+        for(auto& [key, sampler] : cache.samplers) {
+            vkDestroySampler(cache.state->device, sampler, nullptr);
+        }
+        cache.samplers.clear();
+    }
+
     void DescriptorSetBuilder::buildInternal(std::string_view name, DescriptorSet& set) {
         const VkDevice       device    = cache.state->device;
         DescriptorAllocator& allocator = cache.state->descriptors;
@@ -2679,11 +4002,14 @@ namespace kvk {
             .queueFamilyIndex = queueFamilyIndex,
         };
         const std::uint32_t coreCount = std::thread::hardware_concurrency();
-        queue.freePoolCount           = coreCount;
-        queue.isSlotOccupied.resize(coreCount, false);
+        queue.slotBits                = std::vector<std::atomic<std::uint64_t>>((coreCount + 63) / 64);
+        for(std::uint32_t word = 0; word != queue.slotBits.size(); word++) {
+            const std::uint32_t usedBits = std::min(64u, coreCount - word * 64);
+            queue.slotBits[word]         = usedBits == 64 ? 0 : ~0ull << usedBits;
+        }
+        queue.poolWaiters = 0;
         queue.pools.resize(coreCount);
         queue.commandBuffers.resize(coreCount);
-        queue.fences.resize(coreCount);
 
         for(VkCommandPool& pool : queue.pools) {
             if(vkCreateCommandPool(state.device,
@@ -2711,20 +4037,28 @@ namespace kvk {
             }
         }
 
-        VkFenceCreateInfo fenceCreateInfo = {
-            .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+        const VkSemaphoreTypeCreateInfo timelineCreateInfo = {
+            .sType         = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+            .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+            .initialValue  = 0,
         };
-        for(VkFence& fence : queue.fences) {
-            if(vkCreateFence(state.device, &fenceCreateInfo, nullptr, &fence) != VK_SUCCESS) {
-                return ReturnCode::UNKNOWN;
-            }
+        const VkSemaphoreCreateInfo semaphoreCreateInfo = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+            .pNext = &timelineCreateInfo,
+        };
+        if(vkCreateSemaphore(state.device, &semaphoreCreateInfo, nullptr, &queue.timeline) != VK_SUCCESS) {
+            logError("Could not create queue timeline");
+            return ReturnCode::UNKNOWN;
         }
+        queue.timelineValue  = 0;
+        queue.flushedValue   = 0;
+        queue.completedValue = 0;
+        queue.lost           = false;
 
         return ReturnCode::OK;
     }
 
-    PoolInfo lockCommandPool(RendererState& state, VkQueueFlags desiredQueueFlags) {
-        KAMSKI_PROFILE();
+    static Queue& poolQueue(RendererState& state, VkQueueFlags desiredQueueFlags) {
         //std::uint32_t familyIndex = 0;
         //std::uint32_t bestScore = std::numeric_limits<std::uint32_t>::max();
         //const std::uint32_t maxScore = std::popcount(desiredQueueFlags);
@@ -2741,40 +4075,434 @@ namespace kvk {
         //    }
         //}
         //assert(bestScore != std::numeric_limits<std::uint32_t>::max());
-        std::uint32_t familyIndex;
         if(desiredQueueFlags == VK_QUEUE_TRANSFER_BIT) {
-            familyIndex = 1;
-        } else {
-            familyIndex = 0;
+            return state.queues[1];
+        }
+        return state.queues[0];
+    }
+
+    //
+    // Scans from the word this thread last took a slot from, so threads that lock and unlock in a
+    // loop keep hitting their own word instead of all contending on the first one
+    //
+    static bool claimPoolSlot(Queue& queue, std::uint32_t& slotIndex) {
+        thread_local std::uint32_t hint      = 0;
+        const std::uint32_t        wordCount = std::uint32_t(queue.slotBits.size());
+        for(std::uint32_t i = 0; i != wordCount; i++) {
+            const std::uint32_t         word = (hint + i) % wordCount;
+            std::atomic<std::uint64_t>& bits = queue.slotBits[word];
+            std::uint64_t               seen = bits.load(std::memory_order_relaxed);
+            while(seen != ~0ull) {
+                const std::uint64_t bit = 1ull << std::countr_one(seen);
+                if(bits.compare_exchange_weak(seen, seen | bit, std::memory_order_acquire, std::memory_order_relaxed)) {
+                    hint      = word;
+                    slotIndex = word * 64 + std::countr_zero(bit);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool tryLockCommandPool(RendererState& state, PoolInfo& poolInfo, VkQueueFlags desiredQueueFlags) {
+        Queue&        queue = poolQueue(state, desiredQueueFlags);
+        std::uint32_t slotIndex;
+        if(!claimPoolSlot(queue, slotIndex)) {
+            return false;
+        }
+        poolInfo = { &queue, slotIndex };
+        return true;
+    }
+
+    PoolInfo lockCommandPool(RendererState& state, VkQueueFlags desiredQueueFlags) {
+        KAMSKI_PROFILE();
+        Queue&        queue = poolQueue(state, desiredQueueFlags);
+        std::uint32_t slotIndex;
+        if(claimPoolSlot(queue, slotIndex)) {
+            return { &queue, slotIndex };
         }
-        Queue&           queue = state.queues[familyIndex];
 
+        //
+        // Every pool is taken. The waiter count is raised under the mutex before the predicate
+        // retries, so an unlock either sees it and notifies or frees its bit before the retry. Both
+        // sides store then load a different variable, which only holds with seq_cst ordering between
+        // the two, the fence here pairs with the seq_cst fetch_and in unlockCommandPool
+        //
         std::unique_lock lck(queue.poolMutex);
-        if(queue.freePoolCount == 0) {
-            queue.poolCvar.wait(lck, [&]() {
-                return queue.freePoolCount != 0;
+        queue.poolWaiters.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        queue.poolCvar.wait(lck, [&]() {
+            return claimPoolSlot(queue, slotIndex);
+        });
+        queue.poolWaiters.fetch_sub(1);
+        return { &queue, slotIndex };
+    }
+
+    void unlockCommandPool(RendererState& state, PoolInfo& poolInfo) {
+        KAMSKI_PROFILE();
+        Queue&              queue = *poolInfo.queue;
+        const std::uint64_t bit   = 1ull << (poolInfo.poolIndex % 64);
+        assert(queue.slotBits.size() > poolInfo.poolIndex / 64);
+        const std::uint64_t previous = queue.slotBits[poolInfo.poolIndex / 64].fetch_and(~bit, std::memory_order_seq_cst);
+        assert(previous & bit);
+        (void)previous;
+        if(queue.poolWaiters.load() != 0) {
+            std::lock_guard lck(queue.poolMutex);
+            queue.poolCvar.notify_one();
+        }
+    }
+
+    void deferDestroy(RendererState& state, const DeferredDestroy& record, std::uint64_t timelineValue) {
+        DeletionRing&   ring = state.deletions;
+        std::lock_guard lck(ring.mutex);
+        if(ring.count == ring.records.size()) {
+            //
+            // Full: unroll into a twice as large vector, the only place the ring allocates
+            //
+            std::vector<DeferredDestroy> records(std::max<std::uint64_t>(64, ring.records.size() * 2));
+            for(std::uint32_t i = 0; i != ring.count; i++) {
+                records[i] = ring.records[(ring.head + i) % ring.records.size()];
+            }
+            ring.records = std::move(records);
+            ring.head    = 0;
+        }
+        DeferredDestroy& slot = ring.records[(ring.head + ring.count) % ring.records.size()];
+        slot                  = record;
+        slot.timelineValue    = timelineValue;
+        ring.count++;
+        if(timelineValue == PENDING_FRAME_VALUE) {
+            ring.pendingCount++;
+        }
+    }
+
+    void deferDestroy(RendererState& state, const AllocatedBuffer& buffer, std::uint64_t timelineValue) {
+        deferDestroy(state,
+                     {
+                         .buffer = { buffer.buffer, buffer.allocation },
+                         .type   = DeferredDestroy::BUFFER,
+                     },
+                     timelineValue);
+    }
+
+    void deferDestroy(RendererState& state, const AllocatedImage& image, std::uint64_t timelineValue) {
+        deferDestroy(state,
+                     {
+                         .image      = { image.image, image.view, image.allocation },
+                         .type       = DeferredDestroy::IMAGE,
+                         .imageViews = image.views,
+                     },
+                     timelineValue);
+    }
+
+    static void destroyRecord(RendererState& state, DeferredDestroy& record) {
+        switch(record.type) {
+        case DeferredDestroy::BUFFER: {
+            vmaDestroyBuffer(state.allocator, record.buffer.handle, record.buffer.allocation);
+        } break;
+
+        case DeferredDestroy::IMAGE: {
+            AllocatedImage image = {
+                .image      = record.image.handle,
+                .view       = record.image.view,
+                .allocation = record.image.allocation,
+                .views      = std::move(record.imageViews),
+            };
+            destroyImage(image, state.device, state.allocator);
+        } break;
+
+        case DeferredDestroy::IMAGE_VIEW: {
+            vkDestroyImageView(state.device, record.view, nullptr);
+        } break;
+
+        case DeferredDestroy::PIPELINE: {
+            vkDestroyPipeline(state.device, record.pipeline, nullptr);
+        } break;
+
+        case DeferredDestroy::SAMPLER: {
+            vkDestroySampler(state.device, record.sampler, nullptr);
+        } break;
+
+        case DeferredDestroy::SEMAPHORE: {
+            vkDestroySemaphore(state.device, record.semaphore, nullptr);
+        } break;
+
+        case DeferredDestroy::SWAPCHAIN: {
+            vkDestroySwapchainKHR(state.device, record.swapchain, nullptr);
+        } break;
+
+        case DeferredDestroy::POOL_SLOT: {
+            unlockCommandPool(state, record.poolInfo);
+        } break;
+
+        case DeferredDestroy::COMMAND_POOL: {
+            vkDestroyCommandPool(state.device, record.commandPool, nullptr);
+        } break;
+
+        default: {
+        } break;
+        }
+        record.type = DeferredDestroy::NONE;
+    }
+
+    void retireDestroys(RendererState& state, std::uint64_t completedValue) {
+        KAMSKI_PROFILE();
+        DeletionRing&   ring     = state.deletions;
+        std::lock_guard lck(ring.mutex);
+        const u32       capacity = u32(ring.records.size());
+
+        //
+        // Records of the frame being recorded sit in front of uploads deferred with their own value
+        // while it records, they are skipped. Everything else carries non-decreasing values so the
+        // walk still stops at the first record that is not complete
+        //
+        std::uint32_t index = 0;
+        for(; index != ring.count; index++) {
+            DeferredDestroy& record = ring.records[(ring.head + index) % capacity];
+            if(record.timelineValue > completedValue) {
+                if(record.timelineValue != PENDING_FRAME_VALUE) {
+                    break;
+                }
+                continue;
+            }
+            if(record.timelineValue == PENDING_FRAME_VALUE) {
+                ring.pendingCount--;
+            }
+            destroyRecord(state, record);
+        }
+
+        // Skipped records move up against the first one still waiting, the freed slots end up at the head
+        std::uint32_t write = index;
+        for(std::uint32_t i = index; i-- != 0;) {
+            DeferredDestroy& record = ring.records[(ring.head + i) % capacity];
+            if(record.timelineValue <= completedValue) {
+                continue;
+            }
+            write--;
+            if(write != i) {
+                ring.records[(ring.head + write) % capacity] = std::move(record);
+                record.type                                  = DeferredDestroy::NONE;
+            }
+        }
+        ring.head   = (ring.head + write) % capacity;
+        ring.count -= write;
+    }
+
+    std::uint64_t enqueueSubmit(Queue&                                 queue,
+                                std::span<const VkCommandBuffer>       commandBuffers,
+                                std::span<const VkSemaphoreSubmitInfo> waits,
+                                std::span<const VkSemaphoreSubmitInfo> signals) {
+        KAMSKI_PROFILE();
+        std::lock_guard     lck(queue.submitMutex);
+        const std::uint64_t value = ++queue.timelineValue;
+
+        queue.pendingSubmits.push_back({
+            .firstBuffer = std::uint32_t(queue.pendingBuffers.size()),
+            .bufferCount = std::uint32_t(commandBuffers.size()),
+            .firstWait   = std::uint32_t(queue.pendingSemaphores.size()),
+            .waitCount   = std::uint32_t(waits.size()),
+            .firstSignal = std::uint32_t(queue.pendingSemaphores.size() + waits.size()),
+            .signalCount = std::uint32_t(signals.size() + 1),
+        });
+        for(VkCommandBuffer cmd : commandBuffers) {
+            queue.pendingBuffers.push_back({
+                .sType         = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+                .commandBuffer = cmd,
+            });
+        }
+        queue.pendingSemaphores.insert(queue.pendingSemaphores.end(), waits.begin(), waits.end());
+        queue.pendingSemaphores.push_back({
+            .sType     = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+            .semaphore = queue.timeline,
+            .value     = value,
+            .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+        });
+        queue.pendingSemaphores.insert(queue.pendingSemaphores.end(), signals.begin(), signals.end());
+        return value;
+    }
+
+    static VkResult flushSubmitsLocked(RendererState& state, Queue& queue) {
+        if(queue.pendingSubmits.empty()) {
+            return VK_SUCCESS;
+        }
+
+        // Pointers are only taken now, the arrays may have grown while batches were collected
+        queue.submitInfos.clear();
+        for(const Queue::PendingSubmit& batch : queue.pendingSubmits) {
+            queue.submitInfos.push_back({
+                .sType                    = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+                .waitSemaphoreInfoCount   = batch.waitCount,
+                .pWaitSemaphoreInfos      = queue.pendingSemaphores.data() + batch.firstWait,
+                .commandBufferInfoCount   = batch.bufferCount,
+                .pCommandBufferInfos      = queue.pendingBuffers.data() + batch.firstBuffer,
+                .signalSemaphoreInfoCount = batch.signalCount,
+                .pSignalSemaphoreInfos    = queue.pendingSemaphores.data() + batch.firstSignal,
             });
         }
-        for(std::uint32_t slotIndex = 0; slotIndex != queue.isSlotOccupied.size(); slotIndex++) {
-            if(!queue.isSlotOccupied[slotIndex]) {
-                queue.isSlotOccupied[slotIndex] = true;
-                queue.freePoolCount--;
-                //logInfo("Qfam: %u, index: %u", queue.familyIndex, slotIndex);
-                return { &queue, slotIndex };
+        VkResult res = vkQueueSubmit2(queue.handle, std::uint32_t(queue.submitInfos.size()), queue.submitInfos.data(), VK_NULL_HANDLE);
+        queue.pendingSubmits.clear();
+        queue.pendingBuffers.clear();
+        queue.pendingSemaphores.clear();
+        if(res != VK_SUCCESS) {
+            //
+            // The batches are lost, signal their values from the host so nobody waits on them forever.
+            // Earlier flushes may still be running and signal values below these, so that only happens
+            // once the queue is idle. If it can't get there the device is treated as lost and the
+            // values stay unsignalled, waitTimeline reports the loss instead of blocking on them
+            //
+            logError("Queue submit failed: %d", res);
+            if(res == VK_ERROR_DEVICE_LOST) {
+                queue.lost = true;
+            } else {
+                const VkResult idleRes = vkQueueWaitIdle(queue.handle);
+                if(idleRes == VK_SUCCESS) {
+                    const VkSemaphoreSignalInfo signalInfo = {
+                        .sType     = VK_STRUCTURE_TYPE_SEMAPHORE_SIGNAL_INFO,
+                        .semaphore = queue.timeline,
+                        .value     = queue.timelineValue,
+                    };
+                    vkSignalSemaphore(state.device, &signalInfo);
+                } else {
+                    logError("Queue did not go idle after a failed submit: %d", idleRes);
+                    queue.lost = true;
+                    res        = VK_ERROR_DEVICE_LOST;
+                }
             }
         }
-        assert(false);
-        return {};
+        queue.flushedValue = queue.timelineValue;
+        return res;
     }
 
-    void unlockCommandPool(RendererState& state, PoolInfo& poolInfo) {
+    VkResult flushSubmits(RendererState& state, Queue& queue) {
+        KAMSKI_PROFILE();
+        std::lock_guard lck(queue.submitMutex);
+        return flushSubmitsLocked(state, queue);
+    }
+
+    VkResult flushAllSubmits(RendererState& state) {
         KAMSKI_PROFILE();
-        std::lock_guard lck(poolInfo.queue->poolMutex);
-        assert(poolInfo.queue->isSlotOccupied.size() > poolInfo.poolIndex);
-        assert(poolInfo.queue->isSlotOccupied[poolInfo.poolIndex]);
-        assert(poolInfo.queue->freePoolCount != std::thread::hardware_concurrency());
-        poolInfo.queue->isSlotOccupied[poolInfo.poolIndex] = false;
-        poolInfo.queue->freePoolCount++;
-        poolInfo.queue->poolCvar.notify_one();
+        VkResult result = VK_SUCCESS;
+        for(std::uint32_t i = 0; i != state.queueCount; i++) {
+            if(VkResult res = flushSubmits(state, state.queues[i])) {
+                result = res;
+            }
+        }
+        return result;
+    }
+
+    VkResult beginOneTimeSubmit(VkCommandBuffer cmd) {
+        const VkCommandBufferBeginInfo beginInfo = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+            .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+        };
+        VkResult res = vkBeginCommandBuffer(cmd, &beginInfo);
+        if(res != VK_SUCCESS) {
+            logError("Could not start command buffer recording");
+        }
+        return res;
+    }
+
+    VkResult endImmediateSubmit(RendererState& state, const PoolInfo& poolInfo) {
+        KAMSKI_PROFILE();
+        const VkCommandBuffer cmd = poolInfo.queue->commandBuffers[poolInfo.poolIndex];
+        VkResult              res = vkEndCommandBuffer(cmd);
+        if(res != VK_SUCCESS) {
+            logError("Could not end command buffer");
+            return res;
+        }
+
+        const std::uint64_t value = enqueueSubmit(*poolInfo.queue, { &cmd, 1 });
+        return waitTimeline(state, *poolInfo.queue, value);
+    }
+
+    ReturnCode endAsyncSubmit(RendererState& state, SubmitTicket& ticket) {
+        KAMSKI_PROFILE();
+        const VkCommandBuffer cmd = ticket.poolInfo.queue->commandBuffers[ticket.poolInfo.poolIndex];
+        VkResult              res = vkEndCommandBuffer(cmd);
+        if(res != VK_SUCCESS) {
+            logError("Async submit failed: %d", res);
+            unlockCommandPool(state, ticket.poolInfo);
+            ticket = {};
+            return ReturnCode::UNKNOWN;
+        }
+        ticket.timelineValue = enqueueSubmit(*ticket.poolInfo.queue, { &cmd, 1 });
+        return ReturnCode::OK;
+    }
+
+    bool isSubmitComplete(RendererState& state, SubmitTicket& ticket) {
+        if(ticket.timelineValue == 0) {
+            return true;
+        }
+        if(!isTimelineReached(state, *ticket.poolInfo.queue, ticket.timelineValue)) {
+            return false;
+        }
+        unlockCommandPool(state, ticket.poolInfo);
+        ticket = {};
+        return true;
+    }
+
+    ReturnCode waitForSubmit(RendererState& state, SubmitTicket& ticket) {
+        KAMSKI_PROFILE();
+        if(ticket.timelineValue == 0) {
+            return ReturnCode::OK;
+        }
+        VkResult res = waitTimeline(state, *ticket.poolInfo.queue, ticket.timelineValue);
+        unlockCommandPool(state, ticket.poolInfo);
+        ticket = {};
+
+        if(res != VK_SUCCESS) {
+            logError("Waiting for submit failed: %d", res);
+            return ReturnCode::UNKNOWN;
+        }
+        return ReturnCode::OK;
+    }
+
+    std::uint64_t completedTimelineValue(RendererState& state, Queue& queue) {
+        std::uint64_t value = 0;
+        if(vkGetSemaphoreCounterValue(state.device, queue.timeline, &value) != VK_SUCCESS) {
+            return queue.completedValue;
+        }
+        std::uint64_t completed = queue.completedValue;
+        while(completed < value && !queue.completedValue.compare_exchange_weak(completed, value)) {
+        }
+        return value;
+    }
+
+    bool isTimelineReached(RendererState& state, Queue& queue, std::uint64_t value) {
+        if(queue.completedValue >= value) {
+            return true;
+        }
+        if(queue.flushedValue < value) {
+            flushSubmits(state, queue);
+        }
+        return completedTimelineValue(state, queue) >= value;
+    }
+
+    VkResult waitTimeline(RendererState& state,
+                          Queue&         queue,
+                          std::uint64_t  value,
+                          std::uint64_t  timeout) {
+        KAMSKI_PROFILE();
+        if(queue.completedValue >= value) {
+            return VK_SUCCESS;
+        }
+        if(queue.flushedValue < value) {
+            flushSubmits(state, queue);
+        }
+        if(queue.lost) {
+            return VK_ERROR_DEVICE_LOST;
+        }
+        const VkSemaphoreWaitInfo waitInfo = {
+            .sType          = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+            .semaphoreCount = 1,
+            .pSemaphores    = &queue.timeline,
+            .pValues        = &value,
+        };
+        const VkResult res = vkWaitSemaphores(state.device, &waitInfo, timeout);
+        if(res == VK_SUCCESS) {
+            std::uint64_t completed = queue.completedValue;
+            while(completed < value && !queue.completedValue.compare_exchange_weak(completed, value)) {
+            }
+        }
+        return res;
     }
 }
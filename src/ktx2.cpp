@@ -0,0 +1,383 @@
+#include "vulkan/vulkan_core.h"
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+
+#include "common.h"
+#include "krender.h"
+#include "utils.h"
+
+#if defined(KVK_BASISU)
+#include <basisu_transcoder.h>
+#endif
+
+namespace kvk {
+
+    static constexpr std::uint8_t KTX2_IDENTIFIER[12] = {
+        0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n'
+    };
+
+    enum Ktx2Supercompression : std::uint32_t {
+        KTX2_SUPERCOMPRESSION_NONE    = 0,
+        KTX2_SUPERCOMPRESSION_BASISLZ = 1,
+        KTX2_SUPERCOMPRESSION_ZSTD    = 2,
+        KTX2_SUPERCOMPRESSION_ZLIB    = 3,
+    };
+
+    struct Ktx2Header {
+        std::uint8_t  identifier[12];
+        std::uint32_t vkFormat;
+        std::uint32_t typeSize;
+        std::uint32_t pixelWidth;
+        std::uint32_t pixelHeight;
+        std::uint32_t pixelDepth;
+        std::uint32_t layerCount;
+        std::uint32_t faceCount;
+        std::uint32_t levelCount;
+        std::uint32_t supercompressionScheme;
+
+        std::uint32_t dfdByteOffset;
+        std::uint32_t dfdByteLength;
+        std::uint32_t kvdByteOffset;
+        std::uint32_t kvdByteLength;
+        std::uint64_t sgdByteOffset;
+        std::uint64_t sgdByteLength;
+    };
+    static_assert(sizeof(Ktx2Header) == 80);
+
+    struct Ktx2LevelIndex {
+        std::uint64_t byteOffset;
+        std::uint64_t byteLength;
+        std::uint64_t uncompressedByteLength;
+    };
+
+    // KHR_DF_TRANSFER_SRGB, read out of the basic descriptor block of the DFD
+    static constexpr std::uint8_t KTX2_DFD_TRANSFER_SRGB = 2;
+
+    static bool isFormatSampleable(VkPhysicalDevice physicalDevice, VkFormat format) {
+        VkFormatProperties formatProps;
+        vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &formatProps);
+        const VkFormatFeatureFlags required = VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT | VK_FORMAT_FEATURE_TRANSFER_DST_BIT;
+        return (formatProps.optimalTilingFeatures & required) == required;
+    }
+
+    static bool canGenerateMips(VkPhysicalDevice physicalDevice, VkFormat format) {
+        VkFormatProperties formatProps;
+        vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &formatProps);
+        const VkFormatFeatureFlags required = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT;
+        return (formatProps.optimalTilingFeatures & required) == required;
+    }
+
+#if defined(KVK_BASISU)
+    struct BasisTarget {
+        basist::transcoder_texture_format transcoderFormat;
+        VkFormat                          unorm;
+        VkFormat                          srgb;
+    };
+
+    // Ordered best first: quality per bit, then hardware coverage
+    static constexpr BasisTarget BASIS_TARGETS[] = {
+        { basist::transcoder_texture_format::cTFBC7_RGBA,       VK_FORMAT_BC7_UNORM_BLOCK,       VK_FORMAT_BC7_SRGB_BLOCK },
+        { basist::transcoder_texture_format::cTFASTC_4x4_RGBA,  VK_FORMAT_ASTC_4x4_UNORM_BLOCK,  VK_FORMAT_ASTC_4x4_SRGB_BLOCK },
+        { basist::transcoder_texture_format::cTFETC2_RGBA,      VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK, VK_FORMAT_ETC2_R8G8B8A8_SRGB_BLOCK },
+        { basist::transcoder_texture_format::cTFBC3_RGBA,       VK_FORMAT_BC3_UNORM_BLOCK,       VK_FORMAT_BC3_SRGB_BLOCK },
+        { basist::transcoder_texture_format::cTFRGBA32,         VK_FORMAT_R8G8B8A8_UNORM,        VK_FORMAT_R8G8B8A8_SRGB },
+    };
+
+    static ReturnCode transcodeBasis(AllocatedImage&         image,
+                                     RendererState&          state,
+                                     std::span<const u8>     fileContents,
+                                     const bool              isSrgb,
+                                     const VkImageUsageFlags usageFlags) {
+        KAMSKI_PROFILE();
+        static std::once_flag transcoderInitFlag;
+        std::call_once(transcoderInitFlag, []() {
+            basist::basisu_transcoder_init();
+        });
+
+        basist::ktx2_transcoder transcoder;
+        if(!transcoder.init(fileContents.data(), std::uint32_t(fileContents.size()))) {
+            logError("Could not parse basis payload");
+            return ReturnCode::WRONG_PARAMETERS;
+        }
+        if(!transcoder.start_transcoding()) {
+            logError("Could not start basis transcoding");
+            return ReturnCode::UNKNOWN;
+        }
+
+        const BasisTarget* target = nullptr;
+        for(const BasisTarget& candidate : BASIS_TARGETS) {
+            if(isFormatSampleable(state.physicalDevice, isSrgb ? candidate.srgb : candidate.unorm)) {
+                target = &candidate;
+                break;
+            }
+        }
+        if(!target) {
+            logError("No basis transcode target is supported by the device");
+            return ReturnCode::FORMAT_NOT_SUPPORTED;
+        }
+
+        const VkFormat      format      = isSrgb ? target->srgb : target->unorm;
+        const bool          isBlock     = !basist::basis_transcoder_format_is_uncompressed(target->transcoderFormat);
+        const std::uint32_t unitSize    = basist::basis_get_bytes_per_block_or_pixel(target->transcoderFormat);
+        const std::uint32_t levelCount  = std::max(1u, transcoder.get_levels());
+        const std::uint32_t faceCount   = transcoder.get_faces();
+
+        struct Job {
+            std::uint32_t level;
+            std::uint32_t face;
+            std::uint32_t units;
+            std::uint64_t offset;
+        };
+        std::vector<Job>               jobs;
+        std::vector<VkBufferImageCopy> regions;
+        jobs.reserve(levelCount * faceCount);
+        regions.reserve(levelCount);
+
+        std::uint64_t stagingSize = 0;
+        for(std::uint32_t level = 0; level != levelCount; level++) {
+            stagingSize = alignStagingOffset(stagingSize, format);
+            regions.push_back(VkBufferImageCopy{
+                .bufferOffset     = stagingSize,
+                .imageSubresource = {
+                    .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+                    .mipLevel       = level,
+                    .baseArrayLayer = 0,
+                    .layerCount     = faceCount,
+                },
+                .imageExtent = {
+                    .width  = std::max(1u, transcoder.get_width() >> level),
+                    .height = std::max(1u, transcoder.get_height() >> level),
+                    .depth  = 1,
+                },
+            });
+
+            for(std::uint32_t face = 0; face != faceCount; face++) {
+                basist::ktx2_image_level_info levelInfo;
+                if(!transcoder.get_image_level_info(levelInfo, level, 0, face)) {
+                    logError("Could not query basis level %u face %u", level, face);
+                    return ReturnCode::UNKNOWN;
+                }
+                const std::uint32_t units = isBlock ? levelInfo.m_total_blocks : levelInfo.m_orig_width * levelInfo.m_orig_height;
+                jobs.push_back(Job{ level, face, units, stagingSize });
+                stagingSize += std::uint64_t(units) * unitSize;
+            }
+        }
+
+        AllocatedBuffer stagingBuffer = {};
+        ReturnCode      rc            = createBuffer(stagingBuffer,
+                                                     state.device,
+                                                     state.allocator,
+                                                     stagingSize,
+                                                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                                     VMA_MEMORY_USAGE_CPU_ONLY);
+        if(rc != ReturnCode::OK) {
+            logError("Could not create staging buffer");
+            return rc;
+        }
+        defer {
+            destroyBuffer(stagingBuffer, state.allocator);
+        };
+
+        //
+        // Every (level, face) pair transcodes straight into its slice of the staging buffer,
+        // workers pull jobs largest level first so the tail levels fill the gaps
+        //
+        std::uint8_t*              dst          = (std::uint8_t*)stagingBuffer.allocation->GetMappedData();
+        std::atomic<std::uint32_t> nextJob      = 0;
+        std::atomic<bool>          failed       = false;
+        auto                       transcodeJob = [&]() {
+            KAMSKI_PROFILE_NAMED("Basis transcode worker");
+            basist::ktx2_transcoder_state transcoderState;
+            for(std::uint32_t jobIndex = nextJob++; jobIndex < jobs.size(); jobIndex = nextJob++) {
+                const Job& job = jobs[jobIndex];
+                if(!transcoder.transcode_image_level(job.level,
+                                                     0,
+                                                     job.face,
+                                                     dst + job.offset,
+                                                     job.units,
+                                                     target->transcoderFormat,
+                                                     0,
+                                                     0,
+                                                     0,
+                                                     -1,
+                                                     -1,
+                                                     &transcoderState)) {
+                    failed = true;
+                }
+            }
+        };
+
+        const std::uint32_t workerCount = std::min(workerPool().concurrency(), std::uint32_t(jobs.size()));
+        workerPool().parallelFor(workerCount, [&](std::uint32_t) { transcodeJob(); });
+
+        if(failed) {
+            logError("Basis transcoding failed");
+            return ReturnCode::UNKNOWN;
+        }
+
+        return createImage(image,
+                           state,
+                           stagingBuffer,
+                           regions,
+                           format,
+                           VkExtent3D{ transcoder.get_width(), transcoder.get_height(), 1 },
+                           usageFlags,
+                           levelCount,
+                           faceCount == 6,
+                           false);
+    }
+#endif
+
+    ReturnCode loadKtx2(AllocatedImage&         image,
+                        RendererState&          state,
+                        std::span<const u8>     fileContents,
+                        const VkImageUsageFlags usageFlags) {
+        KAMSKI_PROFILE();
+        if(fileContents.size() < sizeof(Ktx2Header)) {
+            logError("KTX2 file too small");
+            return ReturnCode::WRONG_PARAMETERS;
+        }
+
+        Ktx2Header header;
+        memcpy(&header, fileContents.data(), sizeof(header));
+        if(memcmp(header.identifier, KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER)) != 0) {
+            logError("Not a KTX2 file");
+            return ReturnCode::WRONG_PARAMETERS;
+        }
+
+        const std::uint32_t levelCount = std::max(1u, header.levelCount);
+        if(sizeof(Ktx2Header) + levelCount * sizeof(Ktx2LevelIndex) > fileContents.size()) {
+            logError("KTX2 level index out of bounds");
+            return ReturnCode::WRONG_PARAMETERS;
+        }
+        if(header.pixelDepth > 1 || header.layerCount > 1 || (header.faceCount != 1 && header.faceCount != 6)) {
+            logError("Only 2D textures and cubemaps are supported (depth %u, layers %u, faces %u)",
+                     header.pixelDepth,
+                     header.layerCount,
+                     header.faceCount);
+            return ReturnCode::WRONG_PARAMETERS;
+        }
+
+        bool isSrgb = false;
+        if(header.dfdByteLength >= 16 && std::uint64_t(header.dfdByteOffset) + 16 <= fileContents.size()) {
+            isSrgb = fileContents[header.dfdByteOffset + 14] == KTX2_DFD_TRANSFER_SRGB;
+        }
+
+        const bool isBasis = header.vkFormat == VK_FORMAT_UNDEFINED;
+        if(isBasis) {
+#if defined(KVK_BASISU)
+            return transcodeBasis(image, state, fileContents, isSrgb, usageFlags);
+#else
+            logError("KTX2 file holds a Basis Universal payload, build with KVK_BASISU to transcode it");
+            return ReturnCode::FORMAT_NOT_SUPPORTED;
+#endif
+        }
+
+        if(header.supercompressionScheme != KTX2_SUPERCOMPRESSION_NONE) {
+            logError("Unsupported KTX2 supercompression scheme %u for vkFormat %u",
+                     header.supercompressionScheme,
+                     header.vkFormat);
+            return ReturnCode::FORMAT_NOT_SUPPORTED;
+        }
+
+        const VkFormat format = VkFormat(header.vkFormat);
+        if(!isFormatSampleable(state.physicalDevice, format)) {
+            logError("Format %u is not sampleable on this device", header.vkFormat);
+            return ReturnCode::FORMAT_NOT_SUPPORTED;
+        }
+
+        // levelCount == 0 asks the loader to build the chain from level 0
+        std::uint32_t mipLevels    = levelCount;
+        bool          generateMips = false;
+        if(header.levelCount == 0) {
+            if(canGenerateMips(state.physicalDevice, format)) {
+                mipLevels    = getMipLevels(header.pixelWidth, header.pixelHeight);
+                generateMips = mipLevels > 1;
+            } else {
+                logWarning("Format %u can not be blitted, uploading without mips", header.vkFormat);
+            }
+        }
+
+        const Ktx2LevelIndex* levels      = (const Ktx2LevelIndex*)(fileContents.data() + sizeof(Ktx2Header));
+        std::uint64_t         stagingSize = 0;
+        std::vector<VkBufferImageCopy> regions(levelCount);
+        for(std::uint32_t level = 0; level != levelCount; level++) {
+            if(levels[level].byteOffset + levels[level].byteLength > fileContents.size()) {
+                logError("KTX2 level %u out of bounds", level);
+                return ReturnCode::WRONG_PARAMETERS;
+            }
+            stagingSize    = alignStagingOffset(stagingSize, format);
+            regions[level] = VkBufferImageCopy{
+                .bufferOffset     = stagingSize,
+                .imageSubresource = {
+                    .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+                    .mipLevel       = level,
+                    .baseArrayLayer = 0,
+                    .layerCount     = header.faceCount,
+                },
+                .imageExtent = {
+                    .width  = std::max(1u, header.pixelWidth >> level),
+                    .height = std::max(1u, header.pixelHeight >> level),
+                    .depth  = 1,
+                },
+            };
+            stagingSize += levels[level].byteLength;
+        }
+
+        AllocatedBuffer stagingBuffer = {};
+        ReturnCode      rc            = createBuffer(stagingBuffer,
+                                                     state.device,
+                                                     state.allocator,
+                                                     stagingSize,
+                                                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                                     VMA_MEMORY_USAGE_CPU_ONLY);
+        if(rc != ReturnCode::OK) {
+            logError("Could not create staging buffer");
+            return rc;
+        }
+        defer {
+            destroyBuffer(stagingBuffer, state.allocator);
+        };
+
+        std::uint8_t* dst = (std::uint8_t*)stagingBuffer.allocation->GetMappedData();
+        for(std::uint32_t level = 0; level != levelCount; level++) {
+            memcpy(dst + regions[level].bufferOffset,
+                   fileContents.data() + levels[level].byteOffset,
+                   levels[level].byteLength);
+        }
+
+        return createImage(image,
+                           state,
+                           stagingBuffer,
+                           regions,
+                           format,
+                           VkExtent3D{ header.pixelWidth, header.pixelHeight, 1 },
+                           usageFlags,
+                           mipLevels,
+                           header.faceCount == 6,
+                           generateMips);
+    }
+
+    ReturnCode loadKtx2(AllocatedImage&         image,
+                        RendererState&          state,
+                        const char*             path,
+                        const VkImageUsageFlags usageFlags) {
+        KAMSKI_PROFILE();
+        std::ifstream file(path, std::ios::ate | std::ios::binary);
+        if(!file.is_open()) {
+            logError("File %s not found", path);
+            return ReturnCode::FILE_NOT_FOUND;
+        }
+
+        const std::uint64_t  size = file.tellg();
+        std::vector<u8>      contents(size);
+        file.seekg(0);
+        file.read((char*)contents.data(), size);
+
+        return loadKtx2(image, state, std::span<const u8>(contents), usageFlags);
+    }
+}
@@ -0,0 +1,558 @@
+#include "vulkan/vulkan_core.h"
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+
+#include "common.h"
+#include "krender.h"
+#include "utils.h"
+
+//
+// Kernels are picked at compile time from the target flags, KVK_AVX2 builds the AVX2 + F16C ones
+//
+#if defined(__AVX2__)
+#define KVK_PIXELS_AVX2
+#endif
+#if defined(__AVX2__) || defined(__AVX__) || defined(__SSSE3__)
+#define KVK_PIXELS_SSSE3
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KVK_PIXELS_SSE2
+#endif
+#if defined(__F16C__) || (defined(_MSC_VER) && defined(__AVX2__))
+#define KVK_PIXELS_F16C
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#define KVK_PIXELS_NEON
+#endif
+
+#if defined(KVK_PIXELS_SSE2)
+#include <immintrin.h>
+#endif
+#if defined(KVK_PIXELS_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace kvk {
+
+    static constexpr std::uint64_t PIXEL_CHUNK_TEXELS      = 256;
+    static constexpr std::uint64_t PIXEL_TEXELS_PER_WORKER = 1 << 16;
+
+    struct TransferTables {
+        u8    srgbToLinear[256];
+        u8    linearToSrgb[256];
+        float srgbToLinearFloat[256];
+
+        TransferTables() {
+            for(std::uint32_t i = 0; i != 256; i++) {
+                const float value    = float(i) / 255.0f;
+                srgbToLinearFloat[i] = toLinear(value);
+                srgbToLinear[i]      = u8(srgbToLinearFloat[i] * 255.0f + 0.5f);
+                linearToSrgb[i]      = u8(toSrgb(value) * 255.0f + 0.5f);
+            }
+        }
+
+        static float toLinear(float value) {
+            return value <= 0.04045f ? value / 12.92f : std::pow((value + 0.055f) / 1.055f, 2.4f);
+        }
+
+        static float toSrgb(float value) {
+            value = std::max(value, 0.0f);
+            return value <= 0.0031308f ? value * 12.92f : 1.055f * std::pow(value, 1.0f / 2.4f) - 0.055f;
+        }
+    };
+
+    static const TransferTables& transferTables() {
+        static const TransferTables tables;
+        return tables;
+    }
+
+    static std::uint64_t sourceTexelSize(PixelSource source) {
+        switch(source) {
+        case PixelSource::RGB8:
+        case PixelSource::BGR8: {
+            return 3;
+        } break;
+
+        case PixelSource::RGBA8:
+        case PixelSource::BGRA8: {
+            return 4;
+        } break;
+
+        case PixelSource::RGBA32F: {
+            return 16;
+        } break;
+        }
+        return 0;
+    }
+
+    static std::uint16_t floatToHalf(float value) {
+        std::uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        const std::uint32_t sign     = (bits >> 16) & 0x8000;
+        const std::uint32_t exponent = (bits >> 23) & 0xFF;
+        std::uint32_t       mantissa = bits & 0x7FFFFF;
+        if(exponent == 0xFF) {
+            return std::uint16_t(sign | 0x7C00 | (mantissa ? 0x200 : 0));
+        }
+
+        const std::int32_t halfExponent = std::int32_t(exponent) - 127 + 15;
+        if(halfExponent >= 0x1F) {
+            return std::uint16_t(sign | 0x7C00);
+        }
+        if(halfExponent <= 0) {
+            if(halfExponent < -10) {
+                return std::uint16_t(sign);
+            }
+            mantissa                    |= 0x800000;
+            const std::uint32_t shift     = std::uint32_t(14 - halfExponent);
+            const std::uint32_t remainder = mantissa & ((1u << shift) - 1);
+            const std::uint32_t halfway   = 1u << (shift - 1);
+            std::uint32_t       half      = mantissa >> shift;
+            if(remainder > halfway || (remainder == halfway && (half & 1))) {
+                half++;
+            }
+            return std::uint16_t(sign | half);
+        }
+
+        // Rounding may carry into the exponent, which is the correctly rounded result
+        std::uint32_t       half      = (std::uint32_t(halfExponent) << 10) | (mantissa >> 13);
+        const std::uint32_t remainder = mantissa & 0x1FFF;
+        if(remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) {
+            half++;
+        }
+        return std::uint16_t(sign | half);
+    }
+
+    //
+    // 8 bit sources to tightly packed RGBA8. The scalar versions finish what the vector loops leave
+    // over and are the reference the debug self check compares those loops against
+    //
+    static void expandToRgba8Scalar(u8* dst, const u8* src, std::uint64_t count, PixelSource source) {
+        switch(source) {
+        case PixelSource::RGB8:
+        case PixelSource::BGR8: {
+            const std::uint32_t red  = source == PixelSource::BGR8 ? 2 : 0;
+            const std::uint32_t blue = source == PixelSource::BGR8 ? 0 : 2;
+            for(std::uint64_t i = 0; i != count; i++) {
+                dst[i * 4 + 0] = src[i * 3 + red];
+                dst[i * 4 + 1] = src[i * 3 + 1];
+                dst[i * 4 + 2] = src[i * 3 + blue];
+                dst[i * 4 + 3] = 255;
+            }
+        } break;
+
+        case PixelSource::RGBA8: {
+            memcpy(dst, src, count * 4);
+        } break;
+
+        case PixelSource::BGRA8: {
+            for(std::uint64_t i = 0; i != count; i++) {
+                dst[i * 4 + 0] = src[i * 4 + 2];
+                dst[i * 4 + 1] = src[i * 4 + 1];
+                dst[i * 4 + 2] = src[i * 4 + 0];
+                dst[i * 4 + 3] = src[i * 4 + 3];
+            }
+        } break;
+
+        case PixelSource::RGBA32F: {
+            assert(false);
+        } break;
+        }
+    }
+
+    static void expandToRgba8(u8* dst, const u8* src, std::uint64_t count, PixelSource source) {
+        std::uint64_t i = 0;
+        switch(source) {
+        case PixelSource::RGB8:
+        case PixelSource::BGR8: {
+            const bool swap = source == PixelSource::BGR8;
+#if defined(KVK_PIXELS_AVX2)
+            const __m256i mask  = swap ? _mm256_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+                                                          2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1)
+                                       : _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                                          0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+            const __m256i alpha = _mm256_set1_epi32(std::int32_t(0xFF000000));
+            // Each half loads 16 bytes for 4 texels, the last load ends 4 bytes past the 8th texel
+            for(; i + 10 <= count; i += 8) {
+                const __m128i lo     = _mm_loadu_si128((const __m128i*)(src + i * 3));
+                const __m128i hi     = _mm_loadu_si128((const __m128i*)(src + i * 3 + 12));
+                __m256i       texels = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+                texels               = _mm256_or_si256(_mm256_shuffle_epi8(texels, mask), alpha);
+                _mm256_storeu_si256((__m256i*)(dst + i * 4), texels);
+            }
+#elif defined(KVK_PIXELS_SSSE3)
+            const __m128i mask  = swap ? _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1)
+                                       : _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+            const __m128i alpha = _mm_set1_epi32(std::int32_t(0xFF000000));
+            for(; i + 6 <= count; i += 4) {
+                const __m128i texels = _mm_loadu_si128((const __m128i*)(src + i * 3));
+                _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_or_si128(_mm_shuffle_epi8(texels, mask), alpha));
+            }
+#elif defined(KVK_PIXELS_NEON)
+            for(; i + 16 <= count; i += 16) {
+                const uint8x16x3_t rgb = vld3q_u8(src + i * 3);
+                uint8x16x4_t       rgba;
+                rgba.val[0] = swap ? rgb.val[2] : rgb.val[0];
+                rgba.val[1] = rgb.val[1];
+                rgba.val[2] = swap ? rgb.val[0] : rgb.val[2];
+                rgba.val[3] = vdupq_n_u8(255);
+                vst4q_u8(dst + i * 4, rgba);
+            }
+#endif
+            (void)swap;
+            expandToRgba8Scalar(dst + i * 4, src + i * 3, count - i, source);
+        } break;
+
+        case PixelSource::RGBA8: {
+            memcpy(dst, src, count * 4);
+        } break;
+
+        case PixelSource::BGRA8: {
+#if defined(KVK_PIXELS_AVX2)
+            const __m256i mask = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                                  2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+            for(; i + 8 <= count; i += 8) {
+                const __m256i texels = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+                _mm256_storeu_si256((__m256i*)(dst + i * 4), _mm256_shuffle_epi8(texels, mask));
+            }
+#elif defined(KVK_PIXELS_SSSE3)
+            const __m128i mask = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+            for(; i + 4 <= count; i += 4) {
+                const __m128i texels = _mm_loadu_si128((const __m128i*)(src + i * 4));
+                _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_shuffle_epi8(texels, mask));
+            }
+#elif defined(KVK_PIXELS_NEON)
+            for(; i + 16 <= count; i += 16) {
+                uint8x16x4_t    texels = vld4q_u8(src + i * 4);
+                const uint8x16_t blue  = texels.val[0];
+                texels.val[0]          = texels.val[2];
+                texels.val[2]          = blue;
+                vst4q_u8(dst + i * 4, texels);
+            }
+#endif
+            expandToRgba8Scalar(dst + i * 4, src + i * 4, count - i, source);
+        } break;
+
+        case PixelSource::RGBA32F: {
+            assert(false);
+        } break;
+        }
+    }
+
+    static void applyTable(u8* texels, std::uint64_t count, const u8* table) {
+        for(std::uint64_t i = 0; i != count; i++) {
+            texels[i * 4 + 0] = table[texels[i * 4 + 0]];
+            texels[i * 4 + 1] = table[texels[i * 4 + 1]];
+            texels[i * 4 + 2] = table[texels[i * 4 + 2]];
+        }
+    }
+
+    //
+    // c * a / 255 rounded, computed as (x + 128 + ((x + 128) >> 8)) >> 8 which is exact for 8 bits
+    //
+    static void premultiplyRgba8Scalar(u8* texels, std::uint64_t count) {
+        for(std::uint64_t i = 0; i != count; i++) {
+            const std::uint32_t alpha = texels[i * 4 + 3];
+            for(std::uint32_t c = 0; c != 3; c++) {
+                const std::uint32_t product = texels[i * 4 + c] * alpha + 128;
+                texels[i * 4 + c]           = u8((product + (product >> 8)) >> 8);
+            }
+        }
+    }
+
+    static void premultiplyRgba8(u8* texels, std::uint64_t count) {
+        std::uint64_t i = 0;
+#if defined(KVK_PIXELS_SSE2)
+        const __m128i zero      = _mm_setzero_si128();
+        const __m128i bias      = _mm_set1_epi16(128);
+        const __m128i alphaMask = _mm_set1_epi32(std::int32_t(0xFF000000));
+        auto          multiply  = [&](__m128i channels) {
+            const __m128i alpha   = _mm_shufflehi_epi16(_mm_shufflelo_epi16(channels, 0xFF), 0xFF);
+            const __m128i product = _mm_add_epi16(_mm_mullo_epi16(channels, alpha), bias);
+            return _mm_srli_epi16(_mm_add_epi16(product, _mm_srli_epi16(product, 8)), 8);
+        };
+        for(; i + 4 <= count; i += 4) {
+            const __m128i rgba   = _mm_loadu_si128((const __m128i*)(texels + i * 4));
+            const __m128i lo     = multiply(_mm_unpacklo_epi8(rgba, zero));
+            const __m128i hi     = multiply(_mm_unpackhi_epi8(rgba, zero));
+            const __m128i result = _mm_packus_epi16(lo, hi);
+            _mm_storeu_si128((__m128i*)(texels + i * 4),
+                             _mm_or_si128(_mm_andnot_si128(alphaMask, result), _mm_and_si128(alphaMask, rgba)));
+        }
+#elif defined(KVK_PIXELS_NEON)
+        for(; i + 16 <= count; i += 16) {
+            uint8x16x4_t rgba = vld4q_u8(texels + i * 4);
+            for(std::uint32_t c = 0; c != 3; c++) {
+                const uint16x8_t lo = vmull_u8(vget_low_u8(rgba.val[c]), vget_low_u8(rgba.val[3]));
+                const uint16x8_t hi = vmull_u8(vget_high_u8(rgba.val[c]), vget_high_u8(rgba.val[3]));
+                rgba.val[c]         = vcombine_u8(vrshrn_n_u16(vrsraq_n_u16(lo, lo, 8), 8),
+                                                  vrshrn_n_u16(vrsraq_n_u16(hi, hi, 8), 8));
+            }
+            vst4q_u8(texels + i * 4, rgba);
+        }
+#endif
+        premultiplyRgba8Scalar(texels + i * 4, count - i);
+    }
+
+    static void packHalfScalar(std::uint16_t* dst, const float* src, std::uint64_t count) {
+        for(std::uint64_t i = 0; i != count; i++) {
+            dst[i] = floatToHalf(src[i]);
+        }
+    }
+
+    static void packHalf(std::uint16_t* dst, const float* src, std::uint64_t count) {
+        std::uint64_t i = 0;
+#if defined(KVK_PIXELS_F16C) && defined(KVK_PIXELS_AVX2)
+        for(; i + 8 <= count; i += 8) {
+            _mm_storeu_si128((__m128i*)(dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+        }
+#elif defined(KVK_PIXELS_F16C)
+        for(; i + 4 <= count; i += 4) {
+            _mm_storel_epi64((__m128i*)(dst + i), _mm_cvtps_ph(_mm_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+        }
+#elif defined(KVK_PIXELS_NEON)
+        for(; i + 4 <= count; i += 4) {
+            vst1_u16(dst + i, vreinterpret_u16_f16(vcvt_f16_f32(vld1q_f32(src + i))));
+        }
+#endif
+        packHalfScalar(dst + i, src + i, count - i);
+    }
+
+#if !defined(NDEBUG)
+    //
+    // Runs every vector kernel the build picked against its scalar version once, over one chunk of
+    // pseudo random texels whose odd count leaves a tail behind every vector loop
+    //
+    static void checkKernels() {
+        constexpr std::uint64_t count = PIXEL_CHUNK_TEXELS - 3;
+        u8                      source[PIXEL_CHUNK_TEXELS * 4];
+        float                   floats[PIXEL_CHUNK_TEXELS * 4];
+        std::uint32_t           seed = 0x9E3779B9;
+        for(std::uint64_t i = 0; i != PIXEL_CHUNK_TEXELS * 4; i++) {
+            seed      = seed * 1664525 + 1013904223;
+            source[i] = u8(seed >> 24);
+            // Covers negatives, half denormals, normals and values past the half range
+            floats[i] = std::ldexp(float(seed >> 8) / float(1 << 24) - 0.25f, int(seed % 48) - 30);
+        }
+
+        u8 vector[PIXEL_CHUNK_TEXELS * 4];
+        u8 scalar[PIXEL_CHUNK_TEXELS * 4];
+        for(PixelSource pixelSource : { PixelSource::RGB8, PixelSource::BGR8, PixelSource::RGBA8, PixelSource::BGRA8 }) {
+            expandToRgba8(vector, source, count, pixelSource);
+            expandToRgba8Scalar(scalar, source, count, pixelSource);
+            assert(memcmp(vector, scalar, count * 4) == 0 && "expandToRgba8 differs from its scalar version");
+        }
+
+        memcpy(vector, source, count * 4);
+        memcpy(scalar, source, count * 4);
+        premultiplyRgba8(vector, count);
+        premultiplyRgba8Scalar(scalar, count);
+        assert(memcmp(vector, scalar, count * 4) == 0 && "premultiplyRgba8 differs from its scalar version");
+
+        std::uint16_t vectorHalves[PIXEL_CHUNK_TEXELS * 4];
+        std::uint16_t scalarHalves[PIXEL_CHUNK_TEXELS * 4];
+        packHalf(vectorHalves, floats, count * 4);
+        packHalfScalar(scalarHalves, floats, count * 4);
+        assert(memcmp(vectorHalves, scalarHalves, count * 4 * sizeof(std::uint16_t)) == 0 && "packHalf differs from its scalar version");
+    }
+#endif
+
+    //
+    // Chunks are converted in stack memory and copied out in one go, dst is usually mapped staging
+    // memory that is slow to read back and best written sequentially. Anything producing half
+    // floats or reading floats goes through a float chunk, 8 bit to 8 bit conversions through a byte one
+    //
+    static void convertFloatChunk(void*                  dst,
+                                  const void*            src,
+                                  std::uint64_t          count,
+                                  const PixelConversion& conversion) {
+        const TransferTables& tables = transferTables();
+        float                 rgba[PIXEL_CHUNK_TEXELS * 4];
+        if(conversion.source == PixelSource::RGBA32F) {
+            memcpy(rgba, src, count * 16);
+            if(conversion.transfer == PixelTransfer::SRGB_TO_LINEAR) {
+                for(std::uint64_t i = 0; i != count; i++) {
+                    for(std::uint32_t c = 0; c != 3; c++) {
+                        rgba[i * 4 + c] = TransferTables::toLinear(rgba[i * 4 + c]);
+                    }
+                }
+            }
+        } else {
+            u8 texels[PIXEL_CHUNK_TEXELS * 4];
+            expandToRgba8(texels, (const u8*)src, count, conversion.source);
+            const float* table = conversion.transfer == PixelTransfer::SRGB_TO_LINEAR ? tables.srgbToLinearFloat : nullptr;
+            for(std::uint64_t i = 0; i != count; i++) {
+                for(std::uint32_t c = 0; c != 3; c++) {
+                    rgba[i * 4 + c] = table ? table[texels[i * 4 + c]] : float(texels[i * 4 + c]) * (1.0f / 255.0f);
+                }
+                rgba[i * 4 + 3] = float(texels[i * 4 + 3]) * (1.0f / 255.0f);
+            }
+        }
+
+        if(conversion.premultiply) {
+            for(std::uint64_t i = 0; i != count; i++) {
+                rgba[i * 4 + 0] *= rgba[i * 4 + 3];
+                rgba[i * 4 + 1] *= rgba[i * 4 + 3];
+                rgba[i * 4 + 2] *= rgba[i * 4 + 3];
+            }
+        }
+        if(conversion.transfer == PixelTransfer::LINEAR_TO_SRGB) {
+            for(std::uint64_t i = 0; i != count; i++) {
+                for(std::uint32_t c = 0; c != 3; c++) {
+                    rgba[i * 4 + c] = TransferTables::toSrgb(rgba[i * 4 + c]);
+                }
+            }
+        }
+
+        if(conversion.halfFloat) {
+            std::uint16_t halves[PIXEL_CHUNK_TEXELS * 4];
+            packHalf(halves, rgba, count * 4);
+            memcpy(dst, halves, count * 8);
+        } else {
+            u8 out[PIXEL_CHUNK_TEXELS * 4];
+            for(std::uint64_t i = 0; i != count * 4; i++) {
+                out[i] = u8(std::clamp(rgba[i], 0.0f, 1.0f) * 255.0f + 0.5f);
+            }
+            memcpy(dst, out, count * 4);
+        }
+    }
+
+    static void convertByteChunk(void*                  dst,
+                                 const void*            src,
+                                 std::uint64_t          count,
+                                 const PixelConversion& conversion) {
+        const TransferTables& tables = transferTables();
+        u8                    texels[PIXEL_CHUNK_TEXELS * 4];
+        expandToRgba8(texels, (const u8*)src, count, conversion.source);
+        if(conversion.transfer == PixelTransfer::SRGB_TO_LINEAR) {
+            applyTable(texels, count, tables.srgbToLinear);
+        }
+        if(conversion.premultiply) {
+            premultiplyRgba8(texels, count);
+        }
+        if(conversion.transfer == PixelTransfer::LINEAR_TO_SRGB) {
+            applyTable(texels, count, tables.linearToSrgb);
+        }
+        memcpy(dst, texels, count * 4);
+    }
+
+    static void convertRange(void*                  dst,
+                             const void*            src,
+                             std::uint64_t          count,
+                             const PixelConversion& conversion) {
+        KAMSKI_PROFILE();
+        if(conversion.source == PixelSource::RGBA8 &&
+           conversion.transfer == PixelTransfer::NONE &&
+           !conversion.premultiply &&
+           !conversion.halfFloat) {
+            memcpy(dst, src, count * 4);
+            return;
+        }
+
+        const bool          isFloat = conversion.halfFloat || conversion.source == PixelSource::RGBA32F;
+        const std::uint64_t srcSize = sourceTexelSize(conversion.source);
+        const std::uint64_t dstSize = conversion.halfFloat ? 8 : 4;
+        for(std::uint64_t i = 0; i < count; i += PIXEL_CHUNK_TEXELS) {
+            const std::uint64_t chunk = std::min(PIXEL_CHUNK_TEXELS, count - i);
+            if(isFloat) {
+                convertFloatChunk((u8*)dst + i * dstSize, (const u8*)src + i * srcSize, chunk, conversion);
+            } else {
+                convertByteChunk((u8*)dst + i * dstSize, (const u8*)src + i * srcSize, chunk, conversion);
+            }
+        }
+    }
+
+    std::uint64_t convertedSize(const PixelConversion& conversion, std::uint64_t texelCount) {
+        return texelCount * (conversion.halfFloat ? 8 : 4);
+    }
+
+    void convertPixels(void*                  dst,
+                       const void*            src,
+                       std::uint64_t          texelCount,
+                       const PixelConversion& conversion,
+                       std::uint32_t          workerCount) {
+        KAMSKI_PROFILE();
+#if !defined(NDEBUG)
+        static std::once_flag kernelsChecked;
+        std::call_once(kernelsChecked, checkKernels);
+#endif
+        if(workerCount == 0) {
+            const std::uint64_t wanted = (texelCount + PIXEL_TEXELS_PER_WORKER - 1) / PIXEL_TEXELS_PER_WORKER;
+            workerCount                = std::uint32_t(std::min<std::uint64_t>(workerPool().concurrency(), wanted));
+        }
+        workerCount = std::max(1u, workerCount);
+
+        // Ranges stay chunk aligned so no two workers share a float chunk
+        const std::uint64_t srcSize        = sourceTexelSize(conversion.source);
+        const std::uint64_t dstSize        = conversion.halfFloat ? 8 : 4;
+        const std::uint64_t chunkCount     = (texelCount + PIXEL_CHUNK_TEXELS - 1) / PIXEL_CHUNK_TEXELS;
+        const std::uint64_t texelsPerRange = (chunkCount + workerCount - 1) / workerCount * PIXEL_CHUNK_TEXELS;
+        auto                convertJob     = [&](std::uint32_t worker) {
+            KAMSKI_PROFILE_NAMED("Pixel conversion worker");
+            const std::uint64_t begin = std::min(texelCount, worker * texelsPerRange);
+            const std::uint64_t end   = std::min(texelCount, begin + texelsPerRange);
+            if(begin != end) {
+                convertRange((u8*)dst + begin * dstSize, (const u8*)src + begin * srcSize, end - begin, conversion);
+            }
+        };
+
+        workerPool().parallelFor(workerCount, convertJob);
+    }
+
+    ReturnCode createImage(AllocatedImage&         image,
+                           RendererState&          state,
+                           const void*             data,
+                           const PixelConversion&  conversion,
+                           const VkFormat          format,
+                           const VkExtent3D        extent,
+                           const VkImageUsageFlags usageFlags,
+                           std::uint32_t           mipLevels) {
+        KAMSKI_PROFILE();
+        const std::uint64_t texelCount    = std::uint64_t(extent.width) * extent.height * extent.depth;
+        AllocatedBuffer     stagingBuffer = {};
+        ReturnCode          rc            = createBuffer(stagingBuffer,
+                                                         state.device,
+                                                         state.allocator,
+                                                         convertedSize(conversion, texelCount),
+                                                         VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                                         VMA_MEMORY_USAGE_CPU_ONLY);
+        if(rc != ReturnCode::OK) {
+            logError("Could not create staging buffer");
+            return rc;
+        }
+        defer {
+            destroyBuffer(stagingBuffer, state.allocator);
+        };
+        convertPixels(stagingBuffer.allocation->GetMappedData(), data, texelCount, conversion);
+
+        const VkBufferImageCopy copyRegion = {
+            .bufferOffset      = 0,
+            .bufferRowLength   = 0,
+            .bufferImageHeight = 0,
+
+            .imageSubresource  = {
+                 .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+                 .mipLevel       = 0,
+                 .baseArrayLayer = 0,
+                 .layerCount     = 1,
+            },
+            .imageExtent = extent,
+        };
+
+        return createImage(image,
+                           state,
+                           stagingBuffer,
+                           std::span(&copyRegion, 1),
+                           format,
+                           extent,
+                           usageFlags,
+                           mipLevels,
+                           false,
+                           mipLevels > 1);
+    }
+
+}
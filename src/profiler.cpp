@@ -0,0 +1,276 @@
+#include "vulkan/vulkan_core.h"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#include "common.h"
+#include "krender.h"
+#include "utils.h"
+
+#if defined(PROFILER_ENABLED)
+#include <tracy/TracyC.h>
+#endif
+
+#if defined(_WIN32)
+#include <Windows.h>
+#endif
+
+namespace kvk {
+
+    using ProfilerClock = std::chrono::steady_clock;
+
+    static constexpr std::uint32_t QUERIES_PER_FRAME = GpuProfiler::MAX_ZONES * 2;
+
+    // Calibrated reads whose clocks are sampled further apart than this are retried
+    static constexpr std::uint64_t CALIBRATION_TOLERANCE_NS = 10'000;
+    static constexpr std::uint32_t CALIBRATION_ATTEMPTS     = 4;
+
+    // A HOST_TIME_DOMAIN value on the steady_clock timeline
+    static ProfilerClock::time_point hostTimeToClock(std::uint64_t hostTime) {
+#if defined(_WIN32)
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        const std::uint64_t ticksPerSecond = std::uint64_t(frequency.QuadPart);
+        const std::uint64_t nanoseconds    = hostTime / ticksPerSecond * 1'000'000'000ull + hostTime % ticksPerSecond * 1'000'000'000ull / ticksPerSecond;
+#else
+        const std::uint64_t nanoseconds = hostTime;
+#endif
+        return ProfilerClock::time_point(std::chrono::duration_cast<ProfilerClock::duration>(std::chrono::nanoseconds(nanoseconds)));
+    }
+
+    //
+    // Maps GPU ticks onto the CPU clock. The extension samples the device and host clock in one call,
+    // the read with the smallest maxDeviation out of a few is kept. Without it one timestamp is
+    // written and waited for, which places the reference late by the submit latency.
+    //
+    static ReturnCode calibrate(GpuProfiler& profiler, RendererState& state) {
+        KAMSKI_PROFILE();
+        if(state.vkGetCalibratedTimestamps) {
+            const VkCalibratedTimestampInfoKHR infos[2] = {
+                {
+                    .sType      = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_KHR,
+                    .timeDomain = VK_TIME_DOMAIN_DEVICE_KHR,
+                },
+                {
+                    .sType      = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_KHR,
+                    .timeDomain = HOST_TIME_DOMAIN,
+                },
+            };
+            std::uint64_t bestTimestamps[2] = {};
+            std::uint64_t bestDeviation     = UINT64_MAX;
+            for(std::uint32_t attempt = 0; attempt != CALIBRATION_ATTEMPTS && bestDeviation > CALIBRATION_TOLERANCE_NS; attempt++) {
+                std::uint64_t timestamps[2];
+                std::uint64_t maxDeviation;
+                VkResult      res = state.vkGetCalibratedTimestamps(state.device, 2, infos, timestamps, &maxDeviation);
+                if(res != VK_SUCCESS) {
+                    logError("Could not read calibrated timestamps: %d", res);
+                    return ReturnCode::UNKNOWN;
+                }
+                if(maxDeviation < bestDeviation) {
+                    bestTimestamps[0] = timestamps[0];
+                    bestTimestamps[1] = timestamps[1];
+                    bestDeviation     = maxDeviation;
+                }
+            }
+            profiler.gpuReference         = bestTimestamps[0] & profiler.timestampMask;
+            profiler.cpuReference         = hostTimeToClock(bestTimestamps[1]);
+            profiler.calibrationDeviation = bestDeviation;
+            return ReturnCode::OK;
+        }
+
+        const VkQueryPool pool     = profiler.frames[0].pool;
+        PoolInfo          poolInfo = lockCommandPool(state, VK_QUEUE_GRAPHICS_BIT);
+        VkResult          res      = immediateSubmit(state, poolInfo, [&](VkCommandBuffer cmd) {
+            vkCmdResetQueryPool(cmd, pool, 0, 1);
+            vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, pool, 0);
+        });
+        unlockCommandPool(state, poolInfo);
+        if(res != VK_SUCCESS) {
+            logError("Could not write calibration timestamp: %d", res);
+            return ReturnCode::UNKNOWN;
+        }
+        profiler.cpuReference = ProfilerClock::now();
+
+        std::uint64_t timestamp;
+        res = vkGetQueryPoolResults(state.device,
+                                    pool,
+                                    0,
+                                    1,
+                                    sizeof(timestamp),
+                                    &timestamp,
+                                    sizeof(timestamp),
+                                    VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+        if(res != VK_SUCCESS) {
+            logError("Could not read calibration timestamp: %d", res);
+            return ReturnCode::UNKNOWN;
+        }
+        profiler.gpuReference         = timestamp & profiler.timestampMask;
+        profiler.calibrationDeviation = UINT64_MAX;
+        return ReturnCode::OK;
+    }
+
+    ReturnCode initGpuProfiler(GpuProfiler& profiler, RendererState& state) {
+        KAMSKI_PROFILE();
+        std::uint32_t familyCount = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(state.physicalDevice, &familyCount, nullptr);
+        std::vector<VkQueueFamilyProperties> families(familyCount);
+        vkGetPhysicalDeviceQueueFamilyProperties(state.physicalDevice, &familyCount, families.data());
+
+        // Zones are recorded into frame command buffers, which come from the graphics pools
+        PoolInfo            poolInfo    = lockCommandPool(state, VK_QUEUE_GRAPHICS_BIT);
+        const std::uint32_t familyIndex = poolInfo.queue->familyIndex;
+        unlockCommandPool(state, poolInfo);
+
+        const std::uint32_t validBits = families[familyIndex].timestampValidBits;
+        if(validBits == 0) {
+            logError("Graphics queue does not support timestamps");
+            return ReturnCode::UNKNOWN;
+        }
+        profiler.timestampMask   = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+        profiler.timestampPeriod = state.limits.timestampPeriod;
+        profiler.currentFrame    = 0;
+        profiler.results.clear();
+        profiler.results.reserve(GpuProfiler::MAX_ZONES);
+
+        const VkQueryPoolCreateInfo poolCreateInfo = {
+            .sType      = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+            .queryType  = VK_QUERY_TYPE_TIMESTAMP,
+            .queryCount = QUERIES_PER_FRAME,
+        };
+        for(GpuProfiler::FrameQueries& frame : profiler.frames) {
+            frame.pool      = VK_NULL_HANDLE;
+            frame.zoneCount = 0;
+        }
+        for(std::uint32_t i = 0; i != state.framesInFlight; i++) {
+            if(vkCreateQueryPool(state.device, &poolCreateInfo, nullptr, &profiler.frames[i].pool) != VK_SUCCESS) {
+                logError("Could not create timestamp query pool");
+                destroyGpuProfiler(profiler, state);
+                return ReturnCode::UNKNOWN;
+            }
+        }
+
+        ReturnCode rc = calibrate(profiler, state);
+        if(rc != ReturnCode::OK) {
+            destroyGpuProfiler(profiler, state);
+            return rc;
+        }
+
+#if defined(PROFILER_ENABLED)
+        // Tracy numbers GPU contexts itself for its own Vulkan integration, which is not used here
+        static std::atomic<std::uint8_t> tracyContextCounter      = 0;
+        constexpr std::uint8_t           TRACY_GPU_CONTEXT_VULKAN = 2;
+        profiler.tracyContext                                     = tracyContextCounter.fetch_add(1);
+        ___tracy_emit_gpu_new_context({
+            .gpuTime = std::int64_t(profiler.gpuReference),
+            .period  = profiler.timestampPeriod,
+            .context = profiler.tracyContext,
+            .flags   = 0,
+            .type    = TRACY_GPU_CONTEXT_VULKAN,
+        });
+        const char* contextName = "kvk graphics";
+        ___tracy_emit_gpu_context_name({
+            .context = profiler.tracyContext,
+            .name    = contextName,
+            .len     = std::uint16_t(strlen(contextName)),
+        });
+#endif
+        return ReturnCode::OK;
+    }
+
+    void destroyGpuProfiler(GpuProfiler& profiler, RendererState& state) {
+        KAMSKI_PROFILE();
+        for(GpuProfiler::FrameQueries& frame : profiler.frames) {
+            if(frame.pool != VK_NULL_HANDLE) {
+                vkDestroyQueryPool(state.device, frame.pool, nullptr);
+                frame.pool = VK_NULL_HANDLE;
+            }
+        }
+        profiler.results.clear();
+    }
+
+    void cmdBeginGpuProfilerFrame(GpuProfiler& profiler, RendererState& state, VkCommandBuffer cmd, std::uint32_t frameIndex) {
+        KAMSKI_PROFILE();
+        GpuProfiler::FrameQueries& frame     = profiler.frames[frameIndex];
+        const std::uint32_t        zoneCount = std::min(frame.zoneCount.load(), GpuProfiler::MAX_ZONES);
+        if(zoneCount != 0) {
+            //
+            // The frame that wrote these retired before its slot came around, zones that were never
+            // ended read as unavailable and are skipped
+            //
+            struct QueryResult {
+                std::uint64_t timestamp;
+                std::uint64_t available;
+            };
+            QueryResult results[QUERIES_PER_FRAME];
+            VkResult    res = vkGetQueryPoolResults(state.device,
+                                                    frame.pool,
+                                                    0,
+                                                    zoneCount * 2,
+                                                    sizeof(QueryResult) * zoneCount * 2,
+                                                    results,
+                                                    sizeof(QueryResult),
+                                                    VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+            if(res == VK_SUCCESS || res == VK_NOT_READY) {
+                if(state.vkGetCalibratedTimestamps) {
+                    (void)calibrate(profiler, state);
+                }
+
+                profiler.results.clear();
+                for(std::uint32_t zone = 0; zone != zoneCount; zone++) {
+                    const QueryResult& begin = results[zone * 2];
+                    const QueryResult& end   = results[zone * 2 + 1];
+                    if(!begin.available || !end.available) {
+                        continue;
+                    }
+                    const std::uint64_t beginTicks = begin.timestamp & profiler.timestampMask;
+                    const std::uint64_t endTicks   = end.timestamp & profiler.timestampMask;
+                    const double        sinceRef   = double(std::int64_t(beginTicks - profiler.gpuReference)) * profiler.timestampPeriod;
+                    profiler.results.push_back({
+                        .name         = frame.names[zone],
+                        .start        = profiler.cpuReference + std::chrono::duration_cast<ProfilerClock::duration>(std::chrono::duration<double, std::nano>(sinceRef)),
+                        .milliseconds = float(double((endTicks - beginTicks) & profiler.timestampMask) * profiler.timestampPeriod / 1e6),
+                    });
+
+#if defined(PROFILER_ENABLED)
+                    const std::uint16_t queryId = std::uint16_t((frameIndex * GpuProfiler::MAX_ZONES + zone) * 2);
+                    const char*         name    = frame.names[zone];
+                    const std::uint64_t srcloc  = ___tracy_alloc_srcloc_name(0, __FILE__, strlen(__FILE__), name, strlen(name), name, strlen(name), 0);
+                    ___tracy_emit_gpu_zone_begin_alloc_serial({ .srcloc = srcloc, .queryId = queryId, .context = profiler.tracyContext });
+                    ___tracy_emit_gpu_time_serial({ .gpuTime = std::int64_t(beginTicks), .queryId = queryId, .context = profiler.tracyContext });
+                    ___tracy_emit_gpu_zone_end_serial({ .queryId = std::uint16_t(queryId + 1), .context = profiler.tracyContext });
+                    ___tracy_emit_gpu_time_serial({ .gpuTime = std::int64_t(endTicks), .queryId = std::uint16_t(queryId + 1), .context = profiler.tracyContext });
+#endif
+                }
+            } else {
+                logWarning("Could not read GPU timestamps: %d", res);
+            }
+        }
+
+        vkCmdResetQueryPool(cmd, frame.pool, 0, QUERIES_PER_FRAME);
+        frame.zoneCount       = 0;
+        profiler.currentFrame = frameIndex;
+    }
+
+    std::uint32_t cmdBeginGpuZone(GpuProfiler& profiler, VkCommandBuffer cmd, const char* name) {
+        GpuProfiler::FrameQueries& frame = profiler.frames[profiler.currentFrame];
+        const std::uint32_t        zone  = frame.zoneCount.fetch_add(1);
+        if(zone >= GpuProfiler::MAX_ZONES) {
+            return UINT32_MAX;
+        }
+        frame.names[zone] = name;
+        vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, frame.pool, zone * 2);
+        return zone;
+    }
+
+    void cmdEndGpuZone(GpuProfiler& profiler, VkCommandBuffer cmd, std::uint32_t zone) {
+        if(zone == UINT32_MAX) {
+            return;
+        }
+        GpuProfiler::FrameQueries& frame = profiler.frames[profiler.currentFrame];
+        vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, frame.pool, zone * 2 + 1);
+    }
+
+}
@@ -0,0 +1,618 @@
+#include "vulkan/vulkan_core.h"
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+#include "common.h"
+#include "krender.h"
+#include "utils.h"
+
+namespace kvk {
+
+    static bool isWriteUsage(ImageUsage usage) {
+        switch(usage) {
+        case ImageUsage::TRANSFER_DST:
+        case ImageUsage::STORAGE_WRITE_COMPUTE:
+        case ImageUsage::COLOR_ATTACHMENT:
+        case ImageUsage::DEPTH_ATTACHMENT: {
+            return true;
+        } break;
+
+        default: {
+            return false;
+        } break;
+        }
+    }
+
+    static VkImageUsageFlags imageUsageFlags(ImageUsage usage) {
+        switch(usage) {
+        case ImageUsage::TRANSFER_SRC: {
+            return VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+        } break;
+
+        case ImageUsage::TRANSFER_DST: {
+            return VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+        } break;
+
+        case ImageUsage::SAMPLED_GRAPHICS:
+        case ImageUsage::SAMPLED_COMPUTE: {
+            return VK_IMAGE_USAGE_SAMPLED_BIT;
+        } break;
+
+        case ImageUsage::STORAGE_READ_COMPUTE:
+        case ImageUsage::STORAGE_WRITE_COMPUTE: {
+            return VK_IMAGE_USAGE_STORAGE_BIT;
+        } break;
+
+        case ImageUsage::COLOR_ATTACHMENT: {
+            return VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+        } break;
+
+        case ImageUsage::DEPTH_ATTACHMENT: {
+            return VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+        } break;
+
+        case ImageUsage::DEPTH_READ: {
+            return VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+        } break;
+
+        default: {
+            return 0;
+        } break;
+        }
+    }
+
+    static bool hasStencil(VkFormat format) {
+        return format == VK_FORMAT_D16_UNORM_S8_UINT ||
+               format == VK_FORMAT_D24_UNORM_S8_UINT ||
+               format == VK_FORMAT_D32_SFLOAT_S8_UINT;
+    }
+
+    // Attachments always cover the first mip of every layer, execute renders them layered with a view
+    // and a layerCount over the same layers
+    static constexpr ImageRange ATTACHMENT_RANGE = { .baseMip = 0, .mipCount = 1 };
+
+    // Cleared and DONT_CARE attachments replace the contents of their own range, every other access
+    // depends on what is in its range, other ranges of the same resource included
+    static bool overwrites(const RenderGraph::Pass& pass, const RenderGraph::Access& access) {
+        if(access.usage == ImageUsage::COLOR_ATTACHMENT) {
+            for(const RenderGraph::Attachment& attachment : pass.colorAttachments) {
+                if(attachment.resource == access.resource) {
+                    return attachment.loadOp != VK_ATTACHMENT_LOAD_OP_LOAD;
+                }
+            }
+        }
+        if(access.usage == ImageUsage::DEPTH_ATTACHMENT && pass.hasDepth && pass.depthAttachment.resource == access.resource) {
+            return pass.depthAttachment.loadOp != VK_ATTACHMENT_LOAD_OP_LOAD;
+        }
+        return false;
+    }
+
+    //
+    // Liveness and contents are tracked per subresource. Every resource owns mipCount * layerCount
+    // consecutive entries, layer major like ImageState
+    //
+    struct SubresourceLayout {
+        std::vector<std::uint32_t> first;  // per resource, its first entry
+        std::vector<std::uint32_t> mipCounts;
+        std::vector<std::uint32_t> layerCounts;
+        std::uint32_t              total;
+    };
+
+    static void buildSubresourceLayout(SubresourceLayout& layout, const RenderGraph& graph) {
+        layout.total = 0;
+        for(const RenderGraph::Resource& resource : graph.resources) {
+            const std::uint32_t mipCount   = resource.imported ? resource.imported->mipCount : resource.desc.mipCount;
+            const std::uint32_t layerCount = resource.imported ? resource.imported->layerCount : resource.desc.layerCount;
+            layout.first.push_back(layout.total);
+            layout.mipCounts.push_back(mipCount);
+            layout.layerCounts.push_back(layerCount);
+            layout.total += mipCount * layerCount;
+        }
+    }
+
+    // Calls function with the entry of every subresource in range of resource
+    template<typename Function>
+    static void forEachSubresource(const SubresourceLayout& layout, RenderResource resource, const ImageRange& range, Function&& function) {
+        const std::uint32_t mipCount   = layout.mipCounts[resource];
+        const std::uint32_t layerCount = layout.layerCounts[resource];
+        const std::uint32_t mipEnd     = range.mipCount == VK_REMAINING_MIP_LEVELS ? mipCount : std::min(mipCount, range.baseMip + range.mipCount);
+        const std::uint32_t layerEnd   = range.layerCount == VK_REMAINING_ARRAY_LAYERS ? layerCount : std::min(layerCount, range.baseLayer + range.layerCount);
+        for(std::uint32_t layer = range.baseLayer; layer < layerEnd; layer++) {
+            for(std::uint32_t mip = range.baseMip; mip < mipEnd; mip++) {
+                function(layout.first[resource] + layer * mipCount + mip);
+            }
+        }
+    }
+
+    static bool anySubresource(const SubresourceLayout& layout, const std::vector<bool>& flags, RenderResource resource, const ImageRange& range) {
+        bool retval = false;
+        forEachSubresource(layout, resource, range, [&](std::uint32_t entry) {
+            retval = retval || flags[entry];
+        });
+        return retval;
+    }
+
+    //
+    // Everything compile results depend on: transient descriptors, accesses, declared load ops and
+    // side effects. Whatever execute reads from the pass directly is left out
+    //
+    static void buildSignature(std::vector<std::uint32_t>& signature, const RenderGraph& graph) {
+        signature.clear();
+        for(const RenderGraph::Resource& resource : graph.resources) {
+            if(resource.imported) {
+                signature.push_back(INVALID_ID);
+                signature.push_back(resource.imported->mipCount);
+                signature.push_back(resource.imported->layerCount);
+                continue;
+            }
+            signature.push_back(std::uint32_t(resource.desc.format));
+            signature.push_back(resource.desc.extent.width);
+            signature.push_back(resource.desc.extent.height);
+            signature.push_back(resource.desc.mipCount);
+            signature.push_back(resource.desc.layerCount);
+        }
+        for(const RenderGraph::Pass& pass : graph.passes) {
+            signature.push_back(std::uint32_t(pass.accesses.size()));
+            signature.push_back(std::uint32_t(pass.colorAttachments.size()));
+            signature.push_back(std::uint32_t(pass.hasDepth) | std::uint32_t(pass.hasSideEffects) << 1);
+            for(const RenderGraph::Access& access : pass.accesses) {
+                signature.push_back(access.resource);
+                signature.push_back(std::uint32_t(access.usage));
+                signature.push_back(access.range.baseMip);
+                signature.push_back(access.range.mipCount);
+                signature.push_back(access.range.baseLayer);
+                signature.push_back(access.range.layerCount);
+            }
+            for(const RenderGraph::Attachment& attachment : pass.colorAttachments) {
+                signature.push_back(attachment.resource);
+                signature.push_back(std::uint32_t(attachment.loadOp));
+            }
+            if(pass.hasDepth) {
+                signature.push_back(pass.depthAttachment.resource);
+                signature.push_back(std::uint32_t(pass.depthAttachment.loadOp));
+            }
+        }
+    }
+
+    static std::size_t hashSignature(std::span<const std::uint32_t> signature) {
+        std::size_t retval = std::hash<std::uint64_t>()(signature.size());
+        for(std::uint32_t word : signature) {
+            retval = (retval << 1) ^ std::hash<std::uint32_t>()(word);
+        }
+        return retval;
+    }
+
+    void RenderGraph::reset() {
+        resources.clear();
+        passes.clear();
+    }
+
+    void RenderGraph::destroy(RendererState& state) {
+        KAMSKI_PROFILE();
+        for(TransientImage& transient : transients) {
+            deferDestroy(state, transient.image);
+        }
+        transients.clear();
+        plan.isValid = false;
+        reset();
+    }
+
+    RenderResource RenderGraph::importImage(const char* name, AllocatedImage& image, ImageUsage finalUsage) {
+        resources.push_back({
+            .name       = name,
+            .imported   = &image,
+            .desc       = {},
+            .usage      = 0,
+            .transient  = INVALID_ID,
+            .finalUsage = finalUsage,
+        });
+        return RenderResource(resources.size() - 1);
+    }
+
+    RenderResource RenderGraph::createImage(const char* name, const RenderGraphImageDesc& desc) {
+        resources.push_back({
+            .name       = name,
+            .imported   = nullptr,
+            .desc       = desc,
+            .usage      = 0,
+            .transient  = INVALID_ID,
+            .finalUsage = ImageUsage::UNDEFINED,
+        });
+        return RenderResource(resources.size() - 1);
+    }
+
+    std::uint32_t RenderGraph::addPass(const char* name, ExecuteFunction&& execute) {
+        Pass& pass          = passes.emplace_back();
+        pass.name           = name;
+        pass.execute        = std::move(execute);
+        pass.hasDepth       = false;
+        pass.hasSideEffects = false;
+        pass.isLive         = false;
+        pass.renderExtent   = { 0, 0 };
+        return std::uint32_t(passes.size() - 1);
+    }
+
+    RenderGraph& RenderGraph::read(std::uint32_t pass, RenderResource resource, ImageUsage usage, ImageRange range) {
+        assert(!isWriteUsage(usage));
+        passes[pass].accesses.push_back({ .resource = resource, .usage = usage, .range = range, .discard = false });
+        return *this;
+    }
+
+    RenderGraph& RenderGraph::write(std::uint32_t pass, RenderResource resource, ImageUsage usage, ImageRange range) {
+        assert(isWriteUsage(usage));
+        passes[pass].accesses.push_back({ .resource = resource, .usage = usage, .range = range, .discard = false });
+        return *this;
+    }
+
+    RenderGraph& RenderGraph::colorAttachment(std::uint32_t      pass,
+                                              RenderResource     resource,
+                                              VkAttachmentLoadOp loadOp,
+                                              glm::vec4          clearColor) {
+        passes[pass].colorAttachments.push_back({
+            .resource   = resource,
+            .loadOp     = loadOp,
+            .storeOp    = VK_ATTACHMENT_STORE_OP_STORE,
+            .clearColor = clearColor,
+            .depthClear = 0.0f,
+        });
+        return write(pass, resource, ImageUsage::COLOR_ATTACHMENT, ATTACHMENT_RANGE);
+    }
+
+    RenderGraph& RenderGraph::depthAttachment(std::uint32_t      pass,
+                                              RenderResource     resource,
+                                              VkAttachmentLoadOp loadOp,
+                                              float              depthClear) {
+        passes[pass].hasDepth        = true;
+        passes[pass].depthAttachment = {
+            .resource   = resource,
+            .loadOp     = loadOp,
+            .storeOp    = VK_ATTACHMENT_STORE_OP_STORE,
+            .clearColor = {},
+            .depthClear = depthClear,
+        };
+        return write(pass, resource, ImageUsage::DEPTH_ATTACHMENT, ATTACHMENT_RANGE);
+    }
+
+    RenderGraph& RenderGraph::setSideEffects(std::uint32_t pass) {
+        passes[pass].hasSideEffects = true;
+        return *this;
+    }
+
+    RenderGraph& RenderGraph::setRenderExtent(std::uint32_t pass, VkExtent2D extent) {
+        passes[pass].renderExtent = extent;
+        return *this;
+    }
+
+    ReturnCode RenderGraph::compile(RendererState& state) {
+        KAMSKI_PROFILE();
+        buildSignature(signature, *this);
+        const std::size_t hash = hashSignature(signature);
+        if(!plan.isValid || plan.hash != hash || plan.signature != signature) {
+            ReturnCode rc = compileFull(state);
+            if(rc != ReturnCode::OK) {
+                plan.isValid = false;
+                return rc;
+            }
+
+            plan.hash = hash;
+            plan.signature.swap(signature);
+            plan.isLive.clear();
+            plan.discards.clear();
+            plan.loadOps.clear();
+            plan.storeOps.clear();
+            plan.transients.clear();
+            for(const Pass& pass : passes) {
+                plan.isLive.push_back(pass.isLive);
+                for(const Access& access : pass.accesses) {
+                    plan.discards.push_back(access.discard);
+                }
+                for(const Attachment& attachment : pass.colorAttachments) {
+                    plan.loadOps.push_back(attachment.loadOp);
+                    plan.storeOps.push_back(attachment.storeOp);
+                }
+                if(pass.hasDepth) {
+                    plan.loadOps.push_back(pass.depthAttachment.loadOp);
+                    plan.storeOps.push_back(pass.depthAttachment.storeOp);
+                }
+            }
+            for(const Resource& resource : resources) {
+                plan.transients.push_back(resource.transient);
+            }
+            plan.isValid = true;
+            return ReturnCode::OK;
+        }
+
+        //
+        // Same topology as last time, only copy the results over. The transients the plan points
+        // at were all in use by the last compile and are still alive
+        //
+        std::uint32_t discardIndex    = 0;
+        std::uint32_t attachmentIndex = 0;
+        for(std::uint32_t passIndex = 0; passIndex != passes.size(); passIndex++) {
+            Pass& pass  = passes[passIndex];
+            pass.isLive = plan.isLive[passIndex];
+            for(Access& access : pass.accesses) {
+                access.discard = plan.discards[discardIndex++];
+            }
+            for(Attachment& attachment : pass.colorAttachments) {
+                attachment.loadOp  = plan.loadOps[attachmentIndex];
+                attachment.storeOp = plan.storeOps[attachmentIndex++];
+            }
+            if(pass.hasDepth) {
+                pass.depthAttachment.loadOp  = plan.loadOps[attachmentIndex];
+                pass.depthAttachment.storeOp = plan.storeOps[attachmentIndex++];
+            }
+        }
+        for(RenderResource resource = 0; resource != resources.size(); resource++) {
+            resources[resource].transient = plan.transients[resource];
+        }
+        return ReturnCode::OK;
+    }
+
+    ReturnCode RenderGraph::compileFull(RendererState& state) {
+        KAMSKI_PROFILE();
+
+        SubresourceLayout layout;
+        buildSubresourceLayout(layout, *this);
+
+        //
+        // Backwards: a pass lives when it writes a subresource needed later. Its own reads become
+        // needed, the ranges it overwrites stop being needed before it. Overwrites are applied first
+        // so a read of another range of the same resource in that pass stays needed. Store ops fall
+        // out of the same walk
+        //
+        std::vector<bool> isNeeded(layout.total);
+        for(RenderResource resource = 0; resource != resources.size(); resource++) {
+            if(resources[resource].imported) {
+                forEachSubresource(layout, resource, {}, [&](std::uint32_t entry) {
+                    isNeeded[entry] = true;
+                });
+            }
+        }
+        for(std::uint32_t passIndex = std::uint32_t(passes.size()); passIndex-- != 0;) {
+            Pass& pass  = passes[passIndex];
+            pass.isLive = pass.hasSideEffects;
+            for(const Access& access : pass.accesses) {
+                pass.isLive = pass.isLive || (isWriteUsage(access.usage) && anySubresource(layout, isNeeded, access.resource, access.range));
+            }
+            if(!pass.isLive) {
+                continue;
+            }
+
+            for(Attachment& attachment : pass.colorAttachments) {
+                attachment.storeOp = anySubresource(layout, isNeeded, attachment.resource, ATTACHMENT_RANGE) ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+            }
+            if(pass.hasDepth) {
+                pass.depthAttachment.storeOp = anySubresource(layout, isNeeded, pass.depthAttachment.resource, ATTACHMENT_RANGE) ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+            }
+            for(const Access& access : pass.accesses) {
+                if(overwrites(pass, access)) {
+                    forEachSubresource(layout, access.resource, access.range, [&](std::uint32_t entry) {
+                        isNeeded[entry] = false;
+                    });
+                }
+            }
+            for(const Access& access : pass.accesses) {
+                if(!overwrites(pass, access)) {
+                    forEachSubresource(layout, access.resource, access.range, [&](std::uint32_t entry) {
+                        isNeeded[entry] = true;
+                    });
+                }
+            }
+        }
+
+        //
+        // Forwards: loads of a range nothing wrote yet become DONT_CARE and every access that does not
+        // depend on earlier contents of its range lets the layout start from UNDEFINED
+        //
+        std::vector<bool> hasContents(layout.total);
+        for(RenderResource resource = 0; resource != resources.size(); resource++) {
+            resources[resource].usage = 0;
+            if(resources[resource].imported) {
+                forEachSubresource(layout, resource, {}, [&](std::uint32_t entry) {
+                    hasContents[entry] = true;
+                });
+            }
+        }
+        for(Pass& pass : passes) {
+            if(!pass.isLive) {
+                continue;
+            }
+            for(Attachment& attachment : pass.colorAttachments) {
+                if(attachment.loadOp == VK_ATTACHMENT_LOAD_OP_LOAD && !anySubresource(layout, hasContents, attachment.resource, ATTACHMENT_RANGE)) {
+                    attachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+                }
+            }
+            if(pass.hasDepth && pass.depthAttachment.loadOp == VK_ATTACHMENT_LOAD_OP_LOAD &&
+               !anySubresource(layout, hasContents, pass.depthAttachment.resource, ATTACHMENT_RANGE)) {
+                pass.depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+            }
+            // execute resets the whole range, so only discard when none of it holds anything
+            for(Access& access : pass.accesses) {
+                access.discard                    = overwrites(pass, access) || !anySubresource(layout, hasContents, access.resource, access.range);
+                resources[access.resource].usage |= imageUsageFlags(access.usage);
+            }
+            for(const Access& access : pass.accesses) {
+                if(isWriteUsage(access.usage)) {
+                    forEachSubresource(layout, access.resource, access.range, [&](std::uint32_t entry) {
+                        hasContents[entry] = true;
+                    });
+                }
+            }
+        }
+
+        //
+        // Transients take the first free image with the same descriptor and at least their usage,
+        // images no resource took are released once the frame retires
+        //
+        for(TransientImage& transient : transients) {
+            transient.isUsed = false;
+        }
+        for(Resource& resource : resources) {
+            resource.transient = INVALID_ID;
+            if(resource.imported || resource.usage == 0) {
+                continue;
+            }
+            for(std::uint32_t i = 0; i != transients.size(); i++) {
+                const TransientImage& transient = transients[i];
+                if(!transient.isUsed &&
+                   transient.desc.format == resource.desc.format &&
+                   transient.desc.extent.width == resource.desc.extent.width &&
+                   transient.desc.extent.height == resource.desc.extent.height &&
+                   transient.desc.mipCount == resource.desc.mipCount &&
+                   transient.desc.layerCount == resource.desc.layerCount &&
+                   (transient.usage & resource.usage) == resource.usage) {
+                    resource.transient = i;
+                    break;
+                }
+            }
+            if(resource.transient == INVALID_ID) {
+                TransientImage transient = {
+                    .desc   = resource.desc,
+                    .usage  = resource.usage,
+                    .image  = {},
+                    .isUsed = false,
+                };
+                ReturnCode rc = kvk::createImage(transient.image,
+                                                 state,
+                                                 resource.desc.format,
+                                                 { resource.desc.extent.width, resource.desc.extent.height, 1 },
+                                                 resource.usage,
+                                                 false,
+                                                 resource.desc.mipCount,
+                                                 resource.desc.layerCount);
+                if(rc != ReturnCode::OK) {
+                    logError("Could not create render graph image %s", resource.name);
+                    return rc;
+                }
+                resource.transient = std::uint32_t(transients.size());
+                transients.push_back(transient);
+            }
+            transients[resource.transient].isUsed = true;
+        }
+
+        std::vector<std::uint32_t> remap(transients.size(), INVALID_ID);
+        std::uint32_t              kept = 0;
+        for(std::uint32_t i = 0; i != transients.size(); i++) {
+            if(!transients[i].isUsed) {
+                deferDestroy(state, transients[i].image);
+                continue;
+            }
+            remap[i]           = kept;
+            transients[kept++] = transients[i];
+        }
+        transients.resize(kept);
+        for(Resource& resource : resources) {
+            if(resource.transient != INVALID_ID) {
+                resource.transient = remap[resource.transient];
+            }
+        }
+        return ReturnCode::OK;
+    }
+
+    void RenderGraph::execute(VkCommandBuffer cmd, RendererState& state, GpuProfiler* profiler) {
+        KAMSKI_PROFILE();
+        BarrierBatch batch;
+        for(Pass& pass : passes) {
+            if(!pass.isLive) {
+                continue;
+            }
+            const std::uint32_t zone = profiler ? cmdBeginGpuZone(*profiler, cmd, pass.name) : UINT32_MAX;
+
+            for(const Access& access : pass.accesses) {
+                AllocatedImage& accessed = image(access.resource);
+                if(access.discard) {
+                    // Keeps stage and access so the barrier still waits for the previous user
+                    const ImageRange range = {
+                        .baseMip    = access.range.baseMip,
+                        .mipCount   = access.range.mipCount == VK_REMAINING_MIP_LEVELS ? accessed.mipCount - access.range.baseMip : access.range.mipCount,
+                        .baseLayer  = access.range.baseLayer,
+                        .layerCount = access.range.layerCount == VK_REMAINING_ARRAY_LAYERS ? accessed.layerCount - access.range.baseLayer : access.range.layerCount,
+                    };
+                    for(std::uint32_t layer = range.baseLayer; layer != range.baseLayer + range.layerCount; layer++) {
+                        for(std::uint32_t mip = range.baseMip; mip != range.baseMip + range.mipCount; mip++) {
+                            accessed.states[layer * accessed.mipCount + mip].layout = VK_IMAGE_LAYOUT_UNDEFINED;
+                        }
+                    }
+                }
+                require(batch, accessed, access.usage, access.range);
+            }
+            batch.flush(cmd);
+
+            if(pass.colorAttachments.empty() && !pass.hasDepth) {
+                pass.execute(cmd, *this);
+                if(profiler) {
+                    cmdEndGpuZone(*profiler, cmd, zone);
+                }
+                continue;
+            }
+
+            auto attachmentView = [&](AllocatedImage& attached) {
+                if(attached.mipCount == 1 && attached.layerCount == 1) {
+                    return attached.view;
+                }
+                return imageView(state,
+                                 attached,
+                                 {
+                                     .type  = attached.layerCount > 1 ? VK_IMAGE_VIEW_TYPE_2D_ARRAY : VK_IMAGE_VIEW_TYPE_2D,
+                                     .range = { .baseMip = 0, .mipCount = 1 },
+                                 });
+            };
+            RenderPassBuilder builder;
+            VkExtent2D        extent     = pass.renderExtent;
+            std::uint32_t     layerCount = 0;
+            for(const Attachment& attachment : pass.colorAttachments) {
+                AllocatedImage& attached = image(attachment.resource);
+                assert(layerCount == 0 || layerCount == attached.layerCount);
+                layerCount = attached.layerCount;
+                builder.addColorAttachment(attachmentView(attached),
+                                           attachment.loadOp,
+                                           attachment.clearColor,
+                                           attachment.storeOp,
+                                           VK_IMAGE_LAYOUT_ATTACHMENT_OPTIMAL);
+                if(extent.width == 0) {
+                    extent = { attached.extent.width, attached.extent.height };
+                }
+            }
+            if(pass.hasDepth) {
+                AllocatedImage& attached = image(pass.depthAttachment.resource);
+                assert(layerCount == 0 || layerCount == attached.layerCount);
+                layerCount = attached.layerCount;
+                builder.setDepthAttachment(attachmentView(attached),
+                                           hasStencil(attached.format),
+                                           pass.depthAttachment.loadOp,
+                                           pass.depthAttachment.depthClear,
+                                           0,
+                                           pass.depthAttachment.storeOp,
+                                           VK_IMAGE_LAYOUT_ATTACHMENT_OPTIMAL);
+                if(extent.width == 0) {
+                    extent = { attached.extent.width, attached.extent.height };
+                }
+            }
+            builder.cmdBeginRendering(cmd, extent, { 0, 0 }, layerCount);
+            pass.execute(cmd, *this);
+            vkCmdEndRendering(cmd);
+            if(profiler) {
+                cmdEndGpuZone(*profiler, cmd, zone);
+            }
+        }
+
+        for(Resource& resource : resources) {
+            if(resource.imported && resource.finalUsage != ImageUsage::UNDEFINED) {
+                require(batch, *resource.imported, resource.finalUsage);
+            }
+        }
+        batch.flush(cmd);
+    }
+
+    AllocatedImage& RenderGraph::image(RenderResource resource) {
+        const Resource& described = resources[resource];
+        if(described.imported) {
+            return *described.imported;
+        }
+        assert(described.transient != INVALID_ID);
+        return transients[described.transient].image;
+    }
+
+}
@@ -0,0 +1,126 @@
+#include "vulkan/vulkan_core.h"
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+
+#include "common.h"
+#include "krender.h"
+#include "utils.h"
+
+namespace kvk {
+
+    static constexpr float AVERAGE_WEIGHT = 0.2f;
+
+    static VkExtent2D scaledExtent(VkExtent2D extent, float scale) {
+        return {
+            std::max(1u, std::uint32_t(std::lround(float(extent.width) * scale))),
+            std::max(1u, std::uint32_t(std::lround(float(extent.height) * scale))),
+        };
+    }
+
+    void initDynamicResolution(DynamicResolution& resolution, const DynamicResolutionSettings& settings, VkExtent2D maxExtent) {
+        resolution.settings = settings;
+        resolution.scale    = settings.maxScale;
+        resizeDynamicResolution(resolution, maxExtent);
+    }
+
+    void resizeDynamicResolution(DynamicResolution& resolution, VkExtent2D maxExtent) {
+        resolution.maxExtent    = maxExtent;
+        resolution.renderExtent = scaledExtent(maxExtent, resolution.scale);
+        resolution.averageMs    = 0.0f;
+        resolution.overFrames   = 0;
+        resolution.underFrames  = 0;
+        resolution.staleSamples = resolution.settings.sampleLag;
+    }
+
+    bool updateDynamicResolution(DynamicResolution& resolution, float gpuMilliseconds) {
+        const DynamicResolutionSettings& settings = resolution.settings;
+        // Frames recorded before the last change would shrink again for a cost already dealt with
+        if(resolution.staleSamples != 0) {
+            resolution.staleSamples--;
+            return false;
+        }
+        if(resolution.averageMs == 0.0f) {
+            resolution.averageMs = gpuMilliseconds;
+        }
+        resolution.averageMs += (gpuMilliseconds - resolution.averageMs) * AVERAGE_WEIGHT;
+
+        //
+        // Spikes are judged on the frame itself so shrinking is not held back by the average,
+        // growing needs the average and every recent frame under the headroom
+        //
+        if(gpuMilliseconds > settings.targetMs) {
+            resolution.overFrames++;
+            resolution.underFrames = 0;
+        } else if(gpuMilliseconds < settings.targetMs * settings.headroom) {
+            resolution.underFrames++;
+            resolution.overFrames = 0;
+        } else {
+            resolution.overFrames  = 0;
+            resolution.underFrames = 0;
+        }
+
+        const bool shrink = resolution.overFrames >= settings.shrinkFrames;
+        const bool grow   = resolution.underFrames >= settings.growFrames && resolution.averageMs < settings.targetMs * settings.headroom;
+        if(!shrink && !grow) {
+            return false;
+        }
+
+        // Cost goes with the pixel count, the square of the scale
+        const float budget  = shrink ? settings.targetMs * settings.headroom : settings.targetMs;
+        const float wanted  = resolution.scale * std::sqrt(budget / std::max(resolution.averageMs, 0.01f));
+        const float maxMove = settings.scaleStep * 2.0f;
+        float       scale   = std::clamp(wanted, resolution.scale - maxMove, resolution.scale + maxMove);
+        scale               = std::round(scale / settings.scaleStep) * settings.scaleStep;
+        scale               = std::clamp(scale, settings.minScale, settings.maxScale);
+        if(shrink && scale >= resolution.scale) {
+            scale = std::max(settings.minScale, resolution.scale - settings.scaleStep);
+        }
+        if(grow && scale <= resolution.scale) {
+            scale = std::min(settings.maxScale, resolution.scale + settings.scaleStep);
+        }
+
+        resolution.overFrames  = 0;
+        resolution.underFrames = 0;
+        if(scale == resolution.scale) {
+            return false;
+        }
+        resolution.scale        = scale;
+        resolution.renderExtent = scaledExtent(resolution.maxExtent, scale);
+        // The old average describes the old extent
+        resolution.averageMs    = 0.0f;
+        resolution.staleSamples = settings.sampleLag;
+        return true;
+    }
+
+    bool updateDynamicResolution(DynamicResolution& resolution, const GpuProfiler& profiler) {
+        if(profiler.results.empty()) {
+            return false;
+        }
+        std::chrono::steady_clock::time_point first = profiler.results.front().start;
+        std::chrono::steady_clock::time_point last  = first;
+        for(const GpuZoneResult& zone : profiler.results) {
+            const auto end = zone.start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float, std::milli>(zone.milliseconds));
+            first          = std::min(first, zone.start);
+            last           = std::max(last, end);
+        }
+        return updateDynamicResolution(resolution, std::chrono::duration<float, std::milli>(last - first).count());
+    }
+
+    glm::vec2 dynamicResolutionUvScale(const DynamicResolution& resolution) {
+        return glm::vec2(resolution.renderExtent.width, resolution.renderExtent.height) /
+               glm::vec2(resolution.maxExtent.width, resolution.maxExtent.height);
+    }
+
+    void cmdUpscale(VkCommandBuffer          cmd,
+                    const DynamicResolution& resolution,
+                    AllocatedImage&          source,
+                    VkImage                  dst,
+                    VkExtent2D               dstExtent) {
+        KAMSKI_PROFILE();
+        require(cmd, source, ImageUsage::TRANSFER_SRC, { .baseMip = 0, .mipCount = 1, .baseLayer = 0, .layerCount = 1 });
+        blitImageToImage(cmd, source.image, dst, resolution.renderExtent, dstExtent);
+    }
+
+}
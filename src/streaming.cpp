@@ -0,0 +1,486 @@
+#include "vulkan/vulkan_core.h"
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "common.h"
+#include "krender.h"
+#include "utils.h"
+
+namespace kvk {
+
+    static VkExtent3D mipExtent(const StreamedTextureDesc& desc, std::uint32_t mip) {
+        return VkExtent3D{
+            .width  = std::max(1u, desc.extent.width >> mip),
+            .height = std::max(1u, desc.extent.height >> mip),
+            .depth  = 1,
+        };
+    }
+
+    ReturnCode TextureStreamer::init(RendererState& state,
+                                     std::uint64_t  frameBudget,
+                                     std::uint32_t  maxTextures,
+                                     std::uint32_t  evictionDelay) {
+        KAMSKI_PROFILE();
+        this->frameBudget   = frameBudget;
+        this->maxTextures   = maxTextures;
+        this->evictionDelay = evictionDelay;
+        textures.reserve(maxTextures);
+
+        for(std::uint32_t frameIndex = 0; frameIndex != state.framesInFlight; frameIndex++) {
+            ReturnCode rc = createBuffer(stagingBuffers[frameIndex],
+                                         state.device,
+                                         state.allocator,
+                                         frameBudget,
+                                         VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                         VMA_MEMORY_USAGE_CPU_ONLY);
+            if(rc != ReturnCode::OK) {
+                logError("Could not create streaming staging buffer");
+                return rc;
+            }
+
+            rc = createBuffer(feedbackBuffers[frameIndex],
+                              state.device,
+                              state.allocator,
+                              maxTextures * sizeof(std::uint32_t),
+                              VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+                              VMA_MEMORY_USAGE_GPU_TO_CPU);
+            if(rc != ReturnCode::OK) {
+                logError("Could not create streaming feedback buffer");
+                return rc;
+            }
+            memset(feedbackBuffers[frameIndex].allocation->GetMappedData(), 0xFF, maxTextures * sizeof(std::uint32_t));
+            vmaFlushAllocation(state.allocator, feedbackBuffers[frameIndex].allocation, 0, VK_WHOLE_SIZE);
+        }
+
+        return ReturnCode::OK;
+    }
+
+    void TextureStreamer::destroy(RendererState& state) {
+        KAMSKI_PROFILE();
+        for(Texture& texture : textures) {
+            if(texture.isAlive) {
+                destroyImage(texture.image, state.device, state.allocator);
+            }
+        }
+        textures.clear();
+        freeHandles.clear();
+
+        for(std::uint32_t frameIndex = 0; frameIndex != MAX_IN_FLIGHT_FRAMES; frameIndex++) {
+            destroyBuffer(stagingBuffers[frameIndex], state.allocator);
+            destroyBuffer(feedbackBuffers[frameIndex], state.allocator);
+            stagingBuffers[frameIndex]  = {};
+            feedbackBuffers[frameIndex] = {};
+        }
+    }
+
+    ReturnCode TextureStreamer::registerTexture(StreamedTextureHandle&  handle,
+                                                RendererState&          state,
+                                                StreamedTextureDesc&&   desc,
+                                                const VkImageUsageFlags usageFlags) {
+        KAMSKI_PROFILE();
+        if(desc.mipCount == 0 || desc.mipCount > StreamedTextureDesc::MAX_MIPS) {
+            logError("Streamed textures need between 1 and %u mips, got %u", StreamedTextureDesc::MAX_MIPS, desc.mipCount);
+            return ReturnCode::UNKNOWN;
+        }
+        desc.tailMipCount = std::clamp(desc.tailMipCount, 1u, desc.mipCount);
+
+        if(freeHandles.empty() && textures.size() == maxTextures) {
+            logError("Texture streamer is full (%u textures)", maxTextures);
+            return ReturnCode::UNKNOWN;
+        }
+
+        const std::uint32_t tailMip = desc.mipCount - desc.tailMipCount;
+        for(std::uint32_t mip = 0; mip != tailMip; mip++) {
+            if(desc.mipSizes[mip] > frameBudget) {
+                logWarning("Mip %u (%llu bytes) is over the streaming budget and will never become resident",
+                           mip,
+                           (unsigned long long)desc.mipSizes[mip]);
+            }
+        }
+
+        //
+        // Upload the tail up front so the texture is always sampleable
+        //
+        std::uint64_t     stagingSize = 0;
+        VkBufferImageCopy regions[StreamedTextureDesc::MAX_MIPS];
+        for(std::uint32_t mip = tailMip; mip != desc.mipCount; mip++) {
+            stagingSize = alignStagingOffset(stagingSize, desc.format);
+            regions[mip - tailMip] = VkBufferImageCopy{
+                .bufferOffset      = stagingSize,
+                .bufferRowLength   = 0,
+                .bufferImageHeight = 0,
+                .imageSubresource  = {
+                     .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+                     .mipLevel       = mip - tailMip,
+                     .baseArrayLayer = 0,
+                     .layerCount     = 1,
+                },
+                .imageExtent = mipExtent(desc, mip),
+            };
+            stagingSize += desc.mipSizes[mip];
+        }
+
+        AllocatedBuffer stagingBuffer = {};
+        ReturnCode      rc            = createBuffer(stagingBuffer,
+                                                     state.device,
+                                                     state.allocator,
+                                                     stagingSize,
+                                                     VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                                     VMA_MEMORY_USAGE_CPU_ONLY);
+        if(rc != ReturnCode::OK) {
+            logError("Could not create staging buffer");
+            return rc;
+        }
+        defer {
+            destroyBuffer(stagingBuffer, state.allocator);
+        };
+
+        std::uint8_t* stagingData = (std::uint8_t*)stagingBuffer.allocation->GetMappedData();
+        for(std::uint32_t mip = tailMip; mip != desc.mipCount; mip++) {
+            if(!desc.loadMip(mip, stagingData + regions[mip - tailMip].bufferOffset)) {
+                logError("Could not load mip %u", mip);
+                return ReturnCode::FILE_NOT_FOUND;
+            }
+        }
+
+        const VkImageUsageFlags imageUsage = usageFlags | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+        AllocatedImage          tailImage  = {};
+        rc                                 = createImage(tailImage,
+                                                         state,
+                                                         stagingBuffer,
+                                                         std::span<const VkBufferImageCopy>(regions, desc.tailMipCount),
+                                                         desc.format,
+                                                         mipExtent(desc, tailMip),
+                                                         imageUsage,
+                                                         desc.tailMipCount);
+        if(rc != ReturnCode::OK) {
+            logError("Could not create streamed texture");
+            return rc;
+        }
+
+        if(freeHandles.empty()) {
+            handle = std::uint32_t(textures.size());
+            textures.emplace_back();
+        } else {
+            handle = freeHandles.back();
+            freeHandles.pop_back();
+        }
+
+        textures[handle] = Texture{
+            .desc              = std::move(desc),
+            .image             = tailImage,
+            .usage             = imageUsage,
+            .residentMip       = tailMip,
+            .requestedMip      = NO_REQUEST,
+            .framesUnrequested = 0,
+            .isAlive           = true,
+        };
+
+        return ReturnCode::OK;
+    }
+
+    void TextureStreamer::unregisterTexture(StreamedTextureHandle handle, RendererState& state) {
+        KAMSKI_PROFILE();
+        Texture& texture = textures[handle];
+        assert(texture.isAlive);
+
+        deferDestroy(state, texture.image);
+        texture = {};
+        freeHandles.push_back(handle);
+    }
+
+    void TextureStreamer::requestMip(StreamedTextureHandle handle, std::uint32_t mip) {
+        textures[handle].requestedMip = std::min(textures[handle].requestedMip, mip);
+    }
+
+    std::uint32_t TextureStreamer::mipForScreenSize(VkExtent2D extent, float screenSize) {
+        if(screenSize <= 0.0f) {
+            return NO_REQUEST;
+        }
+        const float texelsPerPixel = float(std::max(extent.width, extent.height)) / screenSize;
+        if(texelsPerPixel <= 1.0f) {
+            return 0;
+        }
+        return std::uint32_t(std::floor(std::log2(texelsPerPixel)));
+    }
+
+    void TextureStreamer::update(VkCommandBuffer cmd, RendererState& state, std::uint32_t frameIndex) {
+        KAMSKI_PROFILE();
+        struct StreamCandidate {
+            StreamedTextureHandle handle;
+            std::uint32_t         missingMips;
+        };
+
+        struct Reallocation {
+            StreamedTextureHandle handle;
+            AllocatedImage        image;
+            std::uint32_t         residentMip;
+            std::uint64_t         stagingOffset;
+            bool                  hasUpload;
+        };
+
+        //
+        // Merge GPU feedback with CPU requests
+        //
+        std::vector<StreamCandidate>       streamIns;
+        std::vector<StreamedTextureHandle> evictions;
+        {
+            KAMSKI_PROFILE_NAMED("Read feedback");
+            AllocatedBuffer& feedbackBuffer = feedbackBuffers[frameIndex];
+            vmaInvalidateAllocation(state.allocator, feedbackBuffer.allocation, 0, VK_WHOLE_SIZE);
+            std::uint32_t* feedback = (std::uint32_t*)feedbackBuffer.allocation->GetMappedData();
+
+            for(StreamedTextureHandle handle = 0; handle != textures.size(); handle++) {
+                Texture&            texture   = textures[handle];
+                const std::uint32_t requested = std::min(texture.requestedMip, feedback[handle]);
+                feedback[handle]              = NO_REQUEST;
+                texture.requestedMip          = NO_REQUEST;
+                if(!texture.isAlive) {
+                    continue;
+                }
+
+                const std::uint32_t tailMip   = texture.desc.mipCount - texture.desc.tailMipCount;
+                const std::uint32_t targetMip = std::min(requested, tailMip);
+                if(targetMip < texture.residentMip) {
+                    texture.framesUnrequested = 0;
+                    streamIns.push_back({
+                        .handle      = handle,
+                        .missingMips = texture.residentMip - targetMip,
+                    });
+                } else if(targetMip > texture.residentMip) {
+                    if(++texture.framesUnrequested > evictionDelay) {
+                        texture.framesUnrequested = 0;
+                        evictions.push_back(handle);
+                    }
+                } else {
+                    texture.framesUnrequested = 0;
+                }
+            }
+            vmaFlushAllocation(state.allocator, feedbackBuffer.allocation, 0, VK_WHOLE_SIZE);
+        }
+
+        if(streamIns.empty() && evictions.empty()) {
+            return;
+        }
+
+        //
+        // Most starved textures first, one level per texture per frame
+        //
+        std::sort(streamIns.begin(), streamIns.end(), [&](const StreamCandidate& a, const StreamCandidate& b) {
+            if(a.missingMips != b.missingMips) {
+                return a.missingMips > b.missingMips;
+            }
+            const Texture& textureA = textures[a.handle];
+            const Texture& textureB = textures[b.handle];
+            return textureA.desc.mipSizes[textureA.residentMip - 1] < textureB.desc.mipSizes[textureB.residentMip - 1];
+        });
+
+        std::vector<Reallocation> reallocations;
+        AllocatedBuffer&          stagingBuffer = stagingBuffers[frameIndex];
+        std::uint8_t*             stagingData   = (std::uint8_t*)stagingBuffer.allocation->GetMappedData();
+        std::uint64_t             stagingSize   = 0;
+        for(const StreamCandidate& candidate : streamIns) {
+            Texture&            texture = textures[candidate.handle];
+            const std::uint32_t mip     = texture.residentMip - 1;
+            const std::uint64_t offset  = alignStagingOffset(stagingSize, texture.desc.format);
+            if(offset + texture.desc.mipSizes[mip] > frameBudget) {
+                continue;
+            }
+
+            AllocatedImage image = {};
+            if(createImage(image,
+                           state,
+                           texture.desc.format,
+                           mipExtent(texture.desc, mip),
+                           texture.usage,
+                           false,
+                           texture.desc.mipCount - mip) != ReturnCode::OK) {
+                logError("Could not grow streamed texture %u", candidate.handle);
+                continue;
+            }
+
+            {
+                KAMSKI_PROFILE_NAMED("Load mip");
+                if(!texture.desc.loadMip(mip, stagingData + offset)) {
+                    logError("Could not load mip %u of streamed texture %u", mip, candidate.handle);
+                    destroyImage(image, state.device, state.allocator);
+                    continue;
+                }
+            }
+            stagingSize = offset + texture.desc.mipSizes[mip];
+            reallocations.push_back({
+                .handle        = candidate.handle,
+                .image         = image,
+                .residentMip   = mip,
+                .stagingOffset = offset,
+                .hasUpload     = true,
+            });
+        }
+
+        for(StreamedTextureHandle handle : evictions) {
+            Texture&            texture = textures[handle];
+            const std::uint32_t mip     = texture.residentMip + 1;
+
+            AllocatedImage      image   = {};
+            if(createImage(image,
+                           state,
+                           texture.desc.format,
+                           mipExtent(texture.desc, mip),
+                           texture.usage,
+                           false,
+                           texture.desc.mipCount - mip) != ReturnCode::OK) {
+                logError("Could not shrink streamed texture %u", handle);
+                continue;
+            }
+            reallocations.push_back({
+                .handle      = handle,
+                .image       = image,
+                .residentMip = mip,
+                .hasUpload   = false,
+            });
+        }
+
+        if(reallocations.empty()) {
+            return;
+        }
+        vmaFlushAllocation(state.allocator, stagingBuffer.allocation, 0, stagingSize);
+
+        //
+        // Every reallocation shares the same three barrier batches
+        //
+        std::vector<VkImageMemoryBarrier2> barriers;
+        barriers.reserve(reallocations.size() * 2);
+        for(const Reallocation& reallocation : reallocations) {
+            barriers.push_back({
+                .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                .srcStageMask        = VK_PIPELINE_STAGE_2_NONE,
+                .srcAccessMask       = 0,
+                .dstStageMask        = VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                .dstAccessMask       = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                .oldLayout           = VK_IMAGE_LAYOUT_UNDEFINED,
+                .newLayout           = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .image               = reallocation.image.image,
+                .subresourceRange    = imageSubresourceRange(VK_IMAGE_ASPECT_COLOR_BIT),
+            });
+            barriers.push_back({
+                .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                .srcStageMask        = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                .srcAccessMask       = 0,
+                .dstStageMask        = VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                .dstAccessMask       = VK_ACCESS_2_TRANSFER_READ_BIT,
+                .oldLayout           = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                .newLayout           = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .image               = textures[reallocation.handle].image.image,
+                .subresourceRange    = imageSubresourceRange(VK_IMAGE_ASPECT_COLOR_BIT),
+            });
+        }
+        VkDependencyInfo dependencyInfo = {
+            .sType                   = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+            .imageMemoryBarrierCount = std::uint32_t(barriers.size()),
+            .pImageMemoryBarriers    = barriers.data(),
+        };
+        vkCmdPipelineBarrier2(cmd, &dependencyInfo);
+
+        for(const Reallocation& reallocation : reallocations) {
+            const Texture&      texture    = textures[reallocation.handle];
+            const std::uint32_t sharedMip  = std::max(texture.residentMip, reallocation.residentMip);
+
+            VkImageCopy         copies[StreamedTextureDesc::MAX_MIPS];
+            std::uint32_t       copyCount  = 0;
+            for(std::uint32_t mip = sharedMip; mip != texture.desc.mipCount; mip++) {
+                copies[copyCount++] = VkImageCopy{
+                    .srcSubresource = {
+                        .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+                        .mipLevel       = mip - texture.residentMip,
+                        .baseArrayLayer = 0,
+                        .layerCount     = 1,
+                    },
+                    .dstSubresource = {
+                        .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+                        .mipLevel       = mip - reallocation.residentMip,
+                        .baseArrayLayer = 0,
+                        .layerCount     = 1,
+                    },
+                    .extent = mipExtent(texture.desc, mip),
+                };
+            }
+            vkCmdCopyImage(cmd,
+                           texture.image.image,
+                           VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           reallocation.image.image,
+                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           copyCount,
+                           copies);
+
+            if(reallocation.hasUpload) {
+                const VkBufferImageCopy region = {
+                    .bufferOffset      = reallocation.stagingOffset,
+                    .bufferRowLength   = 0,
+                    .bufferImageHeight = 0,
+                    .imageSubresource  = {
+                         .aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+                         .mipLevel       = 0,
+                         .baseArrayLayer = 0,
+                         .layerCount     = 1,
+                    },
+                    .imageExtent = mipExtent(texture.desc, reallocation.residentMip),
+                };
+                vkCmdCopyBufferToImage(cmd,
+                                       stagingBuffer.buffer,
+                                       reallocation.image.image,
+                                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                       1,
+                                       &region);
+            }
+        }
+
+        barriers.clear();
+        for(const Reallocation& reallocation : reallocations) {
+            barriers.push_back({
+                .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                .srcStageMask        = VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                .srcAccessMask       = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                .dstStageMask        = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                .dstAccessMask       = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+                .oldLayout           = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                .newLayout           = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                .image               = reallocation.image.image,
+                .subresourceRange    = imageSubresourceRange(VK_IMAGE_ASPECT_COLOR_BIT),
+            });
+
+            //
+            // The copies above still read the old image, it goes once this frame retires
+            //
+            Texture& texture = textures[reallocation.handle];
+            deferDestroy(state, texture.image);
+            texture.image       = reallocation.image;
+            texture.residentMip = reallocation.residentMip;
+            setImageState(texture.image, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT);
+        }
+        dependencyInfo.imageMemoryBarrierCount = std::uint32_t(barriers.size());
+        dependencyInfo.pImageMemoryBarriers    = barriers.data();
+        vkCmdPipelineBarrier2(cmd, &dependencyInfo);
+    }
+
+    VkDeviceAddress TextureStreamer::feedbackAddress(std::uint32_t frameIndex) const {
+        return feedbackBuffers[frameIndex].address;
+    }
+
+    const AllocatedImage& TextureStreamer::image(StreamedTextureHandle handle) const {
+        return textures[handle].image;
+    }
+
+    std::uint32_t TextureStreamer::residentMip(StreamedTextureHandle handle) const {
+        return textures[handle].residentMip;
+    }
+
+}
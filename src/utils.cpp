@@ -2,7 +2,10 @@
 #include "common.h"
 #include "utils.h"
 #include "vulkan/vulkan_core.h"
+#include <algorithm>
+#include <atomic>
 #include <mutex>
+#include <numeric>
 
 namespace kvk {
 	VkDescriptorSetLayoutBinding descriptorSetLayoutBinding(std::uint32_t binding,
@@ -241,7 +244,8 @@ namespace kvk {
 						  VkExtent2D dstExtent,
                           VkImageAspectFlags aspect,
                           std::uint32_t srcMipLevel,
-                          std::uint32_t dstMipLevel) {
+                          std::uint32_t dstMipLevel,
+                          std::uint32_t layerCount) {
         KAMSKI_PROFILE();
   		VkImageBlit2 blitRegion = {
  			.sType = VK_STRUCTURE_TYPE_IMAGE_BLIT_2,
@@ -250,14 +254,14 @@ namespace kvk {
 				.aspectMask = aspect,
 				.mipLevel = srcMipLevel,
 				.baseArrayLayer = 0,
-				.layerCount = 1,
+				.layerCount = layerCount,
  			},
 
  			.dstSubresource =  {
 				.aspectMask = aspect,
 				.mipLevel = dstMipLevel,
 				.baseArrayLayer = 0,
-				.layerCount = 1,
+				.layerCount = layerCount,
  			},
   		};
 
@@ -282,86 +286,354 @@ namespace kvk {
   		vkCmdBlitImage2(cmd, &blitInfo);
 	}
 
-	VkResult immediateSubmit(VkCommandBuffer cmd,
-							 VkDevice device,
-							 VkQueue queue,
-                             std::mutex& queueMutex,
-							 std::function<void(VkCommandBuffer)>&& function) {
-        KAMSKI_PROFILE();
-		VkResult retval;
-		VkCommandBufferBeginInfo beginInfo = {
-			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-			.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
-		};
+    std::uint32_t getMipLevels(std::uint32_t width, std::uint32_t height) {
+        std::uint32_t retval = 0;
+        while(width != 0 && height != 0) {
+            retval++;
+            width /= 2;
+            height /= 2;
+        }
+        return retval;
+    }
 
-		VkFenceCreateInfo fenceCreateInfo = {
-			.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-		};
+    VkFormat storageCompatibleFormat(VkFormat format) {
+        switch(format) {
+        case VK_FORMAT_R8G8B8A8_SRGB: {
+            return VK_FORMAT_R8G8B8A8_UNORM;
+        } break;
 
-		VkFence fence;
-		retval = vkCreateFence(device,
-							   &fenceCreateInfo,
-							   nullptr,
-							   &fence);
-		if(retval != VK_SUCCESS) {
-			logError("Could not create fence");
-			return retval;
-		}
+        case VK_FORMAT_B8G8R8A8_SRGB: {
+            return VK_FORMAT_B8G8R8A8_UNORM;
+        } break;
 
-		retval = vkBeginCommandBuffer(cmd,
-									  &beginInfo);
-		if(retval != VK_SUCCESS) {
-			logError("Could not start command buffer recording");
-			return retval;
-		}
+        case VK_FORMAT_A8B8G8R8_SRGB_PACK32: {
+            return VK_FORMAT_A8B8G8R8_UNORM_PACK32;
+        } break;
 
-		function(cmd);
+        default: {
+            return format;
+        } break;
+        }
+    }
 
-		retval = vkEndCommandBuffer(cmd);
-		if(retval != VK_SUCCESS) {
-			logError("Could not end command buffer");
-			return retval;
-		}
+    std::uint32_t formatBlockSize(VkFormat format) {
+        struct FormatRange {
+            VkFormat      first;
+            VkFormat      last;
+            std::uint32_t size;
+        };
+        static constexpr FormatRange RANGES[] = {
+            { VK_FORMAT_R4G4_UNORM_PACK8, VK_FORMAT_R4G4_UNORM_PACK8, 1 },
+            { VK_FORMAT_R4G4B4A4_UNORM_PACK16, VK_FORMAT_A1R5G5B5_UNORM_PACK16, 2 },
+            { VK_FORMAT_R8_UNORM, VK_FORMAT_R8_SRGB, 1 },
+            { VK_FORMAT_R8G8_UNORM, VK_FORMAT_R8G8_SRGB, 2 },
+            { VK_FORMAT_R8G8B8_UNORM, VK_FORMAT_B8G8R8_SRGB, 3 },
+            { VK_FORMAT_R8G8B8A8_UNORM, VK_FORMAT_A2B10G10R10_SINT_PACK32, 4 },
+            { VK_FORMAT_R16_UNORM, VK_FORMAT_R16_SFLOAT, 2 },
+            { VK_FORMAT_R16G16_UNORM, VK_FORMAT_R16G16_SFLOAT, 4 },
+            { VK_FORMAT_R16G16B16_UNORM, VK_FORMAT_R16G16B16_SFLOAT, 6 },
+            { VK_FORMAT_R16G16B16A16_UNORM, VK_FORMAT_R16G16B16A16_SFLOAT, 8 },
+            { VK_FORMAT_R32_UINT, VK_FORMAT_R32_SFLOAT, 4 },
+            { VK_FORMAT_R32G32_UINT, VK_FORMAT_R32G32_SFLOAT, 8 },
+            { VK_FORMAT_R32G32B32_UINT, VK_FORMAT_R32G32B32_SFLOAT, 12 },
+            { VK_FORMAT_R32G32B32A32_UINT, VK_FORMAT_R32G32B32A32_SFLOAT, 16 },
+            { VK_FORMAT_R64_UINT, VK_FORMAT_R64_SFLOAT, 8 },
+            { VK_FORMAT_R64G64_UINT, VK_FORMAT_R64G64_SFLOAT, 16 },
+            { VK_FORMAT_R64G64B64_UINT, VK_FORMAT_R64G64B64_SFLOAT, 24 },
+            { VK_FORMAT_R64G64B64A64_UINT, VK_FORMAT_R64G64B64A64_SFLOAT, 32 },
+            { VK_FORMAT_B10G11R11_UFLOAT_PACK32, VK_FORMAT_E5B9G9R9_UFLOAT_PACK32, 4 },
+            { VK_FORMAT_D16_UNORM, VK_FORMAT_D16_UNORM, 2 },
+            { VK_FORMAT_X8_D24_UNORM_PACK32, VK_FORMAT_D32_SFLOAT, 4 },
+            { VK_FORMAT_S8_UINT, VK_FORMAT_S8_UINT, 1 },
+            { VK_FORMAT_D16_UNORM_S8_UINT, VK_FORMAT_D16_UNORM_S8_UINT, 2 },
+            { VK_FORMAT_D24_UNORM_S8_UINT, VK_FORMAT_D32_SFLOAT_S8_UINT, 4 },
+            { VK_FORMAT_BC1_RGB_UNORM_BLOCK, VK_FORMAT_BC1_RGBA_SRGB_BLOCK, 8 },
+            { VK_FORMAT_BC2_UNORM_BLOCK, VK_FORMAT_BC3_SRGB_BLOCK, 16 },
+            { VK_FORMAT_BC4_UNORM_BLOCK, VK_FORMAT_BC4_SNORM_BLOCK, 8 },
+            { VK_FORMAT_BC5_UNORM_BLOCK, VK_FORMAT_BC7_SRGB_BLOCK, 16 },
+            { VK_FORMAT_ETC2_R8G8B8_UNORM_BLOCK, VK_FORMAT_ETC2_R8G8B8A1_SRGB_BLOCK, 8 },
+            { VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK, VK_FORMAT_ETC2_R8G8B8A8_SRGB_BLOCK, 16 },
+            { VK_FORMAT_EAC_R11_UNORM_BLOCK, VK_FORMAT_EAC_R11_SNORM_BLOCK, 8 },
+            { VK_FORMAT_EAC_R11G11_UNORM_BLOCK, VK_FORMAT_ASTC_12x12_SRGB_BLOCK, 16 },
+        };
+        for(const FormatRange& range : RANGES) {
+            if(format >= range.first && format <= range.last) {
+                return range.size;
+            }
+        }
+        return 16;
+    }
 
-		VkSubmitInfo submitInfo = {
-			.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-			.commandBufferCount = 1,
-			.pCommandBuffers = &cmd,
-		};
+    std::uint64_t alignStagingOffset(std::uint64_t offset, VkFormat format) {
+        // Depth / stencil copies additionally need 4, block sizes like 3 or 6 only meet both at their lcm
+        const std::uint64_t alignment = std::lcm(std::uint64_t(formatBlockSize(format)), std::uint64_t(4));
+        return (offset + alignment - 1) / alignment * alignment;
+    }
 
-        {
-            std::lock_guard lck(queueMutex);
-            retval = vkQueueSubmit(queue,
-                                   1,
-                                   &submitInfo,
-                                   fence);
-            if(retval != VK_SUCCESS) {
-                logError("Queue submit failed");
-                return retval;
+    std::uint64_t hashContents(const void* data, std::uint64_t size, std::uint64_t seed) {
+        const std::uint8_t* bytes = (const std::uint8_t*)data;
+        std::uint64_t       hash  = seed;
+        for(std::uint64_t i = 0; i != size; i++) {
+            hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+        }
+        return hash;
+    }
+
+    BarrierBatch& BarrierBatch::image(VkImage                 image,
+                                      VkImageLayout           oldLayout,
+                                      VkImageLayout           newLayout,
+                                      VkPipelineStageFlags2   srcStageMask,
+                                      VkAccessFlags2          srcAccessMask,
+                                      VkPipelineStageFlags2   dstStageMask,
+                                      VkAccessFlags2          dstAccessMask,
+                                      VkImageSubresourceRange range,
+                                      std::uint32_t           srcQueueFamily,
+                                      std::uint32_t           dstQueueFamily) {
+        for(VkImageMemoryBarrier2& barrier : imageBarriers) {
+            VkImageSubresourceRange& other = barrier.subresourceRange;
+            if(barrier.image != image ||
+               barrier.oldLayout != oldLayout ||
+               barrier.newLayout != newLayout ||
+               barrier.srcStageMask != srcStageMask ||
+               barrier.srcAccessMask != srcAccessMask ||
+               barrier.dstStageMask != dstStageMask ||
+               barrier.dstAccessMask != dstAccessMask ||
+               barrier.srcQueueFamilyIndex != srcQueueFamily ||
+               barrier.dstQueueFamilyIndex != dstQueueFamily ||
+               other.aspectMask != range.aspectMask) {
+                continue;
+            }
+            if(other.baseArrayLayer == range.baseArrayLayer &&
+               other.layerCount == range.layerCount &&
+               other.levelCount != VK_REMAINING_MIP_LEVELS &&
+               other.baseMipLevel + other.levelCount == range.baseMipLevel) {
+                other.levelCount = range.levelCount == VK_REMAINING_MIP_LEVELS ? VK_REMAINING_MIP_LEVELS : other.levelCount + range.levelCount;
+                return *this;
+            }
+            if(other.baseMipLevel == range.baseMipLevel &&
+               other.levelCount == range.levelCount &&
+               other.layerCount != VK_REMAINING_ARRAY_LAYERS &&
+               other.baseArrayLayer + other.layerCount == range.baseArrayLayer) {
+                other.layerCount = range.layerCount == VK_REMAINING_ARRAY_LAYERS ? VK_REMAINING_ARRAY_LAYERS : other.layerCount + range.layerCount;
+                return *this;
             }
         }
 
-		vkWaitForFences(device,
-						1,
-						&fence,
-						VK_TRUE,
-						std::numeric_limits<std::uint64_t>::max());
+        imageBarriers.push_back({
+            .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+            .srcStageMask        = srcStageMask,
+            .srcAccessMask       = srcAccessMask,
+            .dstStageMask        = dstStageMask,
+            .dstAccessMask       = dstAccessMask,
+            .oldLayout           = oldLayout,
+            .newLayout           = newLayout,
+            .srcQueueFamilyIndex = srcQueueFamily,
+            .dstQueueFamilyIndex = dstQueueFamily,
+            .image               = image,
+            .subresourceRange    = range,
+        });
+        return *this;
+    }
 
-		vkDestroyFence(device,
-					   fence,
-					   nullptr);
+    BarrierBatch& BarrierBatch::buffer(VkBuffer              buffer,
+                                       VkPipelineStageFlags2 srcStageMask,
+                                       VkAccessFlags2        srcAccessMask,
+                                       VkPipelineStageFlags2 dstStageMask,
+                                       VkAccessFlags2        dstAccessMask,
+                                       VkDeviceSize          offset,
+                                       VkDeviceSize          size) {
+        for(VkBufferMemoryBarrier2& barrier : bufferBarriers) {
+            if(barrier.buffer != buffer ||
+               barrier.srcStageMask != srcStageMask ||
+               barrier.srcAccessMask != srcAccessMask ||
+               barrier.dstStageMask != dstStageMask ||
+               barrier.dstAccessMask != dstAccessMask) {
+                continue;
+            }
+            if(barrier.size != VK_WHOLE_SIZE && barrier.offset + barrier.size == offset) {
+                barrier.size = size == VK_WHOLE_SIZE ? VK_WHOLE_SIZE : barrier.size + size;
+                return *this;
+            }
+            if(size != VK_WHOLE_SIZE && offset + size == barrier.offset) {
+                barrier.offset = offset;
+                barrier.size   = barrier.size == VK_WHOLE_SIZE ? VK_WHOLE_SIZE : barrier.size + size;
+                return *this;
+            }
+        }
 
-		return retval;
-	}
+        bufferBarriers.push_back({
+            .sType               = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+            .srcStageMask        = srcStageMask,
+            .srcAccessMask       = srcAccessMask,
+            .dstStageMask        = dstStageMask,
+            .dstAccessMask       = dstAccessMask,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .buffer              = buffer,
+            .offset              = offset,
+            .size                = size,
+        });
+        return *this;
+    }
 
-    std::uint32_t getMipLevels(std::uint32_t width, std::uint32_t height) {
-        std::uint32_t retval = 0;
-        while(width != 0 && height != 0) {
-            retval++;
-            width /= 2;
-            height /= 2;
+    BarrierBatch& BarrierBatch::memory(VkPipelineStageFlags2 srcStageMask,
+                                       VkAccessFlags2        srcAccessMask,
+                                       VkPipelineStageFlags2 dstStageMask,
+                                       VkAccessFlags2        dstAccessMask) {
+        // Widening a global barrier only ever adds synchronization
+        memoryBarrier.srcStageMask  |= srcStageMask;
+        memoryBarrier.srcAccessMask |= srcAccessMask;
+        memoryBarrier.dstStageMask  |= dstStageMask;
+        memoryBarrier.dstAccessMask |= dstAccessMask;
+        hasMemoryBarrier             = true;
+        return *this;
+    }
+
+    bool BarrierBatch::isEmpty() const {
+        return imageBarriers.empty() && bufferBarriers.empty() && !hasMemoryBarrier;
+    }
+
+    void BarrierBatch::clear() {
+        imageBarriers.clear();
+        bufferBarriers.clear();
+        memoryBarrier    = { .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2 };
+        hasMemoryBarrier = false;
+    }
+
+    void BarrierBatch::flush(VkCommandBuffer cmd) {
+        KAMSKI_PROFILE();
+        if(isEmpty()) {
+            return;
+        }
+
+        //
+        // Mip runs were merged while adding, fold identical runs of neighbouring layers
+        //
+        for(std::uint64_t i = 0; i < imageBarriers.size(); i++) {
+            VkImageSubresourceRange& range = imageBarriers[i].subresourceRange;
+            for(std::uint64_t j = i + 1; j < imageBarriers.size();) {
+                const VkImageMemoryBarrier2&   other      = imageBarriers[j];
+                const VkImageSubresourceRange& otherRange = other.subresourceRange;
+                if(other.image == imageBarriers[i].image &&
+                   other.oldLayout == imageBarriers[i].oldLayout &&
+                   other.newLayout == imageBarriers[i].newLayout &&
+                   other.srcStageMask == imageBarriers[i].srcStageMask &&
+                   other.srcAccessMask == imageBarriers[i].srcAccessMask &&
+                   other.dstStageMask == imageBarriers[i].dstStageMask &&
+                   other.dstAccessMask == imageBarriers[i].dstAccessMask &&
+                   other.srcQueueFamilyIndex == imageBarriers[i].srcQueueFamilyIndex &&
+                   other.dstQueueFamilyIndex == imageBarriers[i].dstQueueFamilyIndex &&
+                   otherRange.aspectMask == range.aspectMask &&
+                   otherRange.baseMipLevel == range.baseMipLevel &&
+                   otherRange.levelCount == range.levelCount &&
+                   range.layerCount != VK_REMAINING_ARRAY_LAYERS &&
+                   otherRange.baseArrayLayer == range.baseArrayLayer + range.layerCount) {
+                    range.layerCount = otherRange.layerCount == VK_REMAINING_ARRAY_LAYERS ? VK_REMAINING_ARRAY_LAYERS : range.layerCount + otherRange.layerCount;
+                    imageBarriers.erase(imageBarriers.begin() + j);
+                } else {
+                    j++;
+                }
+            }
+        }
+
+        const VkDependencyInfo dependencyInfo = {
+            .sType                    = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+            .memoryBarrierCount       = hasMemoryBarrier ? 1u : 0u,
+            .pMemoryBarriers          = &memoryBarrier,
+            .bufferMemoryBarrierCount = std::uint32_t(bufferBarriers.size()),
+            .pBufferMemoryBarriers    = bufferBarriers.data(),
+            .imageMemoryBarrierCount  = std::uint32_t(imageBarriers.size()),
+            .pImageMemoryBarriers     = imageBarriers.data(),
+        };
+        vkCmdPipelineBarrier2(cmd, &dependencyInfo);
+        clear();
+    }
+
+    //
+    // Workers
+    //
+    static thread_local bool insideWorkerJob = false;
+
+    WorkerPool::WorkerPool() {
+        const std::uint32_t threadCount = std::max(1u, std::thread::hardware_concurrency()) - 1;
+        threads.reserve(threadCount);
+        for(std::uint32_t i = 0; i < threadCount; i++) {
+            threads.emplace_back([this]() {
+                insideWorkerJob = true;
+                for(;;) {
+                    std::function<void()> job;
+                    {
+                        std::unique_lock lock(mutex);
+                        jobReady.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                        if(jobs.empty()) {
+                            return;
+                        }
+                        job = std::move(jobs.front());
+                        jobs.pop_front();
+                    }
+                    job();
+                }
+            });
         }
-        return retval;
     }
 
+    WorkerPool::~WorkerPool() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        jobReady.notify_all();
+        for(std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+
+    std::uint32_t WorkerPool::concurrency() const {
+        return std::uint32_t(threads.size()) + 1;
+    }
+
+    void WorkerPool::parallelFor(std::uint32_t count, const std::function<void(std::uint32_t)>& function) {
+        if(count <= 1 || threads.empty() || insideWorkerJob) {
+            for(std::uint32_t i = 0; i < count; i++) {
+                function(i);
+            }
+            return;
+        }
+
+        // Helpers pull indices until none are left, so a helper that starts late finds nothing to do instead of
+        // holding up the caller. The caller still waits for every helper to retire since they point at this frame
+        std::atomic<std::uint32_t> nextIndex   = 0;
+        const std::uint32_t        helperCount = std::min(count - 1, std::uint32_t(threads.size()));
+        std::uint32_t              helpersLeft = helperCount;
+        std::mutex                 doneMutex;
+        std::condition_variable    done;
+        auto                       drain       = [&]() {
+            for(std::uint32_t i = nextIndex++; i < count; i = nextIndex++) {
+                function(i);
+            }
+        };
+
+        {
+            std::lock_guard lock(mutex);
+            for(std::uint32_t i = 0; i < helperCount; i++) {
+                jobs.emplace_back([&]() {
+                    drain();
+                    std::lock_guard doneLock(doneMutex);
+                    if(--helpersLeft == 0) {
+                        done.notify_one();
+                    }
+                });
+            }
+        }
+        jobReady.notify_all();
+
+        drain();
+        std::unique_lock lock(doneMutex);
+        done.wait(lock, [&]() { return helpersLeft == 0; });
+    }
+
+    WorkerPool& workerPool() {
+        static WorkerPool pool;
+        return pool;
+    }
 }
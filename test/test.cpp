@@ -269,20 +269,14 @@ int main() {
 			}
 			kvk::FrameData& frame = state.frames[currentFrame];
 
-			vkWaitForFences(state.device,
-							1,
-							&frame.inFlightFence,
-							VK_TRUE,
-							std::numeric_limits<std::uint64_t>::max());
+			if(frame.queue) {
+				kvk::waitTimeline(state, *frame.queue, frame.timelineValue);
+			}
 			std::uint32_t imageIndex;
 
-			//
-			// Flush the per-frame deletionQueue
-			//
-			for(auto iter = frame.deletionQueue.rbegin(); iter != frame.deletionQueue.rend(); ++iter) {
-				(*iter)();
+			if(frame.queue) {
+				kvk::retireDestroys(state, kvk::completedTimelineValue(state, *frame.queue));
 			}
-			frame.deletionQueue.clear();
 			frame.descriptors.clearPools(state.device);
 
 
@@ -300,10 +294,6 @@ int main() {
 				ExitProcess(1);
 			}
 
-			vkResetFences(state.device,
-						  1,
-						  &frame.inFlightFence);
-
 			if(kvk::drawScene(frame,
 			                  state,
 							  state.swapchainExtent,
@@ -314,7 +304,7 @@ int main() {
 				ExitProcess(1);
 			}
 
-			currentFrame = (currentFrame + 1) % kvk::MAX_IN_FLIGHT_FRAMES;
+			currentFrame = (currentFrame + 1) % state.framesInFlight;
 		}
 	}).detach();
 